@@ -3,29 +3,279 @@
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/EvaluatedExprVisitor.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Tooling/CompilationDatabase.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Timer.h"
+
+#include <set>
+#include <sstream>
 
 using namespace clang;
 
 #include "Environment.h"
+#include "Fiber.h"
+#include "ForkServer.h"
+#include "Fuzz.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+
+static llvm::cl::OptionCategory InterpreterCategory("ast-interpreter options");
+
+static llvm::cl::list<std::string> Inputs(llvm::cl::Positional,
+   llvm::cl::desc("<program.c | - >..."), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<unsigned long long> MaxSteps("max-steps",
+   llvm::cl::desc("Stop after this many walked statements, loop iterations and calls (0 = unlimited)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<unsigned long long> MaxHeap("max-heap",
+   llvm::cl::desc("Stop when MALLOC'ed bytes still live exceed this (0 = unlimited)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<unsigned> MaxDepth("max-depth",
+   llvm::cl::desc("Stop when the call stack gets deeper than this (0 = unlimited)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<double> Timeout("timeout",
+   llvm::cl::desc("Stop after this many seconds of execution (0 = unlimited)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+
+enum class StatsFormat { None, Json };
+static llvm::cl::opt<StatsFormat> Stats("stats",
+   llvm::cl::desc("Print run statistics for every program"),
+   llvm::cl::values(clEnumValN(StatsFormat::Json, "json", "one JSON record per program")),
+   llvm::cl::init(StatsFormat::None), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> StatsFile("stats-file",
+   llvm::cl::desc("Append the statistics to this file instead of stderr"),
+   llvm::cl::value_desc("path"), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<bool> TimeReport("time-report",
+   llvm::cl::desc("Run clang with -ftime-report and add its timers to the statistics"),
+   llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<bool> Repl("repl",
+   llvm::cl::desc("Read declarations interactively, keeping globals and the heap between runs"),
+   llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<unsigned> JitThreshold("jit-threshold",
+   llvm::cl::desc("Compile a function to native code after this many calls and loop iterations "
+                  "(0 = never, needs a build with ENABLE_NATIVE; ignored with limits, --sanitize or --gc-threshold)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<bool> Walk("walk",
+   llvm::cl::desc("Walk the AST of every function instead of preparing them first"),
+   llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<bool> Sanitize("sanitize",
+   llvm::cl::desc("Check every guest memory access against the bounds of its object and stop "
+                  "on overflows, use after FREE and wild pointers"),
+   llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<unsigned long long> GcThreshold("gc-threshold",
+   llvm::cl::desc("Collect unreachable MALLOC blocks after this many bytes were allocated "
+                  "since the last collection, and before failing --max-heap (0 = never)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<std::string> SnapshotSave("snapshot-save",
+   llvm::cl::desc("After main returns, save the globals and the heap to this file"),
+   llvm::cl::value_desc("path"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> SnapshotLoad("snapshot-load",
+   llvm::cl::desc("Before main runs, map the heap saved in this file and set the globals "
+                  "of the same names"),
+   llvm::cl::value_desc("path"), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::list<std::string> ForkInputs("fork-input",
+   llvm::cl::desc("Run the program once per file of GET input, each in a child forked after "
+                  "parsing and preparation, and print each child's output and exit status"),
+   llvm::cl::value_desc("path"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<unsigned> Jobs("jobs",
+   llvm::cl::desc("Children running at once with --fork-input, worker threads with --throughput "
+                  "and --serve (0 = one per core)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<bool> Throughput("throughput",
+   llvm::cl::desc("Run the programs on worker threads in this one process and report the "
+                  "throughput and the latency percentiles"),
+   llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> Serve("serve",
+   llvm::cl::desc("Run every <name>.c put into this directory on worker threads, with <name>.in "
+                  "as its input, writing <name>.out; stops on SIGINT or SIGTERM"),
+   llvm::cl::value_desc("dir"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<unsigned> MaxPending("max-pending",
+   llvm::cl::desc("Programs waiting for a worker before --throughput and --serve stop taking "
+                  "more (0 = four per worker)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<unsigned> Threads("threads",
+   llvm::cl::desc("Worker threads PARALLEL_FOR spreads its calls over (0 = one per core, "
+                  "1 = run them in order on the calling thread)"),
+   llvm::cl::init(0), llvm::cl::cat(InterpreterCategory));
+
+static llvm::cl::opt<bool> Multiplex("multiplex",
+   llvm::cl::desc("Run all programs on this one thread, switching whenever one waits for GET "
+                  "input; stdin lines \"<n> <value>\" feed program n, \"<n> close\" ends its input"),
+   llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<unsigned long long> YieldSteps("yield-steps",
+   llvm::cl::desc("Steps a --multiplex program runs before the next one gets the thread "
+                  "(0 = switch only at GET)"),
+   llvm::cl::init(100000), llvm::cl::cat(InterpreterCategory));
+
+#ifndef AST_RUNTIME_LIBRARY
+#define AST_RUNTIME_LIBRARY "libast-runtime.a"
+#endif
+
+static llvm::cl::opt<std::string> Aot("aot",
+   llvm::cl::desc("Compile the program to a native executable, or to an object file when "
+                  "the name ends in .o, instead of running it (needs ENABLE_NATIVE)"),
+   llvm::cl::value_desc("output"), llvm::cl::cat(InterpreterCategory));
+static llvm::cl::opt<std::string> Runtime("runtime",
+   llvm::cl::desc("Library with the builtins linked into --aot executables"),
+   llvm::cl::value_desc("path"), llvm::cl::init(AST_RUNTIME_LIBRARY), llvm::cl::cat(InterpreterCategory));
+
+/// Exit status of the whole run, set when any program hits a limit
+static int ExitStatus = 0;
+
+/// The program interpretProgram is running, null outside fuzz builds
+static FuzzRun * FuzzProgram = nullptr;
+/// The job a --throughput or --serve worker is running
+static thread_local Job * ServedJob = nullptr;
+
+static ExecLimits limitsFromOptions() {
+   ExecLimits limits;
+   limits.maxSteps = MaxSteps;
+   limits.maxHeapBytes = MaxHeap;
+   limits.maxDepth = MaxDepth;
+   limits.timeout = Timeout;
+   return limits;
+}
+
+/// Native code does not count steps, check the clock or look at the shadow,
+/// and the collector cannot see its frames, so programs run under limits,
+/// --sanitize or --gc-threshold stay interpreted
+static unsigned jitThreshold() {
+   static bool warned = false;
+   if (JitThreshold && (MaxSteps || MaxHeap || MaxDepth || Timeout > 0 || Sanitize || GcThreshold)) {
+      if (!warned)
+         llvm::errs() << "warning: --jit-threshold is ignored with limits, --sanitize or --gc-threshold\n";
+      warned = true;
+      return 0;
+   }
+   return JitThreshold;
+}
+
+/// Time spent in each phase of one run. The timers live in an llvm::TimerGroup
+/// so that with --time-report they are printed next to clang's own tables.
+struct PhaseTimers {
+   llvm::TimerGroup group;
+   llvm::Timer frontend;
+   llvm::Timer consumer;
+   llvm::Timer init;
+   llvm::Timer prepare;
+   llvm::Timer exec;
+
+   PhaseTimers() : group("interp", "AST interpreter phases"),
+      frontend("frontend", "Clang frontend (driver, parsing and Sema)", group),
+      consumer("consumer", "AST consumer setup", group),
+      init("init", "Global initialization", group),
+      prepare("prepare", "Preparing (functions are lowered on their first call)", group),
+      exec("exec", "Execution", group) {
+   }
+   ~PhaseTimers() {
+      // a group with triggered timers prints itself when it goes away
+      if (!TimeReport)
+         group.clear();
+   }
+
+   static double milliseconds(llvm::Timer &timer) {
+      return timer.getTotalTime().getWallTime() * 1000;
+   }
+};
+
+/// Write one JSON record on a single line, so a stream of them stays greppable
+static void printStats(llvm::raw_ostream &os, llvm::StringRef file, Environment &env,
+                       PhaseTimers &timers) {
+   const RunStats &stats = env.stats();
+   llvm::json::OStream json(os);
+   json.object([&] {
+      json.attribute("file", file);
+      json.attribute("status", env.aborted() ? env.aborted() : "ok");
+      json.attribute("frontend_ms", PhaseTimers::milliseconds(timers.frontend));
+      json.attribute("consumer_ms", PhaseTimers::milliseconds(timers.consumer));
+      json.attribute("init_ms", PhaseTimers::milliseconds(timers.init));
+      json.attribute("prepare_ms", PhaseTimers::milliseconds(timers.prepare));
+      json.attribute("exec_ms", PhaseTimers::milliseconds(timers.exec));
+      json.attribute("statements", (int64_t)stats.statements);
+      json.attribute("loop_iterations", (int64_t)stats.loopIterations);
+      json.attribute("calls", (int64_t)stats.calls);
+      json.attribute("allocations", (int64_t)stats.allocations);
+      json.attribute("frees", (int64_t)stats.frees);
+      json.attribute("allocated_bytes", (int64_t)stats.allocatedBytes);
+      json.attribute("peak_heap_bytes", (int64_t)stats.peakHeapBytes);
+      json.attribute("peak_depth", (int64_t)stats.peakDepth);
+      json.attribute("native_functions", (int64_t)stats.nativeFunctions);
+      json.attribute("native_calls", (int64_t)stats.nativeCalls);
+      json.attribute("functions", (int64_t)stats.functions);
+      json.attribute("reachable_functions", (int64_t)stats.reachableFunctions);
+      json.attribute("prepared_functions", (int64_t)stats.preparedFunctions);
+      json.attribute("pruned_branches", (int64_t)stats.prunedBranches);
+      json.attribute("gc_collections", (int64_t)stats.gcCollections);
+      json.attribute("gc_freed_blocks", (int64_t)stats.gcFreedBlocks);
+      json.attribute("gc_freed_bytes", (int64_t)stats.gcFreedBytes);
+      json.attribute("gc_pause_ms", stats.gcPauseMs);
+      json.attribute("gc_max_pause_ms", stats.gcMaxPauseMs);
+      if (TimeReport) {
+         // every live timer group, clang's -ftime-report ones included, as
+         // "group.timer.wall|user|sys": seconds
+         json.attributeBegin("timers");
+         json.rawValue([&](llvm::raw_ostream &raw) {
+            raw << "{";
+            llvm::TimerGroup::printAllJSONValues(raw, "");
+            raw << "}";
+         });
+         json.attributeEnd();
+      }
+   });
+   os << "\n";
+}
+
+static void emitStats(llvm::StringRef file, Environment &env, PhaseTimers &timers) {
+   if (Stats != StatsFormat::Json)
+      return;
+   if (StatsFile.empty()) {
+      printStats(llvm::errs(), file, env, timers);
+      return;
+   }
+   std::error_code ec;
+   llvm::raw_fd_ostream os(StatsFile, ec, llvm::sys::fs::OF_Append);
+   if (ec) {
+      llvm::errs() << "error: cannot open " << StatsFile << ": " << ec.message() << "\n";
+      return;
+   }
+   printStats(os, file, env, timers);
+}
 
+/// EvaluatedExprVisitor picks the Visit method statically (CRTP), so they are
+/// plain members: virtual would turn every dispatch into an indirect call.
 class InterpreterVisitor : 
    public EvaluatedExprVisitor<InterpreterVisitor> {
 public:
    explicit InterpreterVisitor(const ASTContext &context, Environment * env)
    : EvaluatedExprVisitor(context), mEnv(env) {}
-   virtual ~InterpreterVisitor() {}
+   ~InterpreterVisitor() {}
 
-   virtual void VisitIntegerLiteral(IntegerLiteral * intliteral) {
+   void VisitIntegerLiteral(IntegerLiteral * intliteral) {
       if(mEnv->haveReturn()){
          return;
       } 
       llvm::errs() << "[+] visit IntegerLiteral\n";
       mEnv->intliteral(intliteral);
    }
-   virtual void VisitCharacterLiteral(CharacterLiteral * Character ){
+   void VisitCharacterLiteral(CharacterLiteral * Character ){
       if(mEnv->haveReturn()){
          return;
       } 
@@ -35,19 +285,27 @@ public:
       }
 
    // process BinaryOperator,e.g. assignment, add and etc.
-   virtual void VisitBinaryOperator (BinaryOperator * bop) {
+   void VisitBinaryOperator (BinaryOperator * bop) {
       if(mEnv->haveReturn()){
          return;
       } 
       llvm::errs() << "[+] visit BinaryOperator\n";
 	   //VisitStmt : 分析表达式，分析该节点下所有子树节点，依次进行深度优先遍历的递归调用去获取函数的值，有些子节点比如说VisitIntegerLiteral下不会再有子树，则不需要visit
-      VisitStmt(bop);
+      if (bop->isLogicalOp()) {
+         // the right operand of && and || runs only when the left one
+         // does not decide
+         Visit(bop->getLHS());
+         if (mEnv->shortCircuit(bop))
+            return;
+         Visit(bop->getRHS());
+      } else
+         VisitStmt(bop);
       // llvm::errs() << "[+] visitStmt BinaryOperator done\n";
 	   mEnv->binop(bop);
    }
 
    // process DeclRefExpr, e.g. refered decl expr
-   virtual void VisitDeclRefExpr(DeclRefExpr * expr) {
+   void VisitDeclRefExpr(DeclRefExpr * expr) {
       if(mEnv->haveReturn()){
          return;
       }  
@@ -66,32 +324,29 @@ public:
    // }
 
    // process CallExpr,e.g. function call
-   virtual void VisitCallExpr(CallExpr * call) {
+   void VisitCallExpr(CallExpr * call) {
       if(mEnv->haveReturn()){
          return;
       }  
       llvm::errs() << "[+] visit CallExpr\n";
 	   VisitStmt(call);
-	   mEnv->call(call);
-
-      if (FunctionDecl *callee = call->getDirectCallee()){
-         if ((!callee->getName().equals("GET")) && (!callee->getName().equals("PRINT")) &&
-            (!callee->getName().equals("MALLOC")) && (!callee->getName().equals("FREE"))){
-               Stmt *body=callee->getBody();
-               if(body && isa<CompoundStmt>(body) )
-               {
-                  //visit the function body
-                  Visit(body);
-                  int64_t retvalue = mEnv->getReturn();
-                  mEnv->mStack_pop_back();
-                  mEnv->mStack_bindStmt(call, retvalue);
-               }  
+      // a frame is pushed only for user-defined callees
+	   if (mEnv->call(call)) {
+         FunctionDecl *callee = call->getDirectCallee();
+         Stmt *body=callee->getBody();
+         if(body && isa<CompoundStmt>(body) )
+         {
+            //visit the function body
+            Visit(body);
          }
+         int64_t retvalue = mEnv->getReturn();
+         mEnv->mStack_pop_back();
+         mEnv->mStack_bindStmt(call, retvalue);
       }
 
    }
 
-   virtual void VisitIfStmt(IfStmt *ifstmt) {
+   void VisitIfStmt(IfStmt *ifstmt) {
       if(mEnv->haveReturn()){
          return;
       }   
@@ -118,7 +373,7 @@ public:
    }
    
    //process WhileStmt
-   virtual void VisitWhileStmt(WhileStmt *whilestmt) {
+   void VisitWhileStmt(WhileStmt *whilestmt) {
       if(mEnv->haveReturn()){
          return;
       }  
@@ -132,10 +387,16 @@ public:
       Stmt *body=whilestmt->getBody();
       while(cond)
       {
-        if( body && isa<CompoundStmt>(body) )
+        if(body)
         {
-          VisitStmt(whilestmt->getBody());
+          Visit(body);
         }
+        // a break ends the loop, a continue only the body
+        if(mEnv->leaveLoop())
+          break;
+        mEnv->backedge(whilestmt);
+        if(mEnv->haveReturn())
+          break;
         //update the condition value
         Visit(expr);
         cond=mEnv->getcond(expr);
@@ -144,7 +405,7 @@ public:
 
    //process ForStmt
    //https://clang.llvm.org/doxygen/Stmt_8h_source.html#l2451
-   virtual void VisitForStmt(ForStmt *forstmt){
+   void VisitForStmt(ForStmt *forstmt){
       // llvm::errs() << "[+] visit VisitForStmt\n";
       if(mEnv->haveReturn()){
          return;
@@ -153,17 +414,116 @@ public:
       if(Stmt *init = forstmt->getInit()){
          Visit(init);
       }
-      for(; mEnv->Expr_GetVal(forstmt->getCond()); Visit(forstmt->getInc())){ //getCond 返回值是bool，而不是void，不能使用Visit，只能直接利用expr对该语句进行解析from ‘void’ to ‘bool’
-         Stmt *body=forstmt->getBody();
-         if(body && isa<CompoundStmt>(body)){
-            Visit(forstmt->getBody());
+      // a missing condition is true; the condition visits its ++ and &&
+      // like any other expression
+      Expr *cond = forstmt->getCond();
+      for (;;) {
+         if (cond) {
+            Visit(cond);
+            if (!mEnv->getcond(cond))
+               break;
          }
-            
+         if (Stmt *body = forstmt->getBody())
+            Visit(body);
+         if (mEnv->leaveLoop())
+            break;
+         mEnv->backedge(forstmt);
+         if(mEnv->haveReturn())
+            break;
+         if (Stmt *inc = forstmt->getInc())
+            Visit(inc);
+      }
+   }
+
+   void VisitDoStmt(DoStmt *dostmt) {
+      if(mEnv->haveReturn()){
+         return;
+      }
+      llvm::errs() << "[+] visit DoStmt\n";
+      Expr *cond = dostmt->getCond();
+      for (;;) {
+         Visit(dostmt->getBody());
+         if (mEnv->leaveLoop())
+            break;
+         Visit(cond);
+         if (!mEnv->getcond(cond))
+            break;
+         mEnv->backedge(dostmt);
+         if(mEnv->haveReturn())
+            break;
+      }
+   }
+
+   // the body runs from the label that matches to its end or to a break;
+   // labels nested deeper than the body's statements are not supported,
+   // prepared code leaves such functions to the walker
+   void VisitSwitchStmt(SwitchStmt *sw) {
+      if(mEnv->haveReturn()){
+         return;
+      }
+      llvm::errs() << "[+] visit SwitchStmt\n";
+      Visit(sw->getCond());
+      SwitchCase *target = mEnv->switchCase(sw);
+      if (!target)
+         return;
+      std::vector<Stmt *> body(1, sw->getBody());
+      if (CompoundStmt *block = dyn_cast<CompoundStmt>(sw->getBody()))
+         body.assign(block->body_begin(), block->body_end());
+      bool running = false;
+      for (Stmt *stmt : body) {
+         for (Stmt *label = stmt; !running && isa<SwitchCase>(label); label = cast<SwitchCase>(label)->getSubStmt())
+            running = label == target;
+         if (!running) {
+            // what the label jumps past is still declared
+            if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt))
+               mEnv->decl(declstmt, false);
+            continue;
+         }
+         if (mEnv->haveReturn())
+            break;
+         mEnv->countStmt();
+         mEnv->cover(stmt->getStmtClass());
+         Visit(stmt);
+      }
+      if (!running)
+         mEnv->fail("unsupported", "case label inside a nested statement", target);
+      mEnv->leaveSwitch();
+   }
+
+   // a label only marks where a switch starts
+   void VisitCaseStmt(CaseStmt *label) {
+      Visit(label->getSubStmt());
+   }
+   void VisitDefaultStmt(DefaultStmt *label) {
+      Visit(label->getSubStmt());
+   }
+
+   void VisitBreakStmt(BreakStmt *stmt) {
+      if(mEnv->haveReturn()){
+         return;
+      }
+      mEnv->jump(stmt);
+   }
+   void VisitContinueStmt(ContinueStmt *stmt) {
+      if(mEnv->haveReturn()){
+         return;
+      }
+      mEnv->jump(stmt);
+   }
+
+   // count statements as they run, and stop at a return or an exceeded limit
+   void VisitCompoundStmt(CompoundStmt *cs) {
+      for (Stmt *stmt : cs->body()) {
+         if (mEnv->haveReturn())
+            return;
+         mEnv->countStmt();
+         mEnv->cover(stmt->getStmtClass());
+         Visit(stmt);
       }
    }
 
    // process return stmt.
-   virtual void VisitReturnStmt(ReturnStmt *returnStmt)
+   void VisitReturnStmt(ReturnStmt *returnStmt)
    {
       //isCurFunctionReturn
       if(mEnv->haveReturn()){
@@ -175,7 +535,7 @@ public:
    }
 
    // process DeclStmt,e.g. int a; int a=c+d; and etc.
-   virtual void VisitDeclStmt(DeclStmt * declstmt) {
+   void VisitDeclStmt(DeclStmt * declstmt) {
       if(mEnv->haveReturn()){
          return;
       }  
@@ -184,7 +544,7 @@ public:
    }
 
    //process UnaryExprOrTypeTraitExpr, e.g. sizeof and etc.
-   virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *uop)
+   void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *uop)
    {
       if(mEnv->haveReturn()){
          return;
@@ -194,7 +554,7 @@ public:
       mEnv->unarysizeof(uop);
    }
 
-   virtual void VisitParenExpr(ParenExpr * pexpr) {
+   void VisitParenExpr(ParenExpr * pexpr) {
       if(mEnv->haveReturn()){
          return;
       }
@@ -204,7 +564,7 @@ public:
    }
 
    //process UnaryOperator, e.g. -, * and etc.
-   virtual void VisitUnaryOperator (UnaryOperator * uop) {
+   void VisitUnaryOperator (UnaryOperator * uop) {
       if(mEnv->haveReturn()){
          return;
       }  
@@ -213,7 +573,7 @@ public:
       mEnv->unaryop(uop);
    }
    
-   virtual void VisitCastExpr(CastExpr * expr) {
+   void VisitCastExpr(CastExpr * expr) {
       if(mEnv->haveReturn()){
          return;
       }  
@@ -222,11 +582,20 @@ public:
 	   mEnv->cast(expr);
    }
 
-   virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *ase) {
+   void VisitArraySubscriptExpr(ArraySubscriptExpr *ase) {
 	   VisitStmt(ase);
 	   mEnv->arrayexpr(ase);
    }
 
+   // process MemberExpr, e.g. s.x and p->next
+   void VisitMemberExpr(MemberExpr *member) {
+      if(mEnv->haveReturn()){
+         return;
+      }
+      VisitStmt(member);
+      mEnv->memberexpr(member);
+   }
+
    
    // process ArraySubscriptExpr, e.g. int [2]
    // virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *arrayexpr)
@@ -246,34 +615,529 @@ private:
 
 class InterpreterConsumer : public ASTConsumer {
 public:
-   explicit InterpreterConsumer(const ASTContext& context) : mEnv(),
-   	   mVisitor(context, &mEnv) {
+   explicit InterpreterConsumer(const ASTContext& context, llvm::StringRef file,
+                                PhaseTimers &timers) : mEnv(),
+   	   mVisitor(context, &mEnv), mFile(file.str()), mTimers(timers) {
+      mEnv.setLimits(limitsFromOptions());
+      mEnv.setJitThreshold(jitThreshold());
+      mEnv.setSanitize(Sanitize);
+      mEnv.setGcThreshold(GcThreshold);
+      mEnv.setThreads(Threads);
+      mEnv.setPrepare(!Walk);
+      mEnv.setWalker([this](Stmt * body) { mVisitor.Visit(body); });
+      if (!SnapshotSave.empty() || !SnapshotLoad.empty())
+         mArena = mEnv.heap().useArena(mError);
    }
    virtual ~InterpreterConsumer() {}
 
    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+	   mTimers.frontend.stopTimer();
 	   TranslationUnitDecl * decl = Context.getTranslationUnitDecl();
+	   mTimers.init.startTimer();
 	   mEnv.init(decl);
+	   if (mArena && !SnapshotLoad.empty() && !loadSnapshot(mEnv, SnapshotLoad, mError))
+	      mArena = false;
+	   mTimers.init.stopTimer();
+	   if ((!SnapshotSave.empty() || !SnapshotLoad.empty()) && !mArena) {
+	      llvm::errs() << "error: " << mError << "\n";
+	      ExitStatus = 1;
+	      return;
+	   }
+	   mTimers.prepare.startTimer();
+	   mEnv.prepare();
+	   // paid once in the parent, and outside the timed run of a job
+	   if (ServedJob || !ForkInputs.empty())
+	      mEnv.prepareReachable();
+	   mTimers.prepare.stopTimer();
+
+	   if (FuzzProgram) {
+	      mEnv.setCoverage(FuzzProgram->coverage, FuzzProgram->coverageSize);
+	      FuzzProgram->finished = executeCaptured(FuzzProgram->input, FuzzProgram->output);
+	      return;
+	   }
+	   if (ServedJob) {
+	      ServedJob->status = executeCaptured(ServedJob->input, ServedJob->output) ? 0 : 1;
+	      emitStats(mFile, mEnv, mTimers);
+	      return;
+	   }
 
-	   FunctionDecl * entry = mEnv.getEntry();
-	   mVisitor.VisitStmt(entry->getBody());
+	   if (!ForkInputs.empty()) {
+	      bool ok = serveForked(ForkInputs, Jobs, [this](std::istream &in, std::ostream &out) {
+	         mEnv.setStreams(&in, &out);
+	         mTimers.exec.startTimer();
+	         mEnv.execute();
+	         mTimers.exec.stopTimer();
+	         emitStats(mFile, mEnv, mTimers);
+	         return mEnv.aborted() ? 1 : 0;
+	      }, llvm::outs());
+	      if (!ok)
+	         ExitStatus = 1;
+	      return;
+	   }
+
+	   mTimers.exec.startTimer();
+	   mEnv.execute();
+	   mTimers.exec.stopTimer();
+	   if (mEnv.aborted())
+	      ExitStatus = 1;
+	   else if (!SnapshotSave.empty() && !saveSnapshot(mEnv, SnapshotSave, mError)) {
+	      llvm::errs() << "error: " << mError << "\n";
+	      ExitStatus = 1;
+	   }
+	   emitStats(mFile, mEnv, mTimers);
    }
 private:
+   /// Run with GET reading input and PRINT writing to output; false when
+   /// the program did not finish
+   bool executeCaptured(const std::string &input, std::string &output) {
+      std::istringstream in(input);
+      std::ostringstream out;
+      mEnv.setStreams(&in, &out);
+      mTimers.exec.startTimer();
+      mEnv.execute();
+      mTimers.exec.stopTimer();
+      output = out.str();
+      return !mEnv.aborted();
+   }
+
    Environment mEnv;
+   /// The heap is in arena mode for snapshots, and they went fine so far
+   bool mArena = false;
+   std::string mError;
    InterpreterVisitor mVisitor;
+   std::string mFile;
+   PhaseTimers &mTimers;
 };
 
 class InterpreterClassAction : public ASTFrontendAction {
 public: 
+   // created right before clang runs on the file, so the frontend timer
+   // starts here and stops when the consumer gets the translation unit
+   InterpreterClassAction() {
+      mTimers.frontend.startTimer();
+   }
+
    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
       clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-      return std::unique_ptr<clang::ASTConsumer>(
-         new InterpreterConsumer(Compiler.getASTContext()));
+      mTimers.frontend.stopTimer();
+      std::unique_ptr<clang::ASTConsumer> consumer;
+      {
+         llvm::TimeRegion region(mTimers.consumer);
+         consumer.reset(new InterpreterConsumer(Compiler.getASTContext(), InFile, mTimers));
+      }
+      // parsing runs after the consumer exists
+      mTimers.frontend.startTimer();
+      return consumer;
+   }
+private:
+   PhaseTimers mTimers;
+};
+
+/// Flags every program is parsed with. C++ like runToolOnCode did (it names
+/// its input "input.cc"), so the ASTs the interpreter walks keep the same
+/// shape for .c files.
+static std::vector<std::string> compileFlags() {
+   std::vector<std::string> flags = {"-xc++"};
+   if (TimeReport)
+      flags.push_back("-ftime-report");
+   return flags;
+}
+
+/// Interactive session. Top-level declarations are typed in chunks ended by an
+/// empty line and accumulate into one program; ":run" runs its main. A chunk
+/// defining a name an older chunk defines replaces that chunk. The program is
+/// re-parsed after each edit and kept until the next one, while the
+/// Environment stays alive, carrying the values of globals over by name and
+/// keeping the guest heap.
+class ReplSession {
+public:
+   ReplSession() {
+      mEnv.setLimits(limitsFromOptions());
+      mEnv.setJitThreshold(jitThreshold());
+      mEnv.setSanitize(Sanitize);
+      mEnv.setGcThreshold(GcThreshold);
+      mEnv.setThreads(Threads);
+      mEnv.setPrepare(!Walk);
+   }
+
+   bool add(const std::string &text) {
+      std::vector<Chunk> chunks = mChunks;
+      chunks.push_back(Chunk{text, {}});
+      unsigned begin = 0;
+      std::string code = source(chunks, &begin);
+
+      // find out what the new chunk defines; redefinitions are errors here
+      IgnoringDiagConsumer ignore;
+      std::unique_ptr<ASTUnit> probe = tooling::buildASTFromCodeWithArgs(code, compileFlags(),
+         "repl.cc", "ast-interpreter", std::make_shared<PCHContainerOperations>(),
+         tooling::getClangStripDependencyFileAdjuster(), tooling::FileContentMappings(), &ignore);
+      if (!probe)
+         return false;
+      std::set<std::string> names = definedAfter(*probe, begin);
+      chunks.pop_back();
+      chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [&](const Chunk &chunk) {
+         for (const std::string &name : chunk.names)
+            if (names.count(name))
+               return true;
+         return false;
+      }), chunks.end());
+      chunks.push_back(Chunk{text, names});
+
+      std::unique_ptr<ASTUnit> ast = tooling::buildASTFromCodeWithArgs(source(chunks, nullptr),
+         compileFlags(), "repl.cc", "ast-interpreter");
+      if (!ast || ast->getDiagnostics().hasErrorOccurred())
+         return false;
+      mChunks = chunks;
+
+      std::map<std::string, SavedGlobal> globals;
+      if (mAST)
+         globals = mEnv.saveGlobals();
+      mEnv.init(ast->getASTContext().getTranslationUnitDecl());
+      mEnv.restoreGlobals(globals);
+      mEnv.prepare();
+      mAST = std::move(ast);
+      return true;
+   }
+
+   void run() {
+      FunctionDecl * entry = mAST ? mEnv.getEntry() : nullptr;
+      if (!entry || !entry->hasBody()) {
+         llvm::errs() << "error: no main to run\n";
+         return;
+      }
+      InterpreterVisitor visitor(mAST->getASTContext(), &mEnv);
+      mEnv.setWalker([&visitor](Stmt * body) { visitor.Visit(body); });
+      mEnv.startRun();
+      mEnv.execute();
+   }
+
+   void reset() {
+      mChunks.clear();
+      mAST.reset();
+   }
+
+private:
+   struct Chunk {
+      std::string text;
+      /// names the chunk defines
+      std::set<std::string> names;
+   };
+
+   /// The program text for chunks, with the builtins declared up front.
+   /// begin receives the offset of the last chunk.
+   static std::string source(const std::vector<Chunk> &chunks, unsigned *begin) {
+      std::string code = "extern int GET();\nextern void * MALLOC(int);\n"
+                         "extern void FREE(void *);\nextern void PRINT(int);\n"
+                         "extern void PARALLEL_FOR(int, int, void (*)(int));\n";
+      for (const Chunk &chunk : chunks) {
+         if (begin)
+            *begin = code.size();
+         code += chunk.text;
+         code += "\n";
+      }
+      return code;
+   }
+
+   /// Names of the variables and function definitions at or after offset begin
+   static std::set<std::string> definedAfter(ASTUnit &unit, unsigned begin) {
+      SourceManager &sm = unit.getSourceManager();
+      std::set<std::string> names;
+      for (Decl * decl : unit.getASTContext().getTranslationUnitDecl()->decls()) {
+         NamedDecl * named = dyn_cast<NamedDecl>(decl);
+         if (!named || !named->getIdentifier())
+            continue;
+         if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(decl))
+            if (!fdecl->isThisDeclarationADefinition())
+               continue;
+         SourceLocation loc = sm.getExpansionLoc(decl->getLocation());
+         if (sm.getFileID(loc) == sm.getMainFileID() && sm.getFileOffset(loc) >= begin)
+            names.insert(named->getNameAsString());
+      }
+      return names;
+   }
+
+   std::vector<Chunk> mChunks;
+   std::unique_ptr<ASTUnit> mAST;
+   Environment mEnv;
+};
+
+/// Files named on the command line are loaded as the first chunks, then the
+/// session reads stdin: ":run", ":reset", ":quit", or a chunk ended by an
+/// empty line.
+static int runRepl() {
+   ReplSession session;
+   for (const std::string &input : Inputs) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> file = llvm::MemoryBuffer::getFile(input);
+      if (!file) {
+         llvm::errs() << "error: cannot read " << input << ": " << file.getError().message() << "\n";
+         return 1;
+      }
+      session.add((*file)->getBuffer().str());
+   }
+
+   std::string chunk, line;
+   llvm::errs() << "ast> ";
+   while (std::getline(std::cin, line)) {
+      if (chunk.empty() && line == ":quit")
+         return 0;
+      if (chunk.empty() && line == ":run")
+         session.run();
+      else if (chunk.empty() && line == ":reset")
+         session.reset();
+      else if (!line.empty())
+         chunk += line + "\n";
+      else if (!chunk.empty()) {
+         session.add(chunk);
+         chunk.clear();
+      }
+      llvm::errs() << (chunk.empty() ? "ast> " : "...> ");
    }
+   if (!chunk.empty())
+      session.add(chunk);
+   return 0;
+}
+
+/// Runs a --throughput or --serve job on the calling worker. Every job gets
+/// its own CompilerInstance and Environment, so nothing a program leaves in
+/// the heap or in globals reaches the next one on the same thread.
+static void runJob(Job &job) {
+   ServedJob = &job;
+   bool parsed = tooling::runToolOnCodeWithArgs(std::make_unique<InterpreterClassAction>(),
+      job.code, compileFlags(), job.name, "ast-interpreter");
+   ServedJob = nullptr;
+   if (!parsed)
+      job.status = 1;
+}
+
+#ifdef AST_INTERPRETER_FUZZ
+void interpretProgram(FuzzRun &run) {
+   Walk = run.walk;
+   MaxSteps = run.maxSteps;
+   MaxDepth = run.maxDepth;
+   run.output.clear();
+   run.finished = false;
+   FuzzProgram = &run;
+   bool parsed = tooling::runToolOnCodeWithArgs(std::make_unique<InterpreterClassAction>(),
+      run.code, compileFlags(), "input.cc", "ast-interpreter");
+   FuzzProgram = nullptr;
+   // clang hands over the translation unit even when it has errors
+   if (!parsed)
+      run.finished = false;
+}
+#else
+/// One program of --multiplex: its AST, its Environment and the fiber it
+/// runs on. GET takes values from inputs, and suspends while there are none
+/// and the input is not closed.
+struct GuestTask {
+   std::string name;
+   std::unique_ptr<ASTUnit> ast;
+   Environment env;
+   std::unique_ptr<InterpreterVisitor> visitor;
+   std::unique_ptr<Fiber> fiber;
+   std::deque<int64_t> inputs;
+   bool closed = false;
+   /// Suspended in GET, rather than out of steps
+   bool waiting = false;
+   std::ostringstream out;
 };
 
+/// Print what task n's PRINTs wrote since the last time, "[<n>] " before
+/// every line
+static void flushOutput(unsigned n, GuestTask &task) {
+   std::string text = task.out.str();
+   task.out.str("");
+   llvm::StringRef rest(text);
+   while (!rest.empty()) {
+      std::pair<llvm::StringRef, llvm::StringRef> line = rest.split('\n');
+      llvm::outs() << "[" << n << "] " << line.first << "\n";
+      rest = line.second;
+   }
+}
+
+/// Every input is its own program and all of them share this thread, each
+/// on a fiber that gives the thread back when GET has nothing to read or
+/// --yield-steps ran out. Runnable programs take turns; once all of them
+/// wait for input, the next stdin line is read: "<n> <value>" feeds program
+/// n, "<n> close" makes its GETs return 0 from then on, as the end of stdin
+/// does for all of them.
+static int runMultiplexed() {
+   int status = 0;
+   std::vector<std::unique_ptr<GuestTask>> tasks;
+   std::deque<unsigned> ready;
+   for (const std::string &input : Inputs) {
+      std::unique_ptr<GuestTask> task(new GuestTask);
+      task->name = input;
+      tasks.push_back(std::move(task));
+      GuestTask * t = tasks.back().get();
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> file = llvm::MemoryBuffer::getFile(input);
+      if (!file) {
+         llvm::errs() << "error: cannot read " << input << ": " << file.getError().message() << "\n";
+         tasks.back().reset();
+         status = 1;
+         continue;
+      }
+      t->ast = tooling::buildASTFromCodeWithArgs((*file)->getBuffer(), compileFlags(), input, "ast-interpreter");
+      if (!t->ast || t->ast->getDiagnostics().hasErrorOccurred()) {
+         tasks.back().reset();
+         status = 1;
+         continue;
+      }
+      t->visitor.reset(new InterpreterVisitor(t->ast->getASTContext(), &t->env));
+      t->env.setLimits(limitsFromOptions());
+      t->env.setJitThreshold(jitThreshold());
+      t->env.setSanitize(Sanitize);
+      t->env.setGcThreshold(GcThreshold);
+      t->env.setThreads(Threads);
+      t->env.setPrepare(!Walk);
+      t->env.setWalker([t](Stmt * body) { t->visitor->Visit(body); });
+      t->env.setStreams(&std::cin, &t->out);
+      t->env.setInput([t]() -> int64_t {
+         while (t->inputs.empty() && !t->closed) {
+            t->waiting = true;
+            t->fiber->suspend();
+         }
+         if (t->inputs.empty())
+            return 0;
+         int64_t val = t->inputs.front();
+         t->inputs.pop_front();
+         return val;
+      });
+      t->env.setYield(YieldSteps, [t]() { t->fiber->suspend(); });
+      t->fiber.reset(new Fiber([t]() {
+         t->env.init(t->ast->getASTContext().getTranslationUnitDecl());
+         t->env.prepare();
+         t->env.execute();
+      }));
+      ready.push_back(tasks.size() - 1);
+   }
+
+   size_t live = ready.size();
+   std::string line;
+   while (live) {
+      while (!ready.empty()) {
+         unsigned n = ready.front();
+         ready.pop_front();
+         GuestTask &task = *tasks[n];
+         task.waiting = false;
+         bool running = task.fiber->resume();
+         flushOutput(n, task);
+         if (running) {
+            if (!task.waiting)
+               ready.push_back(n);
+            continue;
+         }
+         --live;
+         const char * result = !task.fiber->done() ? "no stack" : task.env.aborted() ? task.env.aborted() : "ok";
+         if (strcmp(result, "ok"))
+            status = 1;
+         llvm::outs() << "== [" << n << "] " << task.name << ": " << result << "\n";
+         // the AST and both engines' memory go with the task
+         tasks[n].reset();
+      }
+      if (!live)
+         break;
+
+      // every program left waits for input
+      llvm::outs().flush();
+      bool eof = !std::getline(std::cin, line);
+      std::istringstream fields(line);
+      unsigned n = 0;
+      std::string value;
+      if (!eof && (!(fields >> n >> value) || n >= tasks.size() || !tasks[n])) {
+         llvm::errs() << "error: expected \"<program> <value>\" or \"<program> close\" for a "
+                         "running program, got \"" << line << "\"\n";
+         continue;
+      }
+      for (unsigned i = 0; i < tasks.size(); ++i) {
+         GuestTask * task = tasks[i].get();
+         if (!task || (!eof && i != n))
+            continue;
+         if (eof || value == "close")
+            task->closed = true;
+         else
+            task->inputs.push_back(strtoll(value.c_str(), nullptr, 10));
+         if (task->waiting) {
+            task->waiting = false;
+            ready.push_back(i);
+         }
+      }
+   }
+   return status;
+}
+
 int main (int argc, char ** argv) {
-   if (argc > 1) {
-      clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction), argv[1]);
+   llvm::cl::HideUnrelatedOptions(InterpreterCategory);
+   llvm::cl::ParseCommandLineOptions(argc, argv, "interpreter for a small subset of C\n");
+   if (Repl)
+      return runRepl();
+   if (Multiplex)
+      return runMultiplexed();
+   if (!Aot.empty()) {
+      if (Inputs.size() != 1) {
+         llvm::errs() << "error: --aot takes exactly one program\n";
+         return 1;
+      }
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> file = llvm::MemoryBuffer::getFileOrSTDIN(Inputs[0]);
+      if (!file) {
+         llvm::errs() << "error: cannot read " << Inputs[0] << ": " << file.getError().message() << "\n";
+         return 1;
+      }
+      return compileProgram((*file)->getBuffer().str(), Aot, Runtime) ? 0 : 1;
+   }
+   if (Throughput || !Serve.empty()) {
+      // the snapshot arena sits at one fixed address, and workers are not
+      // forked
+      if (!SnapshotSave.empty() || !SnapshotLoad.empty() || !ForkInputs.empty()) {
+         llvm::errs() << "error: --throughput and --serve do not take snapshot options or --fork-input\n";
+         return 1;
+      }
+      unsigned workers = Jobs ? Jobs : std::max(1u, std::thread::hardware_concurrency());
+      size_t pending = MaxPending ? MaxPending : 4 * workers;
+      if (!Serve.empty())
+         return serveDirectory(Serve, workers, pending, runJob, llvm::errs()) ? 0 : 1;
+      if (!Inputs.empty())
+         return runThroughput(Inputs, workers, pending, runJob, llvm::outs()) ? 0 : 1;
    }
+   if (Inputs.empty()) {
+      llvm::cl::PrintHelpMessage();
+      return 1;
+   }
+
+   // Every input is interpreted as its own translation unit. Files on disk are
+   // read by clang's FileManager (large files are mmap'ed), while stdin and
+   // programs passed inline on the command line are mapped as virtual buffers.
+   std::vector<std::string> paths;
+   std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+   std::vector<std::pair<std::string, llvm::StringRef>> mapped;
+   for (unsigned i = 0; i < Inputs.size(); ++i) {
+      const std::string &input = Inputs[i];
+      std::unique_ptr<llvm::MemoryBuffer> buffer;
+      if (input == "-") {
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> in = llvm::MemoryBuffer::getSTDIN();
+         if (!in) {
+            llvm::errs() << "error: cannot read stdin: " << in.getError().message() << "\n";
+            return 1;
+         }
+         buffer = std::move(*in);
+      } else if (!llvm::sys::fs::exists(input) && input.find('\n') != std::string::npos) {
+         // The old calling convention: the whole program text as one argument.
+         buffer = llvm::MemoryBuffer::getMemBuffer(input, "", false);
+      } else {
+         paths.push_back(input);
+         continue;
+      }
+      llvm::SmallString<128> name(input == "-" ? "<stdin>.c" : "<argv" + std::to_string(i) + ">.c");
+      llvm::sys::fs::make_absolute(name);
+      paths.push_back(name.str().str());
+      mapped.emplace_back(name.str().str(), buffer->getBuffer());
+      buffers.push_back(std::move(buffer));
+   }
+
+   tooling::FixedCompilationDatabase compilations(".", compileFlags());
+   tooling::ClangTool tool(compilations, paths);
+   for (auto &file : mapped)
+      tool.mapVirtualFile(file.first, file.second);
+   int status = tool.run(tooling::newFrontendActionFactory<InterpreterClassAction>().get());
+   return status ? status : ExitStatus;
 }
+#endif
@@ -0,0 +1,143 @@
+//==--- Bytecode.h - Prepared form of the interpreted functions ------------===//
+//===----------------------------------------------------------------------===//
+// Functions are lowered on their first call to a flat array of instructions
+// working on numbered 64-bit slots. Every instruction names a kernel
+// specialized for its operator and operand types (see Kernels.h), so running
+// it is one indirect jump with no type tests. Functions that use
+// something the lowering does not know stay with the AST walker; both sides
+// call each other through Environment.
+
+#ifndef AST_INTERPRETER_BYTECODE_H
+#define AST_INTERPRETER_BYTECODE_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace clang {
+class ASTContext;
+class FunctionDecl;
+class Stmt;
+}
+
+class Environment;
+struct GcRoots;
+
+/// dst, a and b are slots of the current frame. imm holds a constant operand,
+/// a size, a declaration or the target of a jump, depending on the kernel.
+/// 32 bytes, two to a cache line; the statement an instruction came from is
+/// kept aside in Code::sources.
+struct Insn {
+	/// Address of the kernel's code in the threaded dispatch loop
+	const void * label;
+	/// Opcode from Kernels.h
+	uint32_t op;
+	int32_t dst;
+	int32_t a;
+	int32_t b;
+	int64_t imm;
+};
+
+/// The labels of a switch. Targets are instructions, held like a jump's imm.
+struct SwitchTable {
+	/// Dense tables hold the target of value in targets[value - low]
+	int64_t low = 0;
+	/// Sparse ones the target of keys[i], sorted, in targets[i]
+	std::vector<int64_t> keys;
+	std::vector<int64_t> targets;
+	/// default, or the end of the switch
+	int64_t otherwise = 0;
+};
+
+/// One prepared function
+struct Code {
+	clang::FunctionDecl * func;
+	std::vector<Insn> insns;
+	/// For error messages and limits, one per instruction
+	std::vector<clang::Stmt *> sources;
+	/// Parameters arrive in slots 0..numParams-1
+	unsigned numParams = 0;
+	unsigned numSlots = 0;
+	/// Local arrays, laid out at fixed offsets of the frame's arena block
+	unsigned frameBytes = 0;
+	/// Offset and size of each of them, for the shadow under --sanitize
+	std::vector<std::pair<unsigned, unsigned>> objects;
+	/// Jump tables of the switches
+	std::vector<std::unique_ptr<SwitchTable>> tables;
+};
+
+/// Lower the definition func, or return null and say why in why
+std::unique_ptr<Code> lowerFunction(clang::FunctionDecl * func, Environment &env, std::string &why);
+/// Once code is lowered, bind its calls to the callees prepared so far and
+/// to the walker for those that cannot be
+void linkCalls(Code &code, Environment &env);
+
+/// Runs prepared code. Calls between prepared functions stay in one loop with
+/// an explicit frame stack; only calls into the AST walker recurse.
+///
+/// The loop jumps straight from one kernel to the next through the label
+/// stored in each instruction (GCC and Clang labels-as-values). Builds with
+/// AST_DISPATCH_SWITCH, or with other compilers, use a switch on the opcode.
+class Machine {
+public:
+	struct Frame {
+		const Code * code;
+		/// Where the caller continues, and the caller slot taking the result
+		const Insn * ret;
+		int32_t dst;
+		int64_t * regs;
+		char * arena;
+	};
+
+	explicit Machine(Environment &env);
+
+	/// Run code to its return. Reentrant: the walker can call back in.
+	int64_t run(const Code * code, const int64_t * args, unsigned argc);
+	/// Fill in the labels of code's instructions, once they are final
+	void thread(Code &code);
+
+	int64_t * regs() { return mRegs; }
+	char * arena() { return mFrames.back().arena; }
+	clang::FunctionDecl * function() { return mFrames.back().code->func; }
+	/// The statement ip, an instruction of the current frame, came from
+	clang::Stmt * source(const Insn * ip) {
+		const Code * code = mFrames.back().code;
+		return code->sources[ip - code->insns.data()];
+	}
+	Environment &env() { return mEnv; }
+	unsigned depth() { return mFrames.size(); }
+
+	/// Enter code with its arguments; null when the stacks are exhausted
+	const Insn * push(const Code * code, const int64_t * args, unsigned argc,
+	                  int32_t dst, const Insn * ret);
+	/// Leave the current frame with value
+	const Insn * pop(int64_t value);
+	/// Drop the frames of the current run after the program stopped
+	const Insn * unwind();
+	/// The live slots and frame arenas, for the garbage collector
+	void addRoots(GcRoots &roots);
+
+private:
+	/// Executes from ip until it reaches mHalt; with a null ip it only
+	/// publishes the label table
+	void dispatch(const Insn * ip);
+
+	Environment &mEnv;
+	std::unique_ptr<int64_t[]> mSlots;
+	std::unique_ptr<char[]> mArena;
+	int64_t * mSlotTop;
+	int64_t * mSlotEnd;
+	char * mArenaTop;
+	char * mArenaEnd;
+	int64_t * mRegs = nullptr;
+	std::vector<Frame> mFrames;
+	/// Frames below this belong to an outer run
+	size_t mBase = 0;
+	int64_t mResult = 0;
+	/// Where a run's outermost return and unwind continue: out of the loop
+	Insn mHalt;
+	const void * const * mLabels = nullptr;
+};
+
+#endif
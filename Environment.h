@@ -1,31 +1,90 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
 //===----------------------------------------------------------------------===//
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/Decl.h"
+#include "clang/AST/RecordLayout.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Analysis/CallGraph.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringExtras.h"
+
+#include "Bytecode.h"
+#include "Native.h"
+#include "Shadow.h"
 
 using namespace clang;
 using namespace std;
 
+// older C libraries; older kernels take it as a hint, which Heap checks
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/// Where a garbage collection looks for pointers to MALLOC blocks: single
+/// values, and memory ranges read as aligned 64-bit words
+struct GcRoots {
+	std::vector<int64_t> values;
+	std::vector<std::pair<int64_t, int64_t>> ranges;
+};
+
+/// A global's bytes and the address they were at, see
+/// Environment::restoreGlobals
+struct SavedGlobal {
+	int64_t addr;
+	std::string bytes;
+};
+
 class StackFrame {
    	/// StackFrame maps Variable Declaration to Value
    	/// Which are either integer or addresses (also represented using an Integer value)
    	std::map<Decl*, int64_t> mVars;
    	std::map<Stmt*, int64_t> mExprs;
+	/// Local arrays and address-taken locals with their sizes, released
+	/// with the frame
+	std::vector<std::pair<std::shared_ptr<char>, int64_t>> mStorage;
    	/// The current stmt
    	Stmt * mPC;
+	/// The function running in this frame
+	FunctionDecl * mFunc;
 	
 public:
 
-   	StackFrame() : mVars(), mExprs(), mPC() {
+   	StackFrame() : mVars(), mExprs(), mStorage(), mPC(), mFunc() {
    	}
 
+	/// Zeroed memory that lives as long as the frame. With a shadow the
+	/// object gets redzones, and is poisoned again when the frame goes.
+	int64_t allocate(int64_t size, const std::shared_ptr<Shadow> &shadow = nullptr) {
+		int64_t pad = shadow ? Shadow::Redzone : 0;
+		int64_t bytes = (size > 0 ? size : 1) + 2 * pad;
+		char * block = new char[bytes]();
+		mStorage.push_back(std::make_pair(std::shared_ptr<char>(block, [shadow, bytes](char * p) {
+			if (shadow)
+				shadow->poison((int64_t)p, bytes, Shadow::StackDead);
+			delete[] p;
+		}), bytes));
+		if (shadow) {
+			shadow->poison((int64_t)block, bytes, Shadow::StackRedzone);
+			shadow->unpoison((int64_t)block + pad, size);
+		}
+		return (int64_t)block + pad;
+	}
+
 
   	void bindDecl(Decl* decl, int64_t val) {
       	mVars[decl] = val;
@@ -53,6 +112,12 @@ public:
    	Stmt * getPC() {
 	   	return mPC;
    	}
+	void setFunction(FunctionDecl * func) {
+		mFunc = func;
+	}
+	FunctionDecl * getFunction() {
+		return mFunc;
+	}
 
 	bool exprExits(Stmt *stmt)
 	{
@@ -62,199 +127,1409 @@ public:
 	{
 		return mVars.find(decl) != mVars.end();
 	}
+
+	/// Everything in the frame that may hold a pointer, stale expression
+	/// values included
+	void addRoots(GcRoots &roots) {
+		for (std::pair<Decl * const, int64_t> &var : mVars)
+			roots.values.push_back(var.second);
+		for (std::pair<Stmt * const, int64_t> &expr : mExprs)
+			roots.values.push_back(expr.second);
+		for (std::pair<std::shared_ptr<char>, int64_t> &object : mStorage)
+			roots.ranges.push_back(std::make_pair((int64_t)object.first.get(), object.second));
+	}
 	// void pushStmtVal(Stmt *stmt, int64_t value)
 	// {
 	// 	mExprs.insert(pair<Stmt *, int64_t>(stmt, value));
 	// }
 };
 
-/// Heap maps address to a value
-/*
-class Heap {
-public:
-   	int Malloc(int size) ;
-   	void Free (int addr) ;
-   	void Update(int addr, int val) ;
-   	int Get(int addr);
-};
-*/
+/// Heap tracks the buffers handed out by MALLOC
 class Heap {
    // The map of mBufs[address] = size
-   std::map<int64_t, int> mBufs;
-   // The map of mContents[address] = value
-   std::map<int64_t, int> mContents;
+   std::map<int64_t, int64_t> mBufs;
+   // Bytes currently allocated and not yet freed
+   int64_t mLive;
+   /// Checked mode: blocks get redzones, and freed blocks stay poisoned in
+   /// the quarantine for a while before the host may reuse them
+   std::shared_ptr<Shadow> mShadow;
+   static const int64_t QuarantineBytes = 64 << 20;
+   std::deque<std::pair<int64_t, int64_t>> mQuarantine;
+   int64_t mQuarantined = 0;
+   /// Snapshot mode: blocks are carved from one region at a fixed address,
+   /// so that an image of it maps back at the same place in another process
+   /// with every pointer in it still valid. Freed blocks are reused by size.
+   char * mArena = nullptr;
+   int64_t mArenaUsed = 0;
+   std::map<int64_t, std::vector<int64_t>> mFreeBlocks;
 public:
-	Heap() : mBufs(), mContents(){
+   static const int64_t ArenaBase = 0x100000000000;
+   /// Reserved, not committed: only touched pages cost memory
+   static const int64_t ArenaCapacity = (int64_t)1 << 36;
+
+	Heap() : mBufs(), mLive(0) {
+   }
+   ~Heap() {
+	   if (mArena)
+		   munmap(mArena, ArenaCapacity);
+   }
+   void setShadow(const std::shared_ptr<Shadow> &shadow) {
+	   assert(mBufs.empty() && "the heap mode is fixed once blocks are out");
+	   mShadow = shadow;
+   }
+
+   /// Switch to the fixed-address arena, before anything is allocated
+   bool useArena(std::string &error) {
+	   assert(mBufs.empty() && "the heap mode is fixed once blocks are out");
+	   void * arena = mmap((void *)ArenaBase, ArenaCapacity, PROT_READ | PROT_WRITE,
+	                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	   if (arena != (void *)ArenaBase) {
+		   if (arena != MAP_FAILED)
+			   munmap(arena, ArenaCapacity);
+		   error = "cannot reserve the heap arena at 0x" + llvm::utohexstr(ArenaBase);
+		   return false;
+	   }
+	   mArena = (char *)arena;
+	   return true;
+   }
+
+   char * arena() {
+	   return mArena;
+   }
+   int64_t arenaUsed() {
+	   return mArenaUsed;
+   }
+   int64_t redzone() {
+	   return pad();
+   }
+   const std::map<int64_t, int64_t> &blocks() {
+	   return mBufs;
    }
-   //allocate a buffer with the size of size and return the start pointer of the buffer
-   int64_t Malloc(int size) {
-      	/// malloc the buffer
-	  	int64_t *p = (int64_t *)std::malloc(size);
-      	mBufs.insert(std::make_pair((int64_t)p, size));
-
-      	/// init the content to zero
-      	for (int i=0; i<size; i ++) {
-         	mContents.insert(std::make_pair((int64_t)(p+i), 0));
-      	}
-      	return (int64_t)p;
+   /// Freed arena blocks by their size, redzones included
+   const std::map<int64_t, std::vector<int64_t>> &freeBlocks() {
+	   return mFreeBlocks;
    }
-   //Free the buffer, clear the content to zero.
+
+   /// Take over an arena image mapped in place by a snapshot, with the
+   /// blocks that were live and free in it
+   void adopt(int64_t used, const std::map<int64_t, int64_t> &blocks,
+              const std::map<int64_t, std::vector<int64_t>> &freeBlocks) {
+	   mArenaUsed = used;
+	   mBufs = blocks;
+	   mFreeBlocks = freeBlocks;
+	   mLive = 0;
+	   for (const std::pair<const int64_t, int64_t> &buf : mBufs)
+		   mLive += buf.second;
+	   if (!mShadow)
+		   return;
+	   mShadow->poison((int64_t)mArena, used, Shadow::HeapFreed);
+	   for (const std::pair<const int64_t, int64_t> &buf : mBufs) {
+		   mShadow->poison(buf.first - pad(), (buf.second > 0 ? buf.second : 1) + 2 * pad(), Shadow::HeapRedzone);
+		   mShadow->unpoison(buf.first, buf.second);
+	   }
+   }
+
+   //allocate a zeroed buffer with the size of size and return the start pointer of the buffer
+   int64_t Malloc(int64_t size) {
+		int64_t bytes = (size > 0 ? size : 1) + 2 * pad();
+		int64_t block = obtain(bytes);
+		if (!block)
+			return 0;
+	  	int64_t p = block + pad();
+		if (mShadow) {
+			mShadow->poison(p - pad(), bytes, Shadow::HeapRedzone);
+			mShadow->unpoison(p, size);
+		}
+      	mBufs.insert(std::make_pair(p, size));
+		mLive += size;
+      	return p;
+   }
+   //Free the buffer
    void Free (int64_t addr) {
+		if (addr == 0)
+			return;
 		// check the address first.
    		assert(mBufs.find(addr) != mBufs.end());
-		//get the buffer address
-      	int64_t *buf = (int64_t *)addr;
-	  	// get the buffer size
-      	int size = mBufs.find(addr)->second;
-	  	// delete the addr's iterator
-      	mBufs.erase(mBufs.find(addr));
-		
-		// delete the addr's iterator
-      	for (int i = 0; i < size; i++) {
-      		assert(mContents.find((int64_t)(buf+i)) != mContents.end());
-        	mContents.erase((int64_t)(buf+i));
-      	}
-        // Free the buffer
-      	std::free(buf);
+		std::map<int64_t, int64_t>::iterator it = mBufs.find(addr);
+		int64_t size = it->second;
+		mLive -= size;
+      	mBufs.erase(it);
+		int64_t bytes = (size > 0 ? size : 1) + 2 * pad();
+		if (!mShadow) {
+			give(addr, bytes);
+			return;
+		}
+		mShadow->poison(addr, size, Shadow::HeapFreed);
+		mQuarantine.push_back(std::make_pair(addr - pad(), bytes));
+		mQuarantined += bytes;
+		while (mQuarantined > QuarantineBytes) {
+			mQuarantined -= mQuarantine.front().second;
+			give(mQuarantine.front().first, mQuarantine.front().second);
+			mQuarantine.pop_front();
+		}
+   }
+
+   bool owns(int64_t addr) {
+	   return mBufs.count(addr);
+   }
+
+   /// Conservative mark and sweep. A block survives when a root value or an
+   /// aligned word of a root range or of a surviving block points into it,
+   /// or one past its end. Returns the number of blocks freed; freed is set
+   /// to their bytes.
+   int64_t collect(const GcRoots &roots, int64_t &freed) {
+	   llvm::DenseSet<int64_t> marked;
+	   std::vector<std::pair<int64_t, int64_t>> work;
+	   auto mark = [&](int64_t value) {
+		   std::map<int64_t, int64_t>::iterator it = mBufs.upper_bound(value);
+		   if (it == mBufs.begin())
+			   return;
+		   --it;
+		   if (value - it->first <= it->second && marked.insert(it->first).second)
+			   work.push_back(*it);
+	   };
+	   auto scan = [&](int64_t begin, int64_t size) {
+		   for (int64_t a = (begin + 7) & ~7; a + 8 <= begin + size; a += 8)
+			   mark(*(int64_t *)a);
+	   };
+	   for (int64_t value : roots.values)
+		   mark(value);
+	   for (const std::pair<int64_t, int64_t> &range : roots.ranges)
+		   scan(range.first, range.second);
+	   while (!work.empty()) {
+		   std::pair<int64_t, int64_t> block = work.back();
+		   work.pop_back();
+		   scan(block.first, block.second);
+	   }
+	   std::vector<int64_t> garbage;
+	   freed = 0;
+	   for (std::pair<const int64_t, int64_t> &buf : mBufs) {
+		   if (!marked.count(buf.first)) {
+			   garbage.push_back(buf.first);
+			   freed += buf.second;
+		   }
+	   }
+	   for (int64_t addr : garbage)
+		   Free(addr);
+	   return garbage.size();
+   }
+
+   int64_t liveBytes() {
+	   return mLive;
    }
 
-   //Update the value of address in the buffer
-   void Update(int64_t addr, int val) {
-      assert(mContents.find(addr) != mContents.end());
-      mContents[addr] = val;
+private:
+   int64_t pad() {
+	   return mShadow ? Shadow::Redzone : 0;
+   }
+
+   /// Zeroed memory for a block, 0 when there is none
+   int64_t obtain(int64_t bytes) {
+	   if (!mArena)
+		   return (int64_t)std::calloc(bytes, 1);
+	   bytes = llvm::alignTo(bytes, 16);
+	   std::map<int64_t, std::vector<int64_t>>::iterator it = mFreeBlocks.find(bytes);
+	   if (it != mFreeBlocks.end() && !it->second.empty()) {
+		   int64_t block = it->second.back();
+		   it->second.pop_back();
+		   memset((void *)block, 0, bytes);
+		   return block;
+	   }
+	   if (mArenaUsed + bytes > ArenaCapacity)
+		   return 0;
+	   // fresh pages of the mapping are zero already
+	   int64_t block = (int64_t)mArena + mArenaUsed;
+	   mArenaUsed += bytes;
+	   return block;
    }
 
-   //Get the value of address in the buffer
-   int64_t Get(int64_t addr) {
-      assert(mContents.find(addr) != mContents.end());
-      return mContents.find(addr)->second;
-    }
+   void give(int64_t block, int64_t bytes) {
+	   if (!mArena)
+		   std::free((void *)block);
+	   else
+		   mFreeBlocks[llvm::alignTo(bytes, 16)].push_back(block);
+   }
+};
+
+/// Finds the scalar locals whose address is taken with '&'. Nothing else can
+/// reach a local's storage, so the rest can live in registers and slots.
+class EscapeAnalysis : public RecursiveASTVisitor<EscapeAnalysis> {
+	llvm::DenseSet<const VarDecl *> &mAddressed;
+public:
+	explicit EscapeAnalysis(llvm::DenseSet<const VarDecl *> &addressed) : mAddressed(addressed) {}
+
+	bool VisitUnaryOperator(UnaryOperator * uop) {
+		if (uop->getOpcode() != UO_AddrOf)
+			return true;
+		if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(uop->getSubExpr()->IgnoreParens()))
+			if (VarDecl * var = dyn_cast<VarDecl>(ref->getDecl()))
+				if (var->hasLocalStorage() && !var->getType()->isArrayType())
+					mAddressed.insert(var);
+		return true;
+	}
+};
+
+/// Functions a body names other than by calling them. Their address can
+/// be called through a pointer, as PARALLEL_FOR does, which clang's
+/// CallGraph does not follow.
+class FunctionRefs : public RecursiveASTVisitor<FunctionRefs> {
+	llvm::SmallVectorImpl<FunctionDecl *> &mFound;
+	llvm::DenseSet<const Expr *> mCallees;
+public:
+	explicit FunctionRefs(llvm::SmallVectorImpl<FunctionDecl *> &found) : mFound(found) {}
+
+	bool VisitCallExpr(CallExpr * call) {
+		mCallees.insert(call->getCallee()->IgnoreParenImpCasts());
+		return true;
+	}
+	bool VisitDeclRefExpr(DeclRefExpr * ref) {
+		if (FunctionDecl * func = dyn_cast<FunctionDecl>(ref->getDecl()))
+			if (!mCallees.count(ref))
+				mFound.push_back(func);
+		return true;
+	}
+};
+
+/// Execution limits for untrusted programs, 0 means unlimited
+struct ExecLimits {
+	uint64_t maxSteps = 0;		/// walked statements, loop iterations and calls
+	uint64_t maxHeapBytes = 0;	/// live bytes handed out by MALLOC
+	unsigned maxDepth = 0;		/// call frames
+	double timeout = 0;			/// wall-clock seconds
+};
+/// Counters collected while a program runs, reported by --stats
+struct RunStats {
+	uint64_t statements = 0;	/// statements walked; prepared code counts no statements
+	uint64_t loopIterations = 0;
+	uint64_t calls = 0;			/// calls of user-defined functions
+	uint64_t allocations = 0;
+	uint64_t frees = 0;
+	uint64_t allocatedBytes = 0;
+	uint64_t peakHeapBytes = 0;
+	uint64_t peakDepth = 1;		/// call frames, main included
+	uint64_t nativeFunctions = 0;	/// functions promoted to native code
+	uint64_t nativeCalls = 0;
+	uint64_t functions = 0;			/// functions defined in the unit
+	uint64_t reachableFunctions = 0;	/// of those, the ones main can reach
+	uint64_t prunedBranches = 0;	/// if branches left out of prepared code, their condition being constant
+	uint64_t preparedFunctions = 0;	/// functions lowered to instructions, on their first call
+	uint64_t gcCollections = 0;
+	uint64_t gcFreedBlocks = 0;		/// MALLOC blocks the collector released
+	uint64_t gcFreedBytes = 0;
+	double gcPauseMs = 0;			/// all collections together
+	double gcMaxPauseMs = 0;
 };
 
+/// Add what a PARALLEL_FOR worker counted to its caller's statistics
+inline void addStats(RunStats &into, const RunStats &from) {
+	into.statements += from.statements;
+	into.loopIterations += from.loopIterations;
+	into.calls += from.calls;
+	into.allocations += from.allocations;
+	into.frees += from.frees;
+	into.allocatedBytes += from.allocatedBytes;
+	into.peakHeapBytes = std::max(into.peakHeapBytes, from.peakHeapBytes);
+	into.peakDepth = std::max(into.peakDepth, from.peakDepth);
+	into.nativeCalls += from.nativeCalls;
+}
+
+/// What one thread running guest code owns: the walker's frames, the value
+/// a return is carrying out, prepared code's frames, the steps taken and the
+/// statistics. main runs on the Environment's own context, every
+/// PARALLEL_FOR worker on one of its own; the heap, the globals and the
+/// prepared code are shared.
+struct ExecContext {
+	std::vector<StackFrame> stack;
+	bool retType = 0; // 0-> void 1 -> int
+	int64_t retValue = 0;
+	/// A break or continue on its way out to its loop or switch
+	Stmt * jumping = nullptr;
+	std::unique_ptr<Machine> machine;
+	/// main's frame is prepared, the bottom walker frame only holds globals
+	bool mainPrepared = false;
+	/// Limits are only compared when steps reaches nextCheck, so the hot
+	/// path on loop back-edges and calls is one increment and one compare.
+	uint64_t steps = 0;
+	uint64_t nextCheck = UINT64_MAX;
+	uint64_t nextYield = UINT64_MAX;
+	RunStats stats;
+};
 
 class Environment {
-   	std::vector<StackFrame> mStack;
+	ExecContext mMain;
+	/// Owns the data segment, see layoutGlobals
    	std::vector<StackFrame> mGlobal;
+	/// Address of each global in the data segment, by canonical decl
+	llvm::DenseMap<const VarDecl *, int64_t> mGlobalAddrs;
 	
 	Heap mHeap;
    	FunctionDecl * mFree;				/// Declartions to the built-in functions
    	FunctionDecl * mMalloc;
    	FunctionDecl * mInput;
    	FunctionDecl * mOutput;
+   	FunctionDecl * mParallelFor;
 
    	FunctionDecl * mEntry;
 
-	bool retType = 0; // 0-> void 1 -> int
-	int64_t retValue = 0;
+	static const uint64_t CheckInterval = 4096;
+	ExecLimits mLimits;
+	std::chrono::steady_clock::time_point mDeadline;
+	/// The limit that stopped the program, unwinds the visitor like a return
+	std::atomic<const char *> mAbort{nullptr};
+	ASTContext * mContext = nullptr;
+	std::vector<VarDecl *> mGlobalDecls;
+
+	/// Calls plus loop iterations per function; past mJitThreshold a function
+	/// is compiled to native code and called that way from then on.
+	unsigned mJitThreshold = 0;
+	llvm::DenseMap<FunctionDecl *, unsigned> mHotness;
+	llvm::DenseMap<FunctionDecl *, NativeTier::Entry> mNative;
+	std::unique_ptr<NativeTier> mNativeTier;
+
+	/// Prepared code of the functions that could be lowered, by canonical
+	/// decl, filled in as they are first called; mWalked holds those that
+	/// could not
+	bool mPrepare = true;
+	llvm::DenseMap<const FunctionDecl *, std::unique_ptr<Code>> mCode;
+	llvm::DenseSet<const FunctionDecl *> mWalked;
+	/// Guards mCode and mWalked while PARALLEL_FOR workers run
+	std::mutex mCodeLock;
+	/// Walks a function body, set by whoever owns the visitor
+	std::function<void(Stmt *)> mWalk;
+	/// Canonical decls of the functions main can reach, see findReachable
+	llvm::DenseSet<const FunctionDecl *> mReachable;
+	/// Locals that need memory, see addressTaken
+	llvm::DenseSet<const VarDecl *> mAddressed;
+	/// Checks guest memory accesses, null unless sanitizing
+	std::shared_ptr<Shadow> mShadow;
+	/// Where GET reads and PRINT writes
+	std::istream * mIn = &std::cin;
+	std::ostream * mOut = &std::cout;
+	/// MALLOC'ed bytes between collections, 0 without the collector
+	int64_t mGcThreshold = 0;
+	int64_t mGcAllocated = 0;
+	/// A resumable run (see Fiber.h) reads GET's values from mGet instead of
+	/// mIn, and gives its thread back through mYield every mYieldSteps steps
+	std::function<int64_t()> mGet;
+	std::function<void()> mYield;
+	uint64_t mYieldSteps = 0;
+	/// PARALLEL_FOR workers, see setThreads
+	unsigned mThreads = 0;
+	/// Set while PARALLEL_FOR workers run; the heap and the builtins'
+	/// streams are then only used under mSharedLock
+	bool mParallel = false;
+	std::mutex mSharedLock;
+	/// Edge counters fuzz/ hands in, see cover
+	uint8_t * mCoverage = nullptr;
+	size_t mCoverageSize = 0;
+	unsigned mLastNode = 0;
 
 public:
    	/// Get the declartions to the built-in functions
-   	Environment() : mStack(), mGlobal(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL) {
+   	Environment() : mGlobal(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mParallelFor(NULL), mEntry(NULL) {
    	}
+
+	/// The context of the PARALLEL_FOR worker running on this thread, null
+	/// on every other thread
+	static ExecContext *&workerContext() {
+		static thread_local ExecContext * context = nullptr;
+		return context;
+	}
+
+	ExecContext &ctx() {
+		ExecContext * worker = workerContext();
+		return worker ? *worker : mMain;
+	}
+
+	/// The current context's Machine, made on first use
+	Machine &machine() {
+		std::unique_ptr<Machine> &machine = ctx().machine;
+		if (!machine)
+			machine.reset(new Machine(*this));
+		return *machine;
+	}
 	
+   /// A variable's frame value; a global's is its address in the data segment
    int64_t getDeclVal_GM(Decl * decl) {
-	   //mstack找不到的时候去mGlobal找,实现子函数中使用全局变量
-	   StackFrame my_Gstack = mGlobal.back();
-	   StackFrame my_mStack = mStack.back();
-	   if(my_mStack.DeclExits(decl))
-		   return my_mStack.getDeclVal(decl);
-	   else
-		   return my_Gstack.getDeclVal(decl);
+	   if (VarDecl * var = dyn_cast<VarDecl>(decl))
+		   if (int64_t addr = globalAddress(var))
+			   return addr;
+	   return ctx().stack.back().getDeclVal(decl);
    }
 
 
-   	/// Initialize the Environment
+   	/// Initialize the Environment. It can be initialized again with another
+   	/// translation unit; the heap is kept, the frames are not.
    	void init(TranslationUnitDecl * unit) {
+		mContext = &unit->getASTContext();
+		ctx().stack.clear();
+		mGlobal.clear();
+		mGlobalDecls.clear();
+		mGlobalAddrs.clear();
+		mFree = mMalloc = mInput = mOutput = mParallelFor = mEntry = NULL;
+		// native code belongs to the previous translation unit
+		mHotness.clear();
+		mNative.clear();
+		mNativeTier.reset();
+		mCode.clear();
+		mWalked.clear();
+		mReachable.clear();
+		mAddressed.clear();
+		startRun();
 		// put it in first ,otherwise th process global will segmentfault because no StackFrame.
-		mStack.push_back(StackFrame());
+		ctx().stack.push_back(StackFrame());
 		mGlobal.push_back(StackFrame());
 	   	for (TranslationUnitDecl::decl_iterator i =unit->decls_begin(), e = unit->decls_end(); i != e; ++ i) {
-		   	// bind global vardecl to stack
+		   	// globals get their place once the whole unit is seen
             if (VarDecl * vdecl = dyn_cast<VarDecl>(*i)) {
-                llvm::errs() << "		global var decl: " << vdecl << "\n";
-                if (vdecl->getType().getTypePtr()->isIntegerType() || vdecl->getType().getTypePtr()->isCharType() ||
-					vdecl->getType().getTypePtr()->isPointerType())
-				{
-					if (vdecl->hasInit()){
-						int64_t val = Expr_GetVal(vdecl->getInit());
-						mStack.back().bindDecl(vdecl, val);
-						mGlobal.back().bindDecl(vdecl, val); //
-					}
-					else{
-						mStack.back().bindDecl(vdecl, 0);
-						mGlobal.back().bindDecl(vdecl, 0);
-					}
-						
-				}
-				else
-				{ // todo global array
-					cout<<"		couldn't find the type when init." <<endl;
-				}
+				if (vdecl == vdecl->getCanonicalDecl())
+					mGlobalDecls.push_back(vdecl);
             } else if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(*i) ) { // extract functions defined by ourself
 			   	if (fdecl->getName().equals("FREE")) mFree = fdecl;
 			   	else if (fdecl->getName().equals("MALLOC")) mMalloc = fdecl;
 			   	else if (fdecl->getName().equals("GET")) mInput = fdecl;
 			   	else if (fdecl->getName().equals("PRINT")) mOutput = fdecl;
+			   	else if (fdecl->getName().equals("PARALLEL_FOR")) mParallelFor = fdecl;
 			   	else if (fdecl->getName().equals("main")) mEntry = fdecl;
 		   	}
 	   	}
-		   
+		layoutGlobals();
+		if (mEntry)
+			ctx().stack.front().setFunction(mEntry->getCanonicalDecl());
+		// only functions that can run need their locals placed
+		if (!mEntry) {
+			EscapeAnalysis(mAddressed).TraverseDecl(unit);
+			return;
+		}
+		for (FunctionDecl * func : findReachable(unit))
+			EscapeAnalysis(mAddressed).TraverseDecl(func);
    	}
 
+	/// Lay every global out once, one after the other in a single zeroed
+	/// block, the data segment, and write the initial values. The walker and
+	/// prepared code both read and write them in place there.
+	void layoutGlobals() {
+		int64_t pad = mShadow ? Shadow::Redzone : 0;
+		std::vector<int64_t> offsets;
+		int64_t size = 0;
+		for (VarDecl * var : mGlobalDecls) {
+			int64_t align = mShadow ? 16 : mContext->getTypeAlignInChars(var->getType()).getQuantity();
+			size = llvm::alignTo(size + (offsets.empty() ? 0 : pad), align);
+			offsets.push_back(size);
+			size += sizeOf(var->getType());
+		}
+		if (mGlobalDecls.empty())
+			return;
+		int64_t base = mGlobal.back().allocate(size, mShadow);
+		if (mShadow)
+			mShadow->poison(base - pad, size + 2 * pad, Shadow::GlobalRedzone);
+		for (size_t i = 0; i < mGlobalDecls.size(); ++i) {
+			mGlobalAddrs[mGlobalDecls[i]] = base + offsets[i];
+			if (mShadow)
+				mShadow->unpoison(base + offsets[i], sizeOf(mGlobalDecls[i]->getType()));
+		}
+		// in declaration order, an initializer may read the globals before it
+		for (VarDecl * var : mGlobalDecls) {
+			const VarDecl * def = nullptr;
+			const Expr * init = var->getAnyInitializer(def);
+			if (!init)
+				continue;
+			const APValue * val = def->evaluateValue();
+			if (val && storeConstant(globalAddress(var), var->getType(), *val))
+				continue;
+			if (scalar(var->getType()))
+				store(globalAddress(var), var->getType(), Expr_GetVal(const_cast<Expr *>(init)));
+			else
+				llvm::errs() << "		" << var->getName() << ": initializer is not a constant\n";
+		}
+	}
+
+	/// Write the constant val of type at addr; false for what has no place
+	/// in guest memory, like a string literal's address
+	bool storeConstant(int64_t addr, QualType type, const APValue &val) {
+		if (val.isInt()) {
+			store(addr, type, val.getInt().getExtValue());
+			return true;
+		}
+		if (val.isLValue()) {
+			APValue::LValueBase base = val.getLValueBase();
+			int64_t offset = val.getLValueOffset().getQuantity();
+			if (!base) {
+				store(addr, type, offset);
+				return true;
+			}
+			const VarDecl * var = dyn_cast_or_null<VarDecl>(base.dyn_cast<const ValueDecl *>());
+			if (!var || !globalAddress(var))
+				return false;
+			store(addr, type, globalAddress(var) + offset);
+			return true;
+		}
+		if (val.isStruct()) {
+			const RecordDecl * record = type->getAsRecordDecl();
+			for (const FieldDecl * field : record->fields()) {
+				if (field->isBitField())
+					return false;
+				if (!storeConstant(addr + fieldOffset(field), field->getType(),
+				                   val.getStructField(field->getFieldIndex())))
+					return false;
+			}
+			return true;
+		}
+		// a field the initializer leaves out stays zero
+		if (val.isAbsent() || val.isIndeterminate())
+			return true;
+		if (val.isArray()) {
+			QualType elem = mContext->getAsArrayType(type)->getElementType();
+			int64_t size = sizeOf(elem);
+			unsigned count = mContext->getAsConstantArrayType(type)->getSize().getZExtValue();
+			for (unsigned i = 0; i < count; ++i) {
+				bool init = i < val.getArrayInitializedElts();
+				if (!init && !val.hasArrayFiller())
+					break;
+				if (!storeConstant(addr + i * size, elem, init ? val.getArrayInitializedElt(i) : val.getArrayFiller()))
+					return false;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	static bool scalar(QualType type) {
+		return type->isIntegralOrEnumerationType() || type->isPointerType();
+	}
+
+	/// Write init to the zeroed array or record at addr: a constant, a
+	/// list of scalars and aggregates, or a copy of another variable;
+	/// false for what the walker cannot evaluate
+	bool storeInit(int64_t addr, QualType type, Expr * init) {
+		Expr::EvalResult result;
+		if (init->EvaluateAsRValue(result, *mContext) && storeConstant(addr, type, result.Val))
+			return true;
+		init = init->IgnoreImpCasts();
+		if (isa<ImplicitValueInitExpr>(init))
+			return true;
+		if (scalar(type)) {
+			store(addr, type, Expr_GetVal(init));
+			return true;
+		}
+		if (CXXConstructExpr * construct = dyn_cast<CXXConstructExpr>(init)) {
+			CXXConstructorDecl * ctor = construct->getConstructor();
+			if (!ctor->isTrivial())
+				return false;
+			if (construct->getNumArgs() == 0)
+				return true;
+			DeclRefExpr * from = dyn_cast<DeclRefExpr>(construct->getArg(0)->IgnoreImpCasts());
+			if (!ctor->isCopyOrMoveConstructor() || !from)
+				return false;
+			memmove((void *)addr, (const void *)addressOf(from), sizeOf(type));
+			return true;
+		}
+		InitListExpr * list = dyn_cast<InitListExpr>(init);
+		if (!list || type->isUnionType())
+			return false;
+		if (const RecordDecl * record = type->getAsRecordDecl()) {
+			unsigned i = 0;
+			for (const FieldDecl * field : record->fields()) {
+				if (i == list->getNumInits())
+					break;
+				if (field->isBitField() || !storeInit(addr + fieldOffset(field), field->getType(), list->getInit(i++)))
+					return false;
+			}
+			return true;
+		}
+		// elements past the list stay zero
+		QualType elem = mContext->getAsArrayType(type)->getElementType();
+		for (unsigned i = 0; i < list->getNumInits(); ++i)
+			if (!storeInit(addr + i * sizeOf(elem), elem, list->getInit(i)))
+				return false;
+		return true;
+	}
+
+	/// Bytes from the start of its record to field, from the record layout
+	/// the ASTContext computes once per record
+	int64_t fieldOffset(const FieldDecl * field) {
+		const ASTRecordLayout &layout = mContext->getASTRecordLayout(field->getParent());
+		return mContext->toCharUnitsFromBits(layout.getFieldOffset(field->getFieldIndex())).getQuantity();
+	}
+
+	/// Arrays and records are values by their address
+	static bool aggregate(QualType type) {
+		return type->isArrayType() || type->isRecordType();
+	}
+
+	/// Where global var lives in the data segment, 0 for other variables
+	int64_t globalAddress(const VarDecl * var) {
+		llvm::DenseMap<const VarDecl *, int64_t>::iterator it = mGlobalAddrs.find(var->getCanonicalDecl());
+		return it == mGlobalAddrs.end() ? 0 : it->second;
+	}
+
+	/// The definitions main can reach through clang's call graph and through
+	/// the functions whose address reachable code or a global initializer
+	/// takes. The others are never prepared nor looked at again.
+	std::vector<FunctionDecl *> findReachable(TranslationUnitDecl * unit) {
+		CallGraph graph;
+		graph.addToCallGraph(unit);
+		std::vector<FunctionDecl *> reachable;
+		llvm::SmallVector<FunctionDecl *, 16> work;
+		for (VarDecl * vdecl : mGlobalDecls)
+			if (vdecl->hasInit())
+				FunctionRefs(work).TraverseStmt(vdecl->getInit());
+		work.push_back(mEntry);
+		while (!work.empty()) {
+			FunctionDecl * def = work.pop_back_val()->getDefinition();
+			if (!def || !mReachable.insert(def->getCanonicalDecl()).second)
+				continue;
+			reachable.push_back(def);
+			if (CallGraphNode * node = graph.getNode(def->getCanonicalDecl()))
+				for (const CallGraphNode::CallRecord &call : *node)
+					if (FunctionDecl * callee = dyn_cast_or_null<FunctionDecl>(call.Callee->getDecl()))
+						work.push_back(callee);
+			FunctionRefs(work).TraverseStmt(def->getBody());
+		}
+		return reachable;
+	}
+
+	/// Without a main every function counts as reachable
+	bool reachable(const FunctionDecl * func) {
+		return !mEntry || mReachable.count(func->getCanonicalDecl());
+	}
+
+	/// Locals whose address is taken live in memory, the walker's frame
+	/// storage or the prepared frame's arena block. Every other local stays
+	/// a plain value.
+	bool addressTaken(const VarDecl * var) {
+		return mAddressed.count(var);
+	}
+
+	/// Read and written through the address getDeclVal_GM gives: globals
+	/// and address-taken locals
+	bool inMemory(const VarDecl * var) {
+		return addressTaken(var) || globalAddress(var);
+	}
+
+	/// Declare var in frame with its first value
+	void bindVar(StackFrame &frame, VarDecl * var, int64_t val) {
+		if (addressTaken(var)) {
+			int64_t addr = frame.allocate(sizeOf(var->getType()), mShadow);
+			store(addr, var->getType(), val);
+			val = addr;
+		}
+		frame.bindDecl(var, val);
+	}
+
+	int64_t readVar(Decl * decl) {
+		int64_t val = getDeclVal_GM(decl);
+		VarDecl * var = dyn_cast<VarDecl>(decl);
+		return var && inMemory(var) ? load(val, var->getType()) : val;
+	}
+
+	/// Address of the lvalue e, whose operands the visitor has evaluated
+	int64_t addressOf(Expr * e) {
+		e = e->IgnoreParens();
+		if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(e)) {
+			VarDecl * var = dyn_cast<VarDecl>(ref->getDecl());
+			// an array's value is its address already
+			if (var && (inMemory(var) || aggregate(var->getType())))
+				return getDeclVal_GM(var);
+		} else if (ArraySubscriptExpr * sub = dyn_cast<ArraySubscriptExpr>(e)) {
+			return ctx().stack.back().getStmtVal(sub->getBase()) +
+				ctx().stack.back().getStmtVal(sub->getIdx()) * sizeOf(sub->getType());
+		} else if (UnaryOperator * deref = dyn_cast<UnaryOperator>(e)) {
+			if (deref->getOpcode() == UO_Deref)
+				return Expr_GetVal(deref->getSubExpr());
+		} else if (MemberExpr * member = dyn_cast<MemberExpr>(e)) {
+			return memberAddress(member);
+		}
+		fail("unsupported", "cannot take the address of " + e->getType().getAsString() + " " +
+			e->getStmtClassName(), e);
+		return 0;
+	}
+
    	FunctionDecl * getEntry() {
 	   	return mEntry;
    	}
 
+	ASTContext &context() {
+		return *mContext;
+	}
+
+	enum Builtin { NotBuiltin, BuiltinGet, BuiltinPrint, BuiltinMalloc, BuiltinFree, BuiltinParallelFor };
+	Builtin builtin(FunctionDecl * callee) {
+		if (callee == mInput) return BuiltinGet;
+		if (callee == mOutput) return BuiltinPrint;
+		if (callee == mMalloc) return BuiltinMalloc;
+		if (callee == mFree) return BuiltinFree;
+		if (callee == mParallelFor) return BuiltinParallelFor;
+		return NotBuiltin;
+	}
+
+	/// The function PARALLEL_FOR(begin, end, func) calls, null unless func
+	/// names a defined function of one parameter
+	FunctionDecl * parallelBody(CallExpr * call) {
+		if (call->getNumArgs() != 3)
+			return nullptr;
+		DeclRefExpr * ref = dyn_cast<DeclRefExpr>(call->getArg(2)->IgnoreParenImpCasts());
+		FunctionDecl * func = ref ? dyn_cast<FunctionDecl>(ref->getDecl()) : nullptr;
+		func = func ? func->getDefinition() : nullptr;
+		return func && func->getNumParams() == 1 ? func : nullptr;
+	}
+
+	/// PARALLEL_FOR workers, 0 for one per core and 1 to run the loop on
+	/// the calling thread
+	void setThreads(unsigned threads) {
+		mThreads = threads;
+	}
+
+	/// Held around the heap and the builtins' streams while PARALLEL_FOR
+	/// workers run, not held otherwise
+	std::unique_lock<std::mutex> sharedLock() {
+		return mParallel ? std::unique_lock<std::mutex>(mSharedLock) : std::unique_lock<std::mutex>();
+	}
+
+	/// func(i) on the current context, prepared when func could be lowered
+	void callIndexed(FunctionDecl * func, int64_t i) {
+		if (const Code * code = prepared(func))
+			machine().run(code, &i, 1);
+		else
+			invoke(func, &i, 1);
+	}
+
+	/// PARALLEL_FOR(begin, end, func): func(i) for every i in [begin, end).
+	/// The range is cut into one contiguous chunk per worker thread, each
+	/// with a context of its own over the shared heap and globals. Checked
+	/// memory, the collector, native code and --multiplex need the one
+	/// thread, so they get the plain loop, as does a PARALLEL_FOR inside a
+	/// worker.
+	void parallelFor(FunctionDecl * func, int64_t begin, int64_t end, Stmt * at) {
+		int64_t count = end > begin ? end - begin : 0;
+		unsigned threads = mThreads ? mThreads : std::max(1u, std::thread::hardware_concurrency());
+		if (threads == 1 || count < 2 || mShadow || mGcThreshold || mJitThreshold || mGet || workerContext()) {
+			for (int64_t i = begin; i < end && enterCall(at); ++i)
+				callIndexed(func, i);
+			return;
+		}
+		threads = std::min<int64_t>(threads, count);
+		ExecContext &caller = ctx();
+		uint64_t steps = caller.steps;
+		std::vector<ExecContext> workers(threads);
+		std::vector<std::thread> pool;
+		mParallel = true;
+		for (unsigned k = 0; k < threads; ++k) {
+			ExecContext &worker = workers[k];
+			worker.stack.push_back(StackFrame());
+			worker.stack.back().setPC(at);
+			worker.steps = steps;
+			// the first tick checks the limits, and sets the next check
+			if (mLimits.maxSteps || mLimits.timeout > 0)
+				worker.nextCheck = steps + 1;
+			int64_t lo = begin + count * k / threads, hi = begin + count * (k + 1) / threads;
+			pool.emplace_back([this, &worker, func, lo, hi, at] {
+				workerContext() = &worker;
+				for (int64_t i = lo; i < hi && enterCall(at); ++i)
+					callIndexed(func, i);
+				workerContext() = nullptr;
+			});
+		}
+		for (std::thread &thread : pool)
+			thread.join();
+		mParallel = false;
+		for (ExecContext &worker : workers) {
+			caller.steps += worker.steps - steps;
+			addStats(caller.stats, worker.stats);
+		}
+	}
+
+	/// Guest memory holds objects at the sizes the target gives them, both
+	/// for the walker and for prepared code
+	int64_t sizeOf(QualType type) {
+		if (type->isVoidType())
+			return 1;
+		return mContext->getTypeSizeInChars(type).getQuantity();
+	}
+
+	int64_t load(int64_t addr, QualType type) {
+		void * p = (void *)addr;
+		bool sign = type->isSignedIntegerOrEnumerationType();
+		if (mShadow && !mShadow->check(addr, sizeOf(type))) {
+			badAccess(addr, sizeOf(type), "read");
+			return 0;
+		}
+		switch (sizeOf(type)) {
+		case 1: return sign ? (int64_t)*(int8_t *)p : (int64_t)*(uint8_t *)p;
+		case 2: return sign ? (int64_t)*(int16_t *)p : (int64_t)*(uint16_t *)p;
+		case 4: return sign ? (int64_t)*(int32_t *)p : (int64_t)*(uint32_t *)p;
+		default: return *(int64_t *)p;
+		}
+	}
+
+	void store(int64_t addr, QualType type, int64_t val) {
+		void * p = (void *)addr;
+		if (mShadow && !mShadow->check(addr, sizeOf(type))) {
+			badAccess(addr, sizeOf(type), "write");
+			return;
+		}
+		switch (sizeOf(type)) {
+		case 1: *(int8_t *)p = (int8_t)val; break;
+		case 2: *(int16_t *)p = (int16_t)val; break;
+		case 4: *(int32_t *)p = (int32_t)val; break;
+		default: *(int64_t *)p = val; break;
+		}
+	}
+
+	/// false walks every function
+	void setPrepare(bool prepare) {
+		mPrepare = prepare;
+	}
+
+	void setWalker(std::function<void(Stmt *)> walk) {
+		mWalk = walk;
+	}
+
+	/// Forget the prepared code and count the functions defined in the
+	/// unit. Nothing is lowered here: prepared lowers a function on its
+	/// first call, so a program pays only for the functions it runs.
+	void prepare() {
+		mCode.clear();
+		mWalked.clear();
+		mMain.stats.functions = 0;
+		mMain.stats.reachableFunctions = 0;
+		mMain.stats.preparedFunctions = 0;
+		mMain.stats.prunedBranches = 0;
+		for (Decl * decl : mContext->getTranslationUnitDecl()->decls()) {
+			FunctionDecl * fdecl = dyn_cast<FunctionDecl>(decl);
+			if (fdecl && fdecl->doesThisDeclarationHaveABody()) {
+				++mMain.stats.functions;
+				if (reachable(fdecl))
+					++mMain.stats.reachableFunctions;
+			}
+		}
+	}
+
+	/// Lower every function main can reach now instead of on its first call:
+	/// forked children would each lower what they call again and lose it
+	/// when they exit
+	void prepareReachable() {
+		if (!mPrepare)
+			return;
+		for (Decl * decl : mContext->getTranslationUnitDecl()->decls()) {
+			FunctionDecl * fdecl = dyn_cast<FunctionDecl>(decl);
+			if (fdecl && fdecl->doesThisDeclarationHaveABody() && reachable(fdecl))
+				prepared(fdecl);
+		}
+	}
+
+	/// Lowering left out the dead branches of count ifs; under prepared's lock
+	void prunedBranches(unsigned count) {
+		mMain.stats.prunedBranches += count;
+	}
+
+	/// The prepared code of func, lowered on the first call and kept; null
+	/// when func is walked. Those that use something the lowering does not
+	/// handle say why, once.
+	const Code * prepared(FunctionDecl * func) {
+		std::unique_lock<std::mutex> lock;
+		if (mParallel)
+			lock = std::unique_lock<std::mutex>(mCodeLock);
+		const FunctionDecl * key = func->getCanonicalDecl();
+		llvm::DenseMap<const FunctionDecl *, std::unique_ptr<Code>>::iterator it = mCode.find(key);
+		if (it != mCode.end())
+			return it->second.get();
+		if (!mPrepare || mWalked.count(key))
+			return nullptr;
+		FunctionDecl * def = func->getDefinition();
+		if (!def || !reachable(def)) {
+			mWalked.insert(key);
+			return nullptr;
+		}
+		std::string why;
+		std::unique_ptr<Code> code = lowerFunction(def, *this, why);
+		if (!code) {
+			llvm::errs() << "		" << def->getName() << " is walked: " << why << "\n";
+			mWalked.insert(key);
+			return nullptr;
+		}
+		// in the table before linking, so that recursive calls bind directly
+		Code &entry = *code;
+		mCode[key] = std::move(code);
+		linkCalls(entry, *this);
+		machine().thread(entry);
+		++mMain.stats.preparedFunctions;
+		return &entry;
+	}
+
+	/// A callee prepared already, without lowering it, for linkCalls
+	const Code * preparedAlready(FunctionDecl * func) {
+		llvm::DenseMap<const FunctionDecl *, std::unique_ptr<Code>>::iterator it = mCode.find(func->getCanonicalDecl());
+		return it == mCode.end() ? nullptr : it->second.get();
+	}
+
+	/// A callee that will never be prepared, for linkCalls
+	bool walked(FunctionDecl * func) {
+		return !mPrepare || mWalked.count(func->getCanonicalDecl()) || !func->getDefinition();
+	}
+
+	/// Run main, prepared when it could be lowered
+	void execute() {
+		if (const Code * code = prepared(mEntry)) {
+			ctx().mainPrepared = true;
+			machine().run(code, nullptr, 0);
+			ctx().mainPrepared = false;
+		} else {
+			mWalk(mEntry->getBody());
+		}
+	}
+
+	/// Walk callee for prepared code calling a function that is not prepared
+	int64_t invoke(FunctionDecl * callee, const int64_t * args, unsigned argc) {
+		FunctionDecl * def = callee->getDefinition();
+		StackFrame stack;
+		stack.setFunction(def->getCanonicalDecl());
+		for (unsigned i = 0; i < argc && i < def->getNumParams(); ++i)
+			bindVar(stack, def->getParamDecl(i), args[i]);
+		ctx().stack.push_back(stack);
+		noteDepth();
+		mWalk(def->getBody());
+		int64_t val = getReturn();
+		mStack_pop_back();
+		return val;
+	}
+
+	/// Reset the per-run state before (re)running the entry
+	void startRun() {
+		setReturn(false, 0);
+		ctx().jumping = nullptr;
+		mAbort = nullptr;
+		ctx().steps = 0;
+		// the clock and the step budget start with the program, not with parsing
+		ctx().nextCheck = UINT64_MAX;
+		if (mLimits.maxSteps || mLimits.timeout > 0)
+			ctx().nextCheck = mLimits.maxSteps ? std::min<uint64_t>(mLimits.maxSteps, CheckInterval) : CheckInterval;
+		ctx().nextYield = mYieldSteps ? mYieldSteps : UINT64_MAX;
+		ctx().nextCheck = std::min(ctx().nextCheck, ctx().nextYield);
+		mDeadline = std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(mLimits.timeout));
+	}
+
+	/// Bytes of the global variables by name, so they survive a re-parse
+	std::map<std::string, SavedGlobal> saveGlobals() {
+		std::map<std::string, SavedGlobal> values;
+		for (VarDecl * vdecl : mGlobalDecls) {
+			SavedGlobal &saved = values[vdecl->getNameAsString()];
+			saved.addr = globalAddress(vdecl);
+			saved.bytes.assign((const char *)saved.addr, sizeOf(vdecl->getType()));
+		}
+		return values;
+	}
+
+	/// Globals that kept their name and size get their saved bytes back.
+	/// They are in a new data segment now, so pointers to them, in them and
+	/// in the heap blocks, move along: like for the collector, any aligned
+	/// word that points into a saved global, or one past it, is a pointer.
+	void restoreGlobals(const std::map<std::string, SavedGlobal> &values) {
+		// old address of each restored global -> its size and new address
+		std::map<int64_t, std::pair<int64_t, int64_t>> moved;
+		for (VarDecl * vdecl : mGlobalDecls) {
+			std::map<std::string, SavedGlobal>::const_iterator it = values.find(vdecl->getNameAsString());
+			if (it == values.end() || (int64_t)it->second.bytes.size() != sizeOf(vdecl->getType()))
+				continue;
+			memcpy((char *)globalAddress(vdecl), it->second.bytes.data(), it->second.bytes.size());
+			moved[it->second.addr] = std::make_pair((int64_t)it->second.bytes.size(), globalAddress(vdecl));
+		}
+		auto relocate = [&](int64_t begin, int64_t size) {
+			for (int64_t a = (begin + 7) & ~7; a + 8 <= begin + size; a += 8) {
+				int64_t val;
+				memcpy(&val, (const void *)a, sizeof(val));
+				std::map<int64_t, std::pair<int64_t, int64_t>>::iterator it = moved.upper_bound(val);
+				if (it == moved.begin())
+					continue;
+				--it;
+				if (val - it->first > it->second.first)
+					continue;
+				val = it->second.second + (val - it->first);
+				memcpy((void *)a, &val, sizeof(val));
+			}
+		};
+		// only the restored globals: the others hold new initial values
+		for (const std::pair<const int64_t, std::pair<int64_t, int64_t>> &global : moved)
+			relocate(global.second.second, global.second.first);
+		for (const std::pair<const int64_t, int64_t> &block : mHeap.blocks())
+			relocate(block.first, block.second);
+	}
+
 	//return 
 
 	void setReturn(bool type, int64_t ret_val){
-		retType = type;
-		retValue = ret_val;
+		ctx().retType = type;
+		ctx().retValue = ret_val;
+	}
+
+	void setLimits(const ExecLimits &limits) {
+		mLimits = limits;
+	}
+
+	/// Check guest memory accesses; set before anything is allocated or
+	/// prepared
+	void setSanitize(bool sanitize) {
+		mShadow = sanitize ? std::make_shared<Shadow>() : nullptr;
+		mHeap.setShadow(mShadow);
+	}
+
+	Shadow * shadow() {
+		return mShadow.get();
+	}
+
+	Heap &heap() {
+		return mHeap;
+	}
+
+	void setStreams(std::istream * in, std::ostream * out) {
+		mIn = in;
+		mOut = out;
+	}
+
+	/// GET returns what get returns instead of reading mIn
+	void setInput(std::function<int64_t()> get) {
+		mGet = std::move(get);
+	}
+
+	/// Call yield every steps steps, counted like --max-steps; takes effect
+	/// with the next run
+	void setYield(uint64_t steps, std::function<void()> yield) {
+		mYieldSteps = steps;
+		mYield = std::move(yield);
+	}
+
+	void setCoverage(uint8_t * counters, size_t size) {
+		mCoverage = counters;
+		mCoverageSize = size;
+		mLastNode = 0;
+	}
+
+	/// Count the edge from the previous node run to this one, AFL style.
+	/// Nodes are statement classes for the walker and, in builds with
+	/// AST_INTERPRETER_FUZZ, Stmt::lastStmtConstant + 1 + opcode for
+	/// prepared code.
+	void cover(unsigned node) {
+		if (!mCoverage)
+			return;
+		++mCoverage[((mLastNode >> 1) ^ (node * 0x9e3779b1u)) % mCoverageSize];
+		mLastNode = node * 0x9e3779b1u;
+	}
+
+	/// Stops the program over a bad access of size bytes at addr
+	void badAccess(int64_t addr, int64_t size, const char * what, Stmt * at = nullptr) {
+		fail("memory", std::string(Shadow::describe(mShadow->state(addr, size))) + ", " +
+			std::to_string(size) + "-byte " + what + " of 0x" + llvm::utohexstr(addr), at);
+	}
+
+	/// Account for statements run by a compound statement
+	void countStmt() {
+		++ctx().stats.statements;
+		++ctx().steps;
+	}
+
+	/// func is the function running the loop, the walker's when null
+	void backedge(Stmt * loop, FunctionDecl * func = nullptr) {
+		++ctx().stats.loopIterations;
+		if (mJitThreshold)
+			++mHotness[func ? func->getCanonicalDecl() : ctx().stack.back().getFunction()];
+		tick(loop);
+	}
+
+	/// Count a call of a user function; false when the program has to stop
+	bool enterCall(Stmt * at) {
+		++ctx().stats.calls;
+		tick(at);
+		if (mLimits.maxDepth && depth() >= mLimits.maxDepth)
+			limitExceeded("depth", std::to_string(mLimits.maxDepth));
+		return !mAbort;
+	}
+
+	/// Call frames of both engines, main included
+	unsigned depth() {
+		return ctx().stack.size() + (ctx().machine ? ctx().machine->depth() : 0) - ctx().mainPrepared;
+	}
+
+	void noteDepth() {
+		ctx().stats.peakDepth = std::max<uint64_t>(ctx().stats.peakDepth, depth());
+	}
+
+	/// Called on loop back-edges and calls, the only places a program can
+	/// keep running forever.
+	void tick(Stmt * at) {
+		ctx().stack.back().setPC(at);
+		if (++ctx().steps >= ctx().nextCheck)
+			checkLimits();
+	}
+
+	void checkLimits() {
+		if (ctx().steps >= ctx().nextYield) {
+			ctx().nextYield = ctx().steps + mYieldSteps;
+			mYield();
+		}
+		if (mLimits.maxSteps && ctx().steps >= mLimits.maxSteps) {
+			limitExceeded("steps", std::to_string(mLimits.maxSteps));
+			return;
+		}
+		if (mLimits.timeout > 0 && std::chrono::steady_clock::now() >= mDeadline) {
+			limitExceeded("timeout", std::to_string(mLimits.timeout) + "s");
+			return;
+		}
+		ctx().nextCheck = ctx().steps + CheckInterval;
+		if (mLimits.maxSteps)
+			ctx().nextCheck = std::min<uint64_t>(ctx().nextCheck, mLimits.maxSteps);
+		ctx().nextCheck = std::min(ctx().nextCheck, ctx().nextYield);
+	}
+
+	/// Stop the program and report which limit it hit and where, as one line:
+	///   error: steps limit exceeded (1000000) at prog.c:7:4
+	void limitExceeded(const char * kind, const std::string &limit) {
+		fail(kind, std::string(kind) + " limit exceeded (" + limit + ")");
+	}
+
+	/// Stop the program with an error at a statement, the walker's current
+	/// one when at is null. kind becomes the status in --stats.
+	void fail(const char * kind, const std::string &message, Stmt * at = nullptr) {
+		// the first error wins, PARALLEL_FOR workers may fail at once
+		const char * none = nullptr;
+		if (!mAbort.compare_exchange_strong(none, kind))
+			return;
+		llvm::errs() << "error: " << message << " at ";
+		Stmt * pc = at ? at : ctx().stack.back().getPC();
+		if (pc && mContext)
+			pc->getBeginLoc().print(llvm::errs(), mContext->getSourceManager());
+		else
+			llvm::errs() << "<unknown>";
+		llvm::errs() << "\n";
+	}
+
+	const char * aborted() {
+		return mAbort;
+	}
+
+	const RunStats &stats() {
+		return mMain.stats;
+	}
+
+	/// 0 keeps every function in the interpreter
+	void setJitThreshold(unsigned threshold) {
+		mJitThreshold = threshold;
+	}
+
+	/// Native code for callee once it is hot enough, null while it is not or
+	/// when it cannot be compiled
+	NativeTier::Entry native(FunctionDecl * callee) {
+		if (!mJitThreshold)
+			return nullptr;
+		callee = callee->getCanonicalDecl();
+		if (++mHotness[callee] < mJitThreshold)
+			return nullptr;
+		llvm::DenseMap<FunctionDecl *, NativeTier::Entry>::iterator it = mNative.find(callee);
+		if (it != mNative.end())
+			return it->second;
+		if (!mNativeTier)
+			mNativeTier.reset(new NativeTier(*mContext, this));
+		NativeTier::Entry entry = mNativeTier->compile(callee);
+		mNative[callee] = entry;
+		if (entry)
+			++ctx().stats.nativeFunctions;
+		return entry;
+	}
+
+	int64_t callNative(NativeTier::Entry entry, const int64_t * args) {
+		++ctx().stats.nativeCalls;
+		return mNativeTier->call(entry, args);
+	}
+
+	/// The built-in functions, shared by the interpreter and native code
+	int64_t input() {
+		if (mGet)
+			return mGet();
+		std::unique_lock<std::mutex> lock = sharedLock();
+		int64_t val = 0;
+	  	llvm::errs() << "		Please Input an Integer Value : ";
+		*mIn >> val;
+		return val;
+	}
+
+	void output(int64_t val) {
+		std::unique_lock<std::mutex> lock = sharedLock();
+		*mOut << "	output : " << val << endl;
+	}
+
+	/// Returns 0 and stops the program when the heap limit is hit
+	int64_t allocate(int64_t size) {
+		std::unique_lock<std::mutex> lock = sharedLock();
+		bool overLimit = mLimits.maxHeapBytes && (uint64_t)(mHeap.liveBytes() + size) > mLimits.maxHeapBytes;
+		if (mGcThreshold && (overLimit || mGcAllocated >= mGcThreshold)) {
+			collectGarbage();
+			overLimit = mLimits.maxHeapBytes && (uint64_t)(mHeap.liveBytes() + size) > mLimits.maxHeapBytes;
+		}
+		if (overLimit) {
+			limitExceeded("heap", std::to_string(mLimits.maxHeapBytes));
+			return 0;
+		}
+		mGcAllocated += size;
+		int64_t p = mHeap.Malloc(size);
+		++ctx().stats.allocations;
+		ctx().stats.allocatedBytes += size;
+		ctx().stats.peakHeapBytes = std::max<uint64_t>(ctx().stats.peakHeapBytes, mHeap.liveBytes());
+		return p;
+	}
+
+	/// Collect MALLOC blocks the program cannot reach any more once this
+	/// many bytes were allocated since the last collection; 0 turns the
+	/// collector off
+	void setGcThreshold(int64_t bytes) {
+		mGcThreshold = bytes;
+	}
+
+	/// Roots are every walker frame and the globals, and the slots and
+	/// frame arenas of prepared code. Only called from allocate, where no
+	/// pointer is held anywhere else.
+	void collectGarbage() {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		GcRoots roots;
+		for (StackFrame &frame : ctx().stack)
+			frame.addRoots(roots);
+		for (StackFrame &frame : mGlobal)
+			frame.addRoots(roots);
+		if (ctx().machine)
+			ctx().machine->addRoots(roots);
+		int64_t bytes;
+		int64_t blocks = mHeap.collect(roots, bytes);
+		mGcAllocated = 0;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		++ctx().stats.gcCollections;
+		ctx().stats.gcFreedBlocks += blocks;
+		ctx().stats.gcFreedBytes += bytes;
+		ctx().stats.gcPauseMs += ms;
+		ctx().stats.gcMaxPauseMs = std::max(ctx().stats.gcMaxPauseMs, ms);
+	}
+
+	void release(int64_t addr, Stmt * at = nullptr) {
+		std::unique_lock<std::mutex> lock = sharedLock();
+		if (mShadow && addr && !mHeap.owns(addr)) {
+			fail("memory", mShadow->state(addr, 1) == Shadow::HeapFreed ? "double FREE" :
+				"FREE of 0x" + llvm::utohexstr(addr) + ", which MALLOC did not return", at);
+			return;
+		}
+		mHeap.Free(addr);
+		++ctx().stats.frees;
 	}
 
     bool haveReturn(){
-		if(retType==0 && retValue==0){
+		if (mAbort || ctx().jumping)
+			return true;
+		if(ctx().retType==0 && ctx().retValue==0){
 			return false;
 		}else{
 			return true;
 		}
 	}
 
+	/// break and continue skip the statements up to their loop or switch,
+	/// like a return skips those of its function
+	void jump(Stmt * stmt) {
+		ctx().jumping = stmt;
+	}
+
+	/// After a loop's body: a continue is done, a break ends the loop. True
+	/// when the loop has to stop.
+	bool leaveLoop() {
+		Stmt * jumping = ctx().jumping;
+		ctx().jumping = nullptr;
+		return (jumping && isa<BreakStmt>(jumping)) || haveReturn();
+	}
+
+	/// After a switch's body: a break is done, a continue goes on to the loop
+	void leaveSwitch() {
+		if (ctx().jumping && isa<BreakStmt>(ctx().jumping))
+			ctx().jumping = nullptr;
+	}
+
+	/// A case label's value, normalized like a value of type, the promoted
+	/// type of the switch's condition
+	int64_t caseValue(Expr * label, QualType type) {
+		llvm::APSInt val = label->EvaluateKnownConstInt(*mContext);
+		val = val.extOrTrunc(mContext->getTypeSize(type));
+		val.setIsSigned(type->isSignedIntegerOrEnumerationType());
+		return val.isSigned() ? val.getSExtValue() : (int64_t)val.getZExtValue();
+	}
+
+	/// The label of sw that matches its condition, which the visitor has
+	/// evaluated: a case, else default, else null
+	SwitchCase * switchCase(SwitchStmt * sw) {
+		QualType type = sw->getCond()->getType();
+		bool sign = type->isSignedIntegerOrEnumerationType();
+		int64_t val = Expr_GetVal(sw->getCond());
+		SwitchCase * otherwise = nullptr;
+		for (SwitchCase * label = sw->getSwitchCaseList(); label; label = label->getNextSwitchCase()) {
+			CaseStmt * c = dyn_cast<CaseStmt>(label);
+			if (!c) {
+				otherwise = label;
+				continue;
+			}
+			int64_t low = caseValue(c->getLHS(), type);
+			int64_t high = c->getRHS() ? caseValue(c->getRHS(), type) : low;
+			if (sign ? low <= val && val <= high : (uint64_t)low <= (uint64_t)val && (uint64_t)val <= (uint64_t)high)
+				return label;
+		}
+		return otherwise;
+	}
+
 	int64_t getReturn(){
-		if (retType){
-			return retValue;
+		if (ctx().retType){
+			return ctx().retValue;
 		}
 		return 0;
 	}
 
     void intliteral(IntegerLiteral * intliteral) {         
 		int64_t val = (int64_t)intliteral->getValue().getLimitedValue();       
-		mStack.back().bindStmt(dyn_cast<Expr>(intliteral), val);   
+		ctx().stack.back().bindStmt(dyn_cast<Expr>(intliteral), val);   
 	}
 
     void Character(CharacterLiteral * Character) {         
 		int64_t val = (int64_t)Character->getValue();         
-		mStack.back().bindStmt(dyn_cast<Expr>(Character), val);   
+		ctx().stack.back().bindStmt(dyn_cast<Expr>(Character), val);   
 	}
 
 	void parenexpr(ParenExpr * pexpr) {    
 		llvm::errs() << "		parenexpr" << "\n";    
 		Expr * expr = pexpr->getSubExpr();         
-		int64_t val = mStack.back().getStmtVal(expr);         
-		mStack.back().bindStmt(pexpr, val);     
+		int64_t val = ctx().stack.back().getStmtVal(expr);         
+		ctx().stack.back().bindStmt(pexpr, val);     
+	}
+
+	/// val converted to type the way C does, wrapped to its width: what a
+	/// slot of prepared code holds for it, see Kernels.h
+	int64_t normalize(int64_t val, QualType type) {
+		if (type->isBooleanType())
+			return val != 0;
+		if (!type->isIntegralOrEnumerationType())
+			return val;
+		unsigned bits = mContext->getTypeSize(type);
+		if (bits >= 64)
+			return val;
+		uint64_t mask = (UINT64_C(1) << bits) - 1;
+		uint64_t bitsOf = (uint64_t)val & mask;
+		if (type->isSignedIntegerOrEnumerationType() && (bitsOf >> (bits - 1)))
+			bitsOf |= ~mask;
+		return (int64_t)bitsOf;
 	}
 
 	void cast(CastExpr * castexpr) {
-	   mStack.back().setPC(castexpr);
+	   ctx().stack.back().setPC(castexpr);
 	   if (castexpr->getType()->isIntegerType()) {
-		   int64_t val = mStack.back().getStmtVal(castexpr->getSubExpr());
-		   mStack.back().bindStmt(castexpr, val);
+		   int64_t val = ctx().stack.back().getStmtVal(castexpr->getSubExpr());
+		   ctx().stack.back().bindStmt(castexpr, normalize(val, castexpr->getType()));
 	   } 
 	   else if (castexpr->getType()->isPointerType()) {
 		   if ( castexpr->getCastKind() == CK_LValueToRValue || castexpr->getCastKind() == CK_ArrayToPointerDecay || 
 				castexpr->getCastKind() == CK_PointerToIntegral || castexpr->getCastKind() == CK_BitCast){
-			   int64_t val = mStack.back().getStmtVal(castexpr->getSubExpr());
-			   mStack.back().bindStmt(castexpr, val);
+			   int64_t val = ctx().stack.back().getStmtVal(castexpr->getSubExpr());
+			   ctx().stack.back().bindStmt(castexpr, val);
 		   }
 	   }else { 
 			llvm::errs() << "		cast nothing" << "\n"; 
@@ -262,20 +1537,40 @@ public:
    }
 
    void arrayexpr(ArraySubscriptExpr * asexpr) {
-	   int64_t *array = (int64_t *)mStack.back().getStmtVal(asexpr->getBase());
-	   int64_t idx = mStack.back().getStmtVal(asexpr->getIdx());
-			llvm::errs() << "		ArraySubscriptExpr asexpr" << array[idx] << "\n"; 
+	   int64_t array = ctx().stack.back().getStmtVal(asexpr->getBase());
+	   int64_t idx = ctx().stack.back().getStmtVal(asexpr->getIdx());
+	   // the row of a 2-D array or a record element is its address
+	   int64_t addr = array + idx * sizeOf(asexpr->getType());
+	   int64_t val = aggregate(asexpr->getType()) ? addr : load(addr, asexpr->getType());
+			llvm::errs() << "		ArraySubscriptExpr asexpr" << val << "\n"; 
 
-	   mStack.back().bindStmt(asexpr, array[idx]);
+	   ctx().stack.back().bindStmt(asexpr, val);
    }
 
+	/// s.f and p->f, whose base the visitor has evaluated to an address
+	int64_t memberAddress(MemberExpr * member) {
+		FieldDecl * field = llvm::cast<FieldDecl>(member->getMemberDecl());
+		return ctx().stack.back().getStmtVal(member->getBase()) + fieldOffset(field);
+	}
+
+	void memberexpr(MemberExpr * member) {
+		ctx().stack.back().setPC(member);
+		FieldDecl * field = dyn_cast<FieldDecl>(member->getMemberDecl());
+		if (!field || field->isBitField()) {
+			fail("unsupported", "member " + member->getMemberDecl()->getNameAsString(), member);
+			return;
+		}
+		int64_t addr = memberAddress(member);
+		ctx().stack.back().bindStmt(member, aggregate(member->getType()) ? addr : load(addr, member->getType()));
+	}
+
 	void mStack_bindStmt(CallExpr *call, int64_t retvalue){
 		cout << "		push_func_stack_stmt = " << call << endl;
-		mStack.back().bindStmt(call, retvalue);
+		ctx().stack.back().bindStmt(call, retvalue);
 	}
 
 	void mStack_pop_back(){
-		mStack.pop_back();
+		ctx().stack.pop_back();
 		setReturn(false, 0);
 	}
    	/// !TODO Support comparison operation
@@ -289,112 +1584,162 @@ public:
 		llvm::errs() << "		binop right : " << right->getStmtClassName() << " " << right << "\n";
 		// isAssignmentOp : 判断是赋值语句还是一个 +-*/的语句
 	   	if (bop->isAssignmentOp()) { 
-			//if left expr is a refered expr, bind the right value to it
-		   	if (DeclRefExpr * declexpr = dyn_cast<DeclRefExpr>(left)) {
-				//获取发生此引用的NamedDecl,绑定右节点的值到左节点
-				int64_t val = Expr_GetVal(right);
-				mStack.back().bindStmt(left, val);
-			   	Decl * decl = declexpr->getFoundDecl();
-			   	mStack.back().bindDecl(decl, val);
-		   	}else if (auto array = dyn_cast<ArraySubscriptExpr>(left))
-			{
-				if (DeclRefExpr *declexpr = dyn_cast<DeclRefExpr>(array->getLHS()->IgnoreImpCasts()))
-				{
-					Decl *decl = declexpr->getFoundDecl();
-					int64_t val = mStack.back().getStmtVal(right);
-
-					std::cout << "		binop ArraySubscriptExpr : " <<  val << endl;
-					int64_t index = Expr_GetVal(array->getRHS());
-					if (VarDecl *vardecl = dyn_cast<VarDecl>(decl)){
-						if (auto array = dyn_cast<ConstantArrayType>(vardecl->getType().getTypePtr())){	
-						   void * addr = (void *)mStack.back().getDeclVal(vardecl);
-							if (array->getElementType().getTypePtr()->isIntegerType() || array->getElementType().getTypePtr()->isPointerType()){ // int64_t a[3];
-								*((int64_t *)addr+index) = val;
-							}else if (array->getElementType().getTypePtr()->isCharType()){ // char a[3];
-								*((char *)addr+index) = (char)val;
-							}
-						}
-					}
-				}
-			}else if (auto unaryExpr = dyn_cast<UnaryOperator>(left))
-			{ // *(p+1)
-				if( (unaryExpr->getOpcode()) == UO_Deref)
-				{
-					int64_t val = mStack.back().getStmtVal(right);
-					int64_t addr = mStack.back().getStmtVal(unaryExpr->getSubExpr());
-					int64_t *p = (int64_t *)addr;
-					*p = val;
+			int64_t val = Expr_GetVal(right);
+			if (bop->isCompoundAssignmentOp()) {
+				// x op= y, with the old value the visitor loaded
+				BinaryOperatorKind op = BinaryOperator::getOpForCompoundAssignment(Opcode);
+				int64_t old = Expr_GetVal(left);
+				if (left->getType()->isPointerType()) {
+					val = old + (op == BO_Add ? val : -val) * sizeOf(left->getType()->getPointeeType());
+				} else {
+					// computed in the promoted type, then narrowed back to left's
+					QualType type = llvm::cast<CompoundAssignOperator>(bop)->getComputationLHSType();
+					val = normalize(arith(op, normalize(old, type), val, type, bop), left->getType());
 				}
 			}
+			assignTo(left, val);
+			ctx().stack.back().bindStmt(bop, val);
 	   	}
+		else if (bop->isLogicalOp()) {
+			// the visitor evaluated the right operand only if it was needed
+			int64_t l = Expr_GetVal(left) != 0;
+			int64_t result = l == (Opcode == BO_LAnd) ? Expr_GetVal(right) != 0 : l;
+			ctx().stack.back().bindStmt(bop, result);
+		}
 		else{
 			// 不是所有stmt都能getStmtVal，我们这里选择expr函数来进行解析
 			int64_t result;
-			switch (Opcode)
-			{
-			case BO_Add: // + 
-					if(left->getType().getTypePtr()->isPointerType()) // 指针+8*index后存取
-					{
-						int64_t ptr = mStack.back().getStmtVal(left);
-						result = ptr + 8 * Expr_GetVal(right);
-					}else{
-						result = Expr_GetVal(left) + Expr_GetVal(right);	
-					}
-				break;
-			case BO_Sub: // -
-				result = Expr_GetVal(left) - Expr_GetVal(right);
-				break;
-			case BO_Mul: // *
-				result = Expr_GetVal(left) * Expr_GetVal(right);
-				break;
-			case BO_Div: //  / ; check the b can not be 0
-				if (Expr_GetVal(right) == 0){
-					llvm::errs() << "		the BinaryOperator /, can not div 0 " << "\n";
-					exit(0);
-				}
-				result = Expr_GetVal(left) / Expr_GetVal(right);
-				break;
-			case BO_LT: // <
-				result = (Expr_GetVal(left) < Expr_GetVal(right)) ? 1:0;
-				break;
-			case BO_GT: // >
-				result = (Expr_GetVal(left) > Expr_GetVal(right)) ? 1:0;
-				break;
-			case BO_EQ: // ==
-				result = (Expr_GetVal(left) == Expr_GetVal(right)) ? 1:0;
-				break;
-			case BO_GE:  //>=
-				if( Expr_GetVal(left) >= Expr_GetVal(right) )
-					result = 1;
-				else
-					result = 0;
-				break;
-			case BO_LE:  //>=
-				if( Expr_GetVal(left) <= Expr_GetVal(right) )
-					result = 1;
-				else
-					result = 0;
-				break;
-			case BO_NE: // !=
-				if( Expr_GetVal(left) != Expr_GetVal(right) )
-					result = 1;
-				else
-					result = 0;
-				break;
-			default:
-				llvm::errs() << "		process binaryOp error" << "\n";
-				exit(0);
-				break;
+			if (Opcode == BO_Add && left->getType()->isPointerType()) // 指针+元素大小*index后存取
+				result = ctx().stack.back().getStmtVal(left) + sizeOf(left->getType()->getPointeeType()) * Expr_GetVal(right);
+			else if (Opcode == BO_Add && right->getType()->isPointerType())
+				result = ctx().stack.back().getStmtVal(right) + sizeOf(right->getType()->getPointeeType()) * Expr_GetVal(left);
+			else if (Opcode == BO_Sub && left->getType()->isPointerType() && right->getType()->isPointerType())
+				result = (ctx().stack.back().getStmtVal(left) - ctx().stack.back().getStmtVal(right)) /
+					sizeOf(left->getType()->getPointeeType());
+			else if (Opcode == BO_Sub && left->getType()->isPointerType())
+				result = ctx().stack.back().getStmtVal(left) - sizeOf(left->getType()->getPointeeType()) * Expr_GetVal(right);
+			else
+				result = arith(Opcode, Expr_GetVal(left), Expr_GetVal(right), left->getType(), bop);
+			ctx().stack.back().bindStmt(bop, result);
+		}
+	}
+
+	/// && and ||: binds the result and returns true when the left operand,
+	/// which the visitor has evaluated, decides it
+	bool shortCircuit(BinaryOperator * bop) {
+		int64_t l = Expr_GetVal(bop->getLHS()) != 0;
+		if (l == (bop->getOpcode() == BO_LAnd))
+			return false;
+		ctx().stack.back().bindStmt(bop, l);
+		return true;
+	}
+
+	/// l op r on operands of type, the same after the usual conversions but
+	/// for a shift's count; the result wraps like the kernels' do. A
+	/// division by zero fails and yields 0.
+	int64_t arith(BinaryOperatorKind op, int64_t l, int64_t r, QualType type, Expr * where) {
+		bool sign = type->isSignedIntegerOrEnumerationType();
+		uint64_t ul = l, ur = r;
+		// a shift's count is taken modulo the width of the promoted left operand
+		uint64_t count = ur & (mContext->getTypeSize(type) - 1);
+		int64_t result;
+		switch (op)
+		{
+		case BO_Add: // + 
+			result = ul + ur;
+			break;
+		case BO_Sub: // -
+			result = ul - ur;
+			break;
+		case BO_Mul: // *
+			result = ul * ur;
+			break;
+		case BO_Div: //  / ; check the b can not be 0
+		case BO_Rem: //  %
+			if (r == 0){
+				fail("division-by-zero", "division by zero", where);
+				return 0;
 			}
+			if (!sign)
+				result = op == BO_Div ? ul / ur : ul % ur;
+			else if (r == -1)
+				result = op == BO_Div ? (int64_t)(0 - ul) : 0;
+			else
+				result = op == BO_Div ? l / r : l % r;
+			break;
+		case BO_And: // &
+			result = l & r;
+			break;
+		case BO_Or: // |
+			result = l | r;
+			break;
+		case BO_Xor: // ^
+			result = l ^ r;
+			break;
+		case BO_Shl: // <<
+			result = ul << count;
+			break;
+		case BO_Shr: // >>
+			result = sign ? l >> count : (int64_t)(ul >> count);
+			break;
+		case BO_LT: // <
+			return sign ? l < r : ul < ur;
+		case BO_GT: // >
+			return sign ? l > r : ul > ur;
+		case BO_LE: // <=
+			return sign ? l <= r : ul <= ur;
+		case BO_GE: // >=
+			return sign ? l >= r : ul >= ur;
+		case BO_EQ: // ==
+			return l == r;
+		case BO_NE: // !=
+			return l != r;
+		default:
+			llvm::errs() << "		process binaryOp error" << "\n";
+			exit(0);
+		}
+		return normalize(result, type);
+	}
 
-			mStack.back().bindStmt(bop, result);
+	/// Stores val to the lvalue e, whose subexpressions the visitor has
+	/// evaluated
+	void assignTo(Expr * e, int64_t val) {
+		e = e->IgnoreParens();
+		//if left expr is a refered expr, bind the value to it
+		if (DeclRefExpr * declexpr = dyn_cast<DeclRefExpr>(e)) {
+			//获取发生此引用的NamedDecl,绑定右节点的值到左节点
+			ctx().stack.back().bindStmt(e, val);
+			Decl * decl = declexpr->getFoundDecl();
+			VarDecl * var = dyn_cast<VarDecl>(decl);
+			if (var && inMemory(var))
+				store(getDeclVal_GM(var), var->getType(), val);
+			else
+				ctx().stack.back().bindDecl(decl, val);
+		}else if (auto array = dyn_cast<ArraySubscriptExpr>(e))
+		{
+			std::cout << "		binop ArraySubscriptExpr : " <<  val << endl;
+			int64_t base = ctx().stack.back().getStmtVal(array->getBase());
+			int64_t index = ctx().stack.back().getStmtVal(array->getIdx());
+			store(base + index * sizeOf(array->getType()), array->getType(), val);
+		}else if (auto member = dyn_cast<MemberExpr>(e))
+		{
+			store(memberAddress(member), member->getType(), val);
+		}else if (auto unaryExpr = dyn_cast<UnaryOperator>(e))
+		{ // *(p+1)
+			if( (unaryExpr->getOpcode()) == UO_Deref)
+			{
+				int64_t addr = ctx().stack.back().getStmtVal(unaryExpr->getSubExpr());
+				store(addr, unaryExpr->getType(), val);
+			}
 		}
 	}
 
 	//CFG: 表示源级别的过程内CFG，它表示Stmt的控制流。
 	//DeclStmt-用于将声明与语句和表达式混合的适配器类
 	// 声明的变量，函数，枚举
-   	void decl(DeclStmt * declstmt) {
+	/// Binds the variables of a declaration; without init, zeroed, as for
+	/// one a case label jumps past
+   	void decl(DeclStmt * declstmt, bool init = true) {
 		cout << "		[*] decl !!!" << endl;
 	   	for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++ it) {
 			//in ast, the sub-node is usually VarDecl
@@ -405,35 +1750,18 @@ public:
 					|| vardecl->getType().getTypePtr()->isCharType() )
 				{
 					int64_t val = 0;
-					if (vardecl->hasInit()) {
+					if (init && vardecl->hasInit()) {
 						val = Expr_GetVal(vardecl->getInit());
 					}
-					mStack.back().bindDecl(vardecl, val);
-				}else if(vardecl->getType().getTypePtr()->isConstantArrayType()) { //array
-					if (auto array = dyn_cast<ConstantArrayType>(vardecl->getType().getTypePtr())){ // array declstmt, bind a's addr to the vardecl.
-						int64_t size = array->getSize().getSExtValue();
-						if (array->getElementType().getTypePtr()->isIntegerType()){ // int a[3]; 
-							int64_t *my_array = new int64_t[size];
-							for (int i = 0; i < size; i++)
-								my_array[i] = 0x61;
-							mStack.back().bindDecl(vardecl, (int64_t)my_array);
-							std::cout << "		mMalloc : " <<  my_array << endl;
-							std::cout << "		mMalloc : " <<  my_array[0] << endl;
-						}else if (array->getElementType().getTypePtr()->isCharType()){ // char a[3];
-							char *my_array = new char[size];
-							for (int i = 0; i < size; i++)
-								my_array[i] = 0;
-							mStack.back().bindDecl(vardecl, (int64_t)my_array);
-							std::cout << "		mMalloc : " <<  my_array << endl;
-							std::cout << "		mMalloc : " <<  my_array[0] << endl;
-						}else if(array->getElementType().getTypePtr()->isPointerType()){  // int* a[3];
-							int64_t **my_array = new int64_t *[size];
-							for (int i = 0; i < size; i++)
-								my_array[i] = 0;
-							mStack.back().bindDecl(vardecl, (int64_t)my_array);
-							std::cout << "		mMalloc : " <<  my_array << endl;
-							std::cout << "		mMalloc : " <<  my_array[0] << endl;
-						}
+					bindVar(ctx().stack.back(), vardecl, val);
+				}else if(vardecl->getType().getTypePtr()->isConstantArrayType() || vardecl->getType()->isRecordType()) { //array
+					if (isa<ConstantArrayType>(vardecl->getType().getTypePtr()) || vardecl->getType()->isRecordType()){ // array or struct declstmt, bind its addr to the vardecl.
+						// int a[3], char a[3], int* a[3]: zeroed, at the element size
+						int64_t my_array = ctx().stack.back().allocate(sizeOf(vardecl->getType()), mShadow);
+						ctx().stack.back().bindDecl(vardecl, my_array);
+						std::cout << "		mMalloc : " << (void *)my_array << endl;
+						if (init && vardecl->hasInit() && !storeInit(my_array, vardecl->getType(), vardecl->getInit()))
+							fail("unsupported", "initializer of " + vardecl->getNameAsString(), declstmt);
 					}
 				}
 		   	}
@@ -443,15 +1771,15 @@ public:
     // 对已声明的变量，函数，枚举等的引用
    	void declref(DeclRefExpr * declref) {
 		llvm::errs() << "		declref : " << declref->getFoundDecl()->getNameAsString() << "\n";
-	   	mStack.back().setPC(declref);
+	   	ctx().stack.back().setPC(declref);
 		if (declref->getType()->isCharType() || declref->getType()->isPointerType() || declref->getType()->isIntegerType()){
 			Decl *decl = declref->getFoundDecl();
-			int64_t val = getDeclVal_GM(decl);
-			mStack.back().bindStmt(declref, val);
-	   	} else if (declref->getType()->isArrayType()) {
+			int64_t val = readVar(decl);
+			ctx().stack.back().bindStmt(declref, val);
+	   	} else if (aggregate(declref->getType())) {
 		   Decl * decl = declref->getFoundDecl();
 		   int64_t val = getDeclVal_GM(decl);
-		   mStack.back().bindStmt(declref, val);
+		   ctx().stack.back().bindStmt(declref, val);
 		}
 		else{
 			llvm::errs() << "		declref nothing" <<"\n";
@@ -463,7 +1791,7 @@ public:
    	bool getcond(/*BinaryOperator *bop*/Expr *expr)
    	{
 		cout<<"		getcond"<<endl;
-   		return mStack.back().getStmtVal(expr);
+   		return ctx().stack.back().getStmtVal(expr);
    	}
 
 	void returnstmt(ReturnStmt *returnStmt)
@@ -483,10 +1811,11 @@ public:
 			if(sizeofexpr->getKind() == UETT_SizeOf ||  sizeofexpr->getArgumentType()->isPointerType())
 			{
 				//if the arg type is integer type, we bind sizeof(long) to UnaryExprOrTypeTraitExpr
-				if(sizeofexpr->getArgumentType()->isIntegerType()|| sizeofexpr->getArgumentType()->isPointerType())
+				if(sizeofexpr->getTypeOfArgument()->isIntegerType()|| sizeofexpr->getTypeOfArgument()->isPointerType() ||
+				   aggregate(sizeofexpr->getTypeOfArgument()))
 				{
-					int64_t val = sizeof(int64_t);
-					mStack.back().bindStmt(uop,val);
+					int64_t val = sizeOf(sizeofexpr->getTypeOfArgument());
+					ctx().stack.back().bindStmt(uop,val);
 				}else{
 					cout<<"		unarysizeof nothing"<<endl;
 				}  
@@ -503,21 +1832,39 @@ public:
 		switch (op)
 		{
 		case UO_Minus: //'-'
-			mStack.back().bindStmt(unaryExpr, -1 * Expr_GetVal(exp));
+			ctx().stack.back().bindStmt(unaryExpr, normalize(0 - (uint64_t)Expr_GetVal(exp), unaryExpr->getType()));
 			break;
 		case UO_Plus: //'+'
-			mStack.back().bindStmt(unaryExpr, Expr_GetVal(exp));
+			ctx().stack.back().bindStmt(unaryExpr, Expr_GetVal(exp));
 			break;
 		case UO_Deref: // '*'
-			mStack.back().bindStmt(unaryExpr, *(int64_t *)Expr_GetVal(exp));
+			ctx().stack.back().bindStmt(unaryExpr, aggregate(unaryExpr->getType()) ? Expr_GetVal(exp)
+			                                       : load(Expr_GetVal(exp), unaryExpr->getType()));
 			llvm::errs() << "unaryop :" << Expr_GetVal(exp) << "\n";
 			// llvm::errs() << "unaryop :" << *(Expr_GetVal(exp)) << "\n";
 			break;
-		case UO_AddrOf: // '&',deref,bind the address of expr to UnaryOperator
-			mStack.back().bindStmt(unaryExpr,(int64_t)exp);
-			llvm::errs() << long(exp) << "\n";
-			//mStack.back().bindStmt(uop, mHeap.Get(val));
+		case UO_AddrOf: // '&',bind the address of the lvalue to UnaryOperator
+			ctx().stack.back().bindStmt(unaryExpr, addressOf(exp));
+			break;
+		case UO_LNot: // '!'
+			ctx().stack.back().bindStmt(unaryExpr, Expr_GetVal(exp) == 0);
+			break;
+		case UO_Not: // '~'
+			ctx().stack.back().bindStmt(unaryExpr, normalize(~Expr_GetVal(exp), unaryExpr->getType()));
 			break;
+		case UO_PreInc: // ++x, x++, --x, x--; the value is the new one or the old one
+		case UO_PostInc:
+		case UO_PreDec:
+		case UO_PostDec: {
+			int64_t old = Expr_GetVal(exp);
+			int64_t step = exp->getType()->isPointerType() ? sizeOf(exp->getType()->getPointeeType()) : 1;
+			int64_t val = unaryExpr->isIncrementOp() ? old + step : old - step;
+			if (!exp->getType()->isPointerType())
+				val = normalize(val, exp->getType());
+			assignTo(exp, val);
+			ctx().stack.back().bindStmt(unaryExpr, unaryExpr->isPrefix() ? val : old);
+			break;
+		}
 		default:
 			llvm::errs() << "		process unaryOp error" << "\n";
 			exit(0);
@@ -525,73 +1872,101 @@ public:
 		}
 	}
 
-   	/// !TODO Support Function Call
-   	void call(CallExpr * callexpr) {
-	   	mStack.back().setPC(callexpr);
+   	/// Returns true when a frame was pushed for a user-defined callee whose
+   	/// body the visitor has to walk next.
+   	bool call(CallExpr * callexpr) {
+	   	ctx().stack.back().setPC(callexpr);
 	   	int64_t val = 0;
 	   	FunctionDecl * callee = callexpr->getDirectCallee();
 	   	if (callee == mInput) {
-		  	llvm::errs() << "		Please Input an Integer Value : ";
-			cin >> val;
-
-			mStack.back().bindStmt(callexpr, val);
+			val = input();
+			ctx().stack.back().bindStmt(callexpr, val);
 	   	} else if (callee == mOutput) {
 			// Todo: cout the char value.
 			Expr *decl = callexpr->getArg(0);
-			Expr *exp = decl->IgnoreImpCasts();
 			val = Expr_GetVal(decl);
-			std::cout << "	output : " << val << endl;
+			output(val);
 		}else if (callee == mMalloc){
-		   int64_t malloc_size = mStack.back().getStmtVal(callexpr->getArg(0));
+		   int64_t malloc_size = ctx().stack.back().getStmtVal(callexpr->getArg(0));
 			// int64_t malloc_size = Expr_GetVal(callexpr->getArg(0));
-			int64_t *p = (int64_t *)std::malloc(malloc_size);
-			std::cout << "	mMalloc : " <<  (int64_t)p << endl;
-			std::cout << "	mMalloc : " <<  *p << endl;
-			mStack.back().bindStmt(callexpr, (int64_t)p);
+			int64_t p = allocate(malloc_size);
+			std::cout << "	mMalloc : " <<  p << endl;
+			ctx().stack.back().bindStmt(callexpr, p);
 		}else if (callee == mFree){
-			int64_t *p = (int64_t *)Expr_GetVal(callexpr->getArg(0));
-			std::free(p);
+			release(Expr_GetVal(callexpr->getArg(0)));
+		}else if (callee == mParallelFor){
+			if (FunctionDecl * func = parallelBody(callexpr))
+				parallelFor(func, Expr_GetVal(callexpr->getArg(0)), Expr_GetVal(callexpr->getArg(1)), callexpr);
+			else
+				fail("unsupported", "PARALLEL_FOR takes the name of a function of one parameter", callexpr);
 		}else{  // other callee
 			cout<<"		other callee"<<endl;
+			if (!enterCall(callexpr))
+				return false;
+			NativeTier::Entry entry = native(callee);
+			const Code * code = entry ? nullptr : prepared(callee);
+			if (entry || code) {
+				std::vector<int64_t> args;
+				for (auto it = callexpr->arg_begin(), ie = callexpr->arg_end(); it != ie; ++it)
+					args.push_back(Expr_GetVal(*it));
+				ctx().stack.back().bindStmt(callexpr, entry ? callNative(entry, args.data())
+				                                       : machine().run(code, args.data(), args.size()));
+				return false;
+			}
+			// the body refers to the parameters of the definition
+			if (FunctionDecl * def = callee->getDefinition())
+				callee = def;
 			StackFrame stack;
+			stack.setFunction(callee->getCanonicalDecl());
 			auto pit=callee->param_begin();
 			for(auto it=callexpr->arg_begin(), ie=callexpr->arg_end();it!=ie;++it,++pit)
 			{
-				// int64_t val=mStack.back().getStmtVal(*it);
-				stack.bindDecl(*pit,Expr_GetVal(*it));
+				// int64_t val=ctx().stack.back().getStmtVal(*it);
+				bindVar(stack, *pit, Expr_GetVal(*it));
 			}
-			mStack.push_back(stack);
+			ctx().stack.push_back(stack);
+			noteDepth();
+			return true;
 	   	}
+		return false;
    	}
 
 	int64_t Expr_GetVal(Expr *exp)
 	{
+		// implicit integer conversions wrap like explicit ones
+		if (ImplicitCastExpr * conv = dyn_cast<ImplicitCastExpr>(exp))
+			if (conv->getCastKind() == CK_IntegralCast || conv->getCastKind() == CK_IntegralToBoolean)
+				return normalize(Expr_GetVal(conv->getSubExpr()), conv->getType());
 		//跳过可能围绕此表达式的所有隐式强制转换，直到达到固定点为止
 		exp = exp->IgnoreImpCasts();
 		if (auto decl = dyn_cast<DeclRefExpr>(exp)){
-			cout << "		DeclRefExpr" << getDeclVal_GM(decl->getDecl()) <<"\n";
-			return getDeclVal_GM(decl->getDecl());
+			cout << "		DeclRefExpr" << readVar(decl->getDecl()) <<"\n";
+			return readVar(decl->getDecl());
 		}else if (auto intLiteral = dyn_cast<IntegerLiteral>(exp)){     //a = 12
 			cout << "		IntegerLiteral" << intLiteral->getValue().getSExtValue() <<"\n";
 			return intLiteral->getValue().getSExtValue(); 
 		}else if (auto unaryExpr = dyn_cast<UnaryOperator>(exp)){      // a = -13 and a = +12;
-			unaryop(unaryExpr);
-			cout << "		UnaryOperator" << mStack.back().getStmtVal(unaryExpr) <<"\n";
-			int64_t result = mStack.back().getStmtVal(unaryExpr);
+			// ++ and -- ran once already, when the visitor reached them
+			if (!unaryExpr->isIncrementDecrementOp())
+				unaryop(unaryExpr);
+			cout << "		UnaryOperator" << ctx().stack.back().getStmtVal(unaryExpr) <<"\n";
+			int64_t result = ctx().stack.back().getStmtVal(unaryExpr);
 			return result;
 		}else if (auto charLiteral = dyn_cast<CharacterLiteral>(exp)){  // a = 'a'
 			cout << "		CharacterLiteral" << charLiteral->getValue() <<"\n";
 			return charLiteral->getValue(); // Clang/AST/Expr.h/ line 1369
 		}else if (auto binaryExpr = dyn_cast<BinaryOperator>(exp)){     //+ - * / < > ==
-			binop(binaryExpr); // 这个是为了在for语句的时候直接解析`a < 10`语句而不调用visit->binop
-			cout << "		BinaryOperator" << mStack.back().getStmtVal(binaryExpr) <<"\n";
-			return mStack.back().getStmtVal(binaryExpr);
+			// so do assignments
+			if (!binaryExpr->isAssignmentOp())
+				binop(binaryExpr);
+			cout << "		BinaryOperator" << ctx().stack.back().getStmtVal(binaryExpr) <<"\n";
+			return ctx().stack.back().getStmtVal(binaryExpr);
 		}else if (auto callexpr = dyn_cast<CallExpr>(exp)){
-			cout << "		CallExpr" << mStack.back().getStmtVal(callexpr) <<"\n";
-			return mStack.back().getStmtVal(callexpr);
+			cout << "		CallExpr" << ctx().stack.back().getStmtVal(callexpr) <<"\n";
+			return ctx().stack.back().getStmtVal(callexpr);
 		}else {
-			cout << "		null" << mStack.back().getStmtVal(exp) <<"\n";
-		   	return mStack.back().getStmtVal(exp);
+			cout << "		null" << ctx().stack.back().getStmtVal(exp) <<"\n";
+		   	return ctx().stack.back().getStmtVal(exp);
 	   	}
 		llvm::errs() << "		have not handle this situation" << "\n";
 		return 0;
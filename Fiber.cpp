@@ -0,0 +1,53 @@
+//==--- Fiber.cpp - Guest programs that give their thread back -------------===//
+//===----------------------------------------------------------------------===//
+#include "Fiber.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Fiber::Fiber(std::function<void()> body, size_t stackSize)
+   : mBody(std::move(body)), mStackSize(stackSize) {
+}
+
+Fiber::~Fiber() {
+   if (mStack)
+      munmap(mStack, mStackSize);
+}
+
+void Fiber::entry(unsigned high, unsigned low) {
+   // makecontext only passes ints
+   Fiber * fiber = (Fiber *)(((uintptr_t)high << 32) | low);
+   fiber->mBody();
+   fiber->mDone = true;
+   // uc_link takes it back to the last resume
+}
+
+bool Fiber::resume() {
+   if (mDone)
+      return false;
+   if (!mStarted) {
+      // the lowest page stays unmapped, so an overflow faults instead of
+      // running into whatever is mapped below
+      mStack = mmap(nullptr, mStackSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (mStack == MAP_FAILED) {
+         mStack = nullptr;
+         return false;
+      }
+      mprotect(mStack, sysconf(_SC_PAGESIZE), PROT_NONE);
+      getcontext(&mContext);
+      mContext.uc_stack.ss_sp = mStack;
+      mContext.uc_stack.ss_size = mStackSize;
+      mContext.uc_link = &mCaller;
+      uintptr_t self = (uintptr_t)this;
+      makecontext(&mContext, (void (*)())entry, 2, (unsigned)(self >> 32), (unsigned)self);
+      mStarted = true;
+   }
+   swapcontext(&mCaller, &mContext);
+   return !mDone;
+}
+
+void Fiber::suspend() {
+   swapcontext(&mContext, &mCaller);
+}
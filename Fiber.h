@@ -0,0 +1,51 @@
+//==--- Fiber.h - Guest programs that give their thread back ---------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_FIBER_H
+#define AST_INTERPRETER_FIBER_H
+
+#include <ucontext.h>
+
+#include <functional>
+
+/// Runs a function on a stack of its own, so that it can stop halfway and
+/// be resumed later from where it stopped. The walker recurses on the host
+/// stack and prepared code keeps its frames in the Machine, so switching
+/// stacks suspends both engines in the middle of any guest call chain.
+///
+/// Stacks are reserved, not committed: a fiber costs the pages its deepest
+/// guest recursion touched, and an idle one nothing but those.
+class Fiber {
+public:
+   /// Enough for the walker on the guest recursion depths the main thread
+   /// handles
+   static const size_t DefaultStackSize = 8 << 20;
+
+   explicit Fiber(std::function<void()> body, size_t stackSize = DefaultStackSize);
+   ~Fiber();
+   Fiber(const Fiber &) = delete;
+   Fiber &operator=(const Fiber &) = delete;
+
+   /// Run the body until it suspends or returns; false once it returned,
+   /// and without done() when the stack could not be mapped
+   bool resume();
+
+   /// From inside the body: switch back to the caller of resume
+   void suspend();
+
+   bool done() const {
+      return mDone;
+   }
+
+private:
+   static void entry(unsigned high, unsigned low);
+
+   std::function<void()> mBody;
+   ucontext_t mContext;
+   ucontext_t mCaller;
+   void * mStack = nullptr;
+   size_t mStackSize;
+   bool mStarted = false;
+   bool mDone = false;
+};
+
+#endif
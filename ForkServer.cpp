@@ -0,0 +1,190 @@
+//==--- ForkServer.cpp - Run a prepared program once per input -------------===//
+//===----------------------------------------------------------------------===//
+#include "ForkServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+
+struct Child {
+   size_t input;
+   pid_t pid;
+   int output;
+};
+
+struct Result {
+   bool done = false;
+   std::string output;
+   /// Exit status, or a message when the input was not run
+   int status = 0;
+   std::string error;
+};
+
+bool writeAll(int fd, const char * data, size_t size) {
+   while (size) {
+      ssize_t n = write(fd, data, size);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return false;
+      data += n;
+      size -= n;
+   }
+   return true;
+}
+
+std::string readAll(int fd) {
+   std::string data;
+   char buf[4096];
+   for (;;) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return data;
+      data.append(buf, n);
+   }
+}
+
+/// In the child: read the whole input, run with its trace output on stdout
+/// dropped, send PRINT's output back and leave without running the
+/// parent's atexit handlers or flushing its buffers a second time
+[[noreturn]] void child(int input, int output,
+                        const std::function<int(std::istream &, std::ostream &)> &run) {
+   std::istringstream in(readAll(input));
+   close(input);
+   int null = open("/dev/null", O_WRONLY);
+   if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      close(null);
+   }
+   std::ostringstream out;
+   int status = run(in, out);
+   std::cout.flush();
+   std::string text = out.str();
+   writeAll(output, text.data(), text.size());
+   close(output);
+   _exit(status);
+}
+
+} // namespace
+
+bool serveForked(const std::vector<std::string> &inputs, unsigned jobs,
+                 const std::function<int(std::istream &, std::ostream &)> &run,
+                 llvm::raw_ostream &report) {
+   if (!jobs)
+      jobs = std::max(1u, std::thread::hardware_concurrency());
+   // a child that exits early must not kill the parent writing its input
+   signal(SIGPIPE, SIG_IGN);
+   std::vector<Result> results(inputs.size());
+   std::vector<Child> running;
+   size_t next = 0, reported = 0;
+   bool ok = true;
+
+   while (reported < inputs.size()) {
+      while (running.size() < jobs && next < inputs.size()) {
+         size_t i = next++;
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> data = llvm::MemoryBuffer::getFileOrSTDIN(inputs[i]);
+         int in[2], out[2];
+         if (!data) {
+            results[i].error = data.getError().message();
+         } else if (pipe(in) != 0) {
+            results[i].error = strerror(errno);
+         } else if (pipe(out) != 0) {
+            results[i].error = strerror(errno);
+            close(in[0]);
+            close(in[1]);
+         } else {
+            // buffered output would otherwise be written by the child too
+            std::cout.flush();
+            fflush(stdout);
+            report.flush();
+            pid_t pid = fork();
+            if (pid == 0) {
+               close(in[1]);
+               close(out[0]);
+               for (const Child &other : running)
+                  close(other.output);
+               child(in[0], out[1], run);
+            }
+            close(in[0]);
+            close(out[1]);
+            if (pid < 0) {
+               results[i].error = strerror(errno);
+               close(in[1]);
+               close(out[0]);
+            } else {
+               writeAll(in[1], (*data)->getBufferStart(), (*data)->getBufferSize());
+               close(in[1]);
+               running.push_back(Child{i, pid, out[0]});
+            }
+         }
+         if (!results[i].error.empty())
+            results[i].done = true;
+      }
+
+      if (!running.empty()) {
+         std::vector<pollfd> fds;
+         for (const Child &c : running)
+            fds.push_back(pollfd{c.output, POLLIN, 0});
+         if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+            report << "error: poll: " << strerror(errno) << "\n";
+            return false;
+         }
+         for (size_t k = fds.size(); k-- > 0; ) {
+            if (!fds[k].revents)
+               continue;
+            Child c = running[k];
+            char buf[4096];
+            ssize_t n = read(c.output, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+               continue;
+            if (n > 0) {
+               results[c.input].output.append(buf, n);
+               continue;
+            }
+            close(c.output);
+            int status = 0;
+            while (waitpid(c.pid, &status, 0) < 0 && errno == EINTR)
+               ;
+            Result &r = results[c.input];
+            r.done = true;
+            if (WIFEXITED(status))
+               r.status = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+               r.error = std::string("killed by signal ") + strsignal(WTERMSIG(status));
+            running.erase(running.begin() + k);
+         }
+      }
+
+      // in input order, as soon as the next one is in
+      while (reported < inputs.size() && results[reported].done) {
+         Result &r = results[reported];
+         report << "== " << inputs[reported] << ": ";
+         if (r.error.empty())
+            report << "exit " << r.status << "\n";
+         else
+            report << r.error << "\n";
+         report << r.output;
+         report.flush();
+         ok = ok && r.error.empty() && r.status == 0;
+         r.output.clear();
+         ++reported;
+      }
+   }
+   return ok;
+}
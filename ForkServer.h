@@ -0,0 +1,32 @@
+//==--- ForkServer.h - Run a prepared program once per input ---------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_FORKSERVER_H
+#define AST_INTERPRETER_FORKSERVER_H
+
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class raw_ostream;
+}
+
+/// Runs the guest once per input file, each time in a child forked from the
+/// calling process, so parsing and preparation are paid once and the
+/// children share their pages copy-on-write. The caller prepares every
+/// reachable function first (Environment::prepareReachable): code a child
+/// lowers on a first call is lost when it exits. A child gets the input file
+/// over a pipe as the stream GET reads from, and hands back what PRINT wrote
+/// and its exit status. Up to jobs children run at once, 0 means one per
+/// core.
+///
+/// run executes the program in the child and returns its exit status.
+/// report gets "== <input>: exit <status>" and the output for each input,
+/// in input order. Returns false when an input could not be run or a child
+/// did not exit with 0.
+bool serveForked(const std::vector<std::string> &inputs, unsigned jobs,
+                 const std::function<int(std::istream &, std::ostream &)> &run,
+                 llvm::raw_ostream &report);
+
+#endif
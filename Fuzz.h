@@ -0,0 +1,33 @@
+//==--- Fuzz.h - In-process runs for the differential fuzzer ---------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_FUZZ_H
+#define AST_INTERPRETER_FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/// One program for fuzz/Fuzzer.cpp to interpret in-process. Only built with
+/// AST_INTERPRETER_FUZZ, where ast-interpreter has no main of its own.
+struct FuzzRun {
+   std::string code;
+   /// What GET reads
+   std::string input;
+   /// Walk the AST instead of preparing functions
+   bool walk = false;
+   uint64_t maxSteps = 1000000;
+   unsigned maxDepth = 200;
+   /// Edge counters the interpreter bumps per node it runs, may be null
+   uint8_t * coverage = nullptr;
+   size_t coverageSize = 0;
+
+   /// What PRINT wrote
+   std::string output;
+   /// The program parsed and main returned without an error or a limit
+   bool finished = false;
+};
+
+/// Runs run.code through InterpreterClassAction and fills in the results
+void interpretProgram(FuzzRun &run);
+
+#endif
@@ -0,0 +1,568 @@
+//==--- Kernels.h - Handlers of the prepared instructions ------------------===//
+//===----------------------------------------------------------------------===//
+// One kernel per (operator, operand types) pair, picked when a function is
+// lowered, e.g. BinOp<Add, Ptr, int32_t> or Load<int8_t>. Values live in the
+// slots normalized to their C type, so a slot holding an int always holds a
+// sign-extended 32-bit value and no kernel needs to look at types. Kernels
+// return the next instruction and are inlined into the dispatch loop.
+
+#ifndef AST_INTERPRETER_KERNELS_H
+#define AST_INTERPRETER_KERNELS_H
+
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+
+#include "Environment.h"
+
+/// Operand category of pointers; arithmetic on them is scaled by imm, the
+/// size of the pointee
+struct Ptr {};
+
+template <class T> struct Arith { typedef T type; };
+template <> struct Arith<Ptr> { typedef uint64_t type; };
+
+/// Wrap around like the target does instead of overflowing
+#define ARITH_OP(Name, op)                                              \
+struct Name {                                                           \
+	static const bool traps = false;                                    \
+	template <class T> static T apply(T a, T b) {                       \
+		typedef typename std::make_unsigned<T>::type U;                 \
+		return (T)((U)a op (U)b);                                       \
+	}                                                                   \
+};
+ARITH_OP(Add, +)
+ARITH_OP(Sub, -)
+ARITH_OP(Mul, *)
+ARITH_OP(And, &)
+ARITH_OP(Or, |)
+ARITH_OP(Xor, ^)
+#undef ARITH_OP
+
+/// The count is taken modulo the width, as x86 does, rather than being
+/// undefined past it
+struct Shl {
+	static const bool traps = false;
+	template <class T> static T apply(T a, T b) {
+		typedef typename std::make_unsigned<T>::type U;
+		return (T)((U)a << ((U)b & (sizeof(T) * 8 - 1)));
+	}
+};
+
+/// Arithmetic for signed operands
+struct Shr {
+	static const bool traps = false;
+	template <class T> static T apply(T a, T b) {
+		typedef typename std::make_unsigned<T>::type U;
+		return a >> ((U)b & (sizeof(T) * 8 - 1));
+	}
+};
+
+#define COMPARE_OP(Name, op)                                            \
+struct Name {                                                           \
+	static const bool traps = false;                                    \
+	template <class T> static bool apply(T a, T b) { return a op b; }   \
+};
+COMPARE_OP(LT, <)
+COMPARE_OP(GT, >)
+COMPARE_OP(LE, <=)
+COMPARE_OP(GE, >=)
+COMPARE_OP(EQ, ==)
+COMPARE_OP(NE, !=)
+#undef COMPARE_OP
+
+/// The divisor is checked by BinOp, MIN / -1 wraps instead of trapping
+struct Div {
+	static const bool traps = true;
+	template <class T> static T apply(T a, T b) {
+		typedef typename std::make_unsigned<T>::type U;
+		if (std::is_signed<T>::value && b == (T)-1)
+			return (T)(0 - (U)a);
+		return a / b;
+	}
+};
+
+/// Like Div; MIN % -1 is 0
+struct Rem {
+	static const bool traps = true;
+	template <class T> static T apply(T a, T b) {
+		if (std::is_signed<T>::value && b == (T)-1)
+			return 0;
+		return a % b;
+	}
+};
+
+inline const Insn * divideByZero(Machine &vm, const Insn * ip);
+
+template <class Op, class L, class R = L>
+struct BinOp {
+	typedef typename Arith<L>::type T;
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		if (Op::traps && (T)r[ip->b] == 0)
+			return divideByZero(vm, ip);
+		r[ip->dst] = (int64_t)Op::apply((T)r[ip->a], (T)r[ip->b]);
+		return ip + 1;
+	}
+};
+
+/// r[dst] = r[a] op imm, for a constant right operand
+template <class Op, class T>
+struct BinOpImm {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		if (Op::traps && (T)ip->imm == 0)
+			return divideByZero(vm, ip);
+		r[ip->dst] = (int64_t)Op::apply((T)r[ip->a], (T)ip->imm);
+		return ip + 1;
+	}
+};
+
+template <class R>
+struct BinOp<Add, Ptr, R> {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		r[ip->dst] = r[ip->a] + (int64_t)(R)r[ip->b] * ip->imm;
+		return ip + 1;
+	}
+};
+
+template <class L>
+struct BinOp<Add, L, Ptr> {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		r[ip->dst] = r[ip->b] + (int64_t)(L)r[ip->a] * ip->imm;
+		return ip + 1;
+	}
+};
+
+template <class R>
+struct BinOp<Sub, Ptr, R> {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		r[ip->dst] = r[ip->a] - (int64_t)(R)r[ip->b] * ip->imm;
+		return ip + 1;
+	}
+};
+
+template <>
+struct BinOp<Sub, Ptr, Ptr> {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		r[ip->dst] = (r[ip->a] - r[ip->b]) / ip->imm;
+		return ip + 1;
+	}
+};
+
+template <class T>
+struct Neg {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		typedef typename std::make_unsigned<T>::type U;
+		int64_t * r = vm.regs();
+		r[ip->dst] = (int64_t)(T)(0 - (U)r[ip->a]);
+		return ip + 1;
+	}
+};
+
+/// Integral conversions, to bool included
+template <class T>
+struct Convert {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		r[ip->dst] = (int64_t)(T)r[ip->a];
+		return ip + 1;
+	}
+};
+
+/// Memory at r[a] + imm
+template <class T>
+struct Load {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		T val;
+		memcpy(&val, (char *)r[ip->a] + ip->imm, sizeof(T));
+		r[ip->dst] = (int64_t)val;
+		return ip + 1;
+	}
+};
+
+template <class T>
+struct Store {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		T val = (T)r[ip->b];
+		memcpy((char *)r[ip->a] + ip->imm, &val, sizeof(T));
+		return ip + 1;
+	}
+};
+
+inline const Insn * badAccess(Machine &vm, const Insn * ip, int64_t addr, int64_t size, const char * what) {
+	vm.env().badAccess(addr, size, what, vm.source(ip));
+	return vm.unwind();
+}
+
+/// Load and Store under --sanitize, looking up the shadow first
+template <class T>
+struct CheckedLoad {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t addr = vm.regs()[ip->a] + ip->imm;
+		if (!vm.env().shadow()->check(addr, sizeof(T)))
+			return badAccess(vm, ip, addr, sizeof(T), "read");
+		return Load<T>::run(vm, ip);
+	}
+};
+
+template <class T>
+struct CheckedStore {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t addr = vm.regs()[ip->a] + ip->imm;
+		if (!vm.env().shadow()->check(addr, sizeof(T)))
+			return badAccess(vm, ip, addr, sizeof(T), "write");
+		return Store<T>::run(vm, ip);
+	}
+};
+
+struct Const {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		vm.regs()[ip->dst] = ip->imm;
+		return ip + 1;
+	}
+};
+
+struct Move {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		int64_t * r = vm.regs();
+		r[ip->dst] = r[ip->a];
+		return ip + 1;
+	}
+};
+
+/// imm is the global's address in the data segment. The access is known
+/// to be in bounds, so there is no checked variant.
+template <class T>
+struct LoadGlobal {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		T val;
+		memcpy(&val, (const char *)ip->imm, sizeof(T));
+		vm.regs()[ip->dst] = (int64_t)val;
+		return ip + 1;
+	}
+};
+
+template <class T>
+struct StoreGlobal {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		T val = (T)vm.regs()[ip->a];
+		memcpy((char *)ip->imm, &val, sizeof(T));
+		return ip + 1;
+	}
+};
+
+/// r[dst] = address of the local array at offset imm of the frame's block
+struct FrameAddr {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		vm.regs()[ip->dst] = (int64_t)(vm.arena() + ip->imm);
+		return ip + 1;
+	}
+};
+
+struct Zero {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		memset((void *)vm.regs()[ip->a], 0, ip->imm);
+		return ip + 1;
+	}
+};
+
+/// Jumps hold the target instruction in imm. Loop and LoopIf are backward
+/// jumps, the only ones, and count against the limits.
+struct Jump {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		return (const Insn *)ip->imm;
+	}
+};
+
+struct JumpIfFalse {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		return vm.regs()[ip->a] ? ip + 1 : (const Insn *)ip->imm;
+	}
+};
+
+struct JumpIfTrue {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		return vm.regs()[ip->a] ? (const Insn *)ip->imm : ip + 1;
+	}
+};
+
+/// switch: r[a] is the value and imm the SwitchTable. JumpTable indexes a
+/// dense table, SwitchSearch searches the keys of a sparse one.
+struct JumpTable {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		const SwitchTable * table = (const SwitchTable *)ip->imm;
+		uint64_t i = (uint64_t)vm.regs()[ip->a] - (uint64_t)table->low;
+		return (const Insn *)(i < table->targets.size() ? table->targets[i] : table->otherwise);
+	}
+};
+
+struct SwitchSearch {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		const SwitchTable * table = (const SwitchTable *)ip->imm;
+		int64_t val = vm.regs()[ip->a];
+		std::vector<int64_t>::const_iterator key = std::lower_bound(table->keys.begin(), table->keys.end(), val);
+		if (key == table->keys.end() || *key != val)
+			return (const Insn *)table->otherwise;
+		return (const Insn *)table->targets[key - table->keys.begin()];
+	}
+};
+
+inline const Insn * backedge(Machine &vm, const Insn * ip) {
+	Environment &env = vm.env();
+	env.backedge(vm.source(ip), vm.function());
+	if (env.aborted())
+		return vm.unwind();
+	return (const Insn *)ip->imm;
+}
+
+struct Loop {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		return backedge(vm, ip);
+	}
+};
+
+struct LoopIf {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		if (!vm.regs()[ip->a])
+			return ip + 1;
+		return backedge(vm, ip);
+	}
+};
+
+/// Arguments are in r[a] .. r[a + b - 1], the result goes to r[dst].
+/// CallFunction holds the FunctionDecl; linkCalls turns it into CallPrepared
+/// holding the Code, or CallWalker when there can be none. A callee that
+/// was not prepared yet stays CallFunction and is prepared on its first run;
+/// the instruction is not rewritten, since other threads may be running it.
+struct CallFunction {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		Environment &env = vm.env();
+		FunctionDecl * callee = (FunctionDecl *)ip->imm;
+		int64_t * r = vm.regs();
+		if (!env.enterCall(vm.source(ip)))
+			return vm.unwind();
+		if (NativeTier::Entry entry = env.native(callee)) {
+			r[ip->dst] = env.callNative(entry, r + ip->a);
+			return ip + 1;
+		}
+		if (const Code * code = env.prepared(callee)) {
+			const Insn * next = vm.push(code, r + ip->a, ip->b, ip->dst, ip + 1);
+			if (!next) {
+				env.fail("stack", "interpreter stack exhausted", vm.source(ip));
+				return vm.unwind();
+			}
+			return next;
+		}
+		r[ip->dst] = env.invoke(callee, r + ip->a, ip->b);
+		if (env.aborted())
+			return vm.unwind();
+		return ip + 1;
+	}
+};
+
+struct CallPrepared {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		Environment &env = vm.env();
+		const Code * code = (const Code *)ip->imm;
+		int64_t * r = vm.regs();
+		if (!env.enterCall(vm.source(ip)))
+			return vm.unwind();
+		if (NativeTier::Entry entry = env.native(code->func)) {
+			r[ip->dst] = env.callNative(entry, r + ip->a);
+			return ip + 1;
+		}
+		const Insn * next = vm.push(code, r + ip->a, ip->b, ip->dst, ip + 1);
+		if (!next) {
+			env.fail("stack", "interpreter stack exhausted", vm.source(ip));
+			return vm.unwind();
+		}
+		return next;
+	}
+};
+
+struct CallWalker {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		Environment &env = vm.env();
+		FunctionDecl * callee = (FunctionDecl *)ip->imm;
+		int64_t * r = vm.regs();
+		if (!env.enterCall(vm.source(ip)))
+			return vm.unwind();
+		if (NativeTier::Entry entry = env.native(callee))
+			r[ip->dst] = env.callNative(entry, r + ip->a);
+		else
+			r[ip->dst] = env.invoke(callee, r + ip->a, ip->b);
+		if (env.aborted())
+			return vm.unwind();
+		return ip + 1;
+	}
+};
+
+struct Return {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		return vm.pop(vm.regs()[ip->a]);
+	}
+};
+
+struct ReturnVoid {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		return vm.pop(0);
+	}
+};
+
+struct Get {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		vm.regs()[ip->dst] = vm.env().input();
+		return ip + 1;
+	}
+};
+
+struct Print {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		vm.env().output(vm.regs()[ip->a]);
+		return ip + 1;
+	}
+};
+
+struct Malloc {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		Environment &env = vm.env();
+		vm.regs()[ip->dst] = env.allocate(vm.regs()[ip->a]);
+		if (env.aborted())
+			return vm.unwind();
+		return ip + 1;
+	}
+};
+
+struct Free {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		Environment &env = vm.env();
+		env.release(vm.regs()[ip->a], vm.source(ip));
+		if (env.aborted())
+			return vm.unwind();
+		return ip + 1;
+	}
+};
+
+/// PARALLEL_FOR(r[a], r[b], imm), imm being the FunctionDecl to call
+struct ParallelFor {
+	static const Insn * run(Machine &vm, const Insn * ip) {
+		Environment &env = vm.env();
+		env.parallelFor((FunctionDecl *)ip->imm, vm.regs()[ip->a], vm.regs()[ip->b], vm.source(ip));
+		if (env.aborted())
+			return vm.unwind();
+		return ip + 1;
+	}
+};
+
+inline const Insn * divideByZero(Machine &vm, const Insn * ip) {
+	vm.env().fail("division-by-zero", "division by zero", vm.source(ip));
+	return vm.unwind();
+}
+
+/// Every handler instance the lowering can pick, as X(opcode, kernel). The
+/// dispatch loop in Machine.cpp gets a label or a case for each.
+template <class T> using AddOp = BinOp<Add, T>;
+template <class T> using SubOp = BinOp<Sub, T>;
+template <class T> using MulOp = BinOp<Mul, T>;
+template <class T> using DivOp = BinOp<Div, T>;
+template <class T> using RemOp = BinOp<Rem, T>;
+template <class T> using AndOp = BinOp<And, T>;
+template <class T> using OrOp = BinOp<Or, T>;
+template <class T> using XorOp = BinOp<Xor, T>;
+template <class T> using ShlOp = BinOp<Shl, T>;
+template <class T> using ShrOp = BinOp<Shr, T>;
+template <class T> using LTOp = BinOp<LT, T>;
+template <class T> using GTOp = BinOp<GT, T>;
+template <class T> using LEOp = BinOp<LE, T>;
+template <class T> using GEOp = BinOp<GE, T>;
+template <class T> using EQOp = BinOp<EQ, T>;
+template <class T> using NEOp = BinOp<NE, T>;
+template <class T> using AddImm = BinOpImm<Add, T>;
+template <class T> using SubImm = BinOpImm<Sub, T>;
+template <class T> using MulImm = BinOpImm<Mul, T>;
+template <class T> using DivImm = BinOpImm<Div, T>;
+template <class T> using RemImm = BinOpImm<Rem, T>;
+template <class T> using AndImm = BinOpImm<And, T>;
+template <class T> using OrImm = BinOpImm<Or, T>;
+template <class T> using XorImm = BinOpImm<Xor, T>;
+template <class T> using ShlImm = BinOpImm<Shl, T>;
+template <class T> using ShrImm = BinOpImm<Shr, T>;
+template <class T> using LTImm = BinOpImm<LT, T>;
+template <class T> using GTImm = BinOpImm<GT, T>;
+template <class T> using LEImm = BinOpImm<LE, T>;
+template <class T> using GEImm = BinOpImm<GE, T>;
+template <class T> using EQImm = BinOpImm<EQ, T>;
+template <class T> using NEImm = BinOpImm<NE, T>;
+template <class T> using PtrPlus = BinOp<Add, Ptr, T>;
+template <class T> using PlusPtr = BinOp<Add, T, Ptr>;
+template <class T> using PtrMinus = BinOp<Sub, Ptr, T>;
+typedef BinOp<Sub, Ptr, Ptr> PtrDiff;
+typedef Convert<bool> ToBool;
+
+#define AST_ARITH_KINDS(X, name, kernel) \
+	X(name##_i32, kernel<int32_t>) X(name##_u32, kernel<uint32_t>) \
+	X(name##_i64, kernel<int64_t>) X(name##_u64, kernel<uint64_t>)
+#define AST_ALL_KINDS(X, name, kernel) \
+	X(name##_i8, kernel<int8_t>) X(name##_u8, kernel<uint8_t>) \
+	X(name##_i16, kernel<int16_t>) X(name##_u16, kernel<uint16_t>) \
+	AST_ARITH_KINDS(X, name, kernel)
+
+#define AST_OPCODES(X) \
+	AST_ARITH_KINDS(X, Add, AddOp) AST_ARITH_KINDS(X, Sub, SubOp) \
+	AST_ARITH_KINDS(X, Mul, MulOp) AST_ARITH_KINDS(X, Div, DivOp) \
+	AST_ARITH_KINDS(X, Rem, RemOp) AST_ARITH_KINDS(X, And, AndOp) \
+	AST_ARITH_KINDS(X, Or, OrOp) AST_ARITH_KINDS(X, Xor, XorOp) \
+	AST_ARITH_KINDS(X, Shl, ShlOp) AST_ARITH_KINDS(X, Shr, ShrOp) \
+	AST_ARITH_KINDS(X, LT, LTOp) AST_ARITH_KINDS(X, GT, GTOp) \
+	AST_ARITH_KINDS(X, LE, LEOp) AST_ARITH_KINDS(X, GE, GEOp) \
+	AST_ARITH_KINDS(X, EQ, EQOp) AST_ARITH_KINDS(X, NE, NEOp) \
+	AST_ARITH_KINDS(X, AddImm, AddImm) AST_ARITH_KINDS(X, SubImm, SubImm) \
+	AST_ARITH_KINDS(X, MulImm, MulImm) AST_ARITH_KINDS(X, DivImm, DivImm) \
+	AST_ARITH_KINDS(X, RemImm, RemImm) AST_ARITH_KINDS(X, AndImm, AndImm) \
+	AST_ARITH_KINDS(X, OrImm, OrImm) AST_ARITH_KINDS(X, XorImm, XorImm) \
+	AST_ARITH_KINDS(X, ShlImm, ShlImm) AST_ARITH_KINDS(X, ShrImm, ShrImm) \
+	AST_ARITH_KINDS(X, LTImm, LTImm) AST_ARITH_KINDS(X, GTImm, GTImm) \
+	AST_ARITH_KINDS(X, LEImm, LEImm) AST_ARITH_KINDS(X, GEImm, GEImm) \
+	AST_ARITH_KINDS(X, EQImm, EQImm) AST_ARITH_KINDS(X, NEImm, NEImm) \
+	AST_ALL_KINDS(X, PtrPlus, PtrPlus) AST_ALL_KINDS(X, PlusPtr, PlusPtr) \
+	AST_ALL_KINDS(X, PtrMinus, PtrMinus) X(PtrDiff, PtrDiff) \
+	AST_ALL_KINDS(X, Neg, Neg) AST_ALL_KINDS(X, Convert, Convert) X(ToBool, ToBool) \
+	AST_ALL_KINDS(X, Load, Load) AST_ALL_KINDS(X, Store, Store) \
+	AST_ALL_KINDS(X, CheckedLoad, CheckedLoad) AST_ALL_KINDS(X, CheckedStore, CheckedStore) \
+	AST_ALL_KINDS(X, LoadGlobal, LoadGlobal) AST_ALL_KINDS(X, StoreGlobal, StoreGlobal) \
+	X(Const, Const) X(Move, Move) \
+	X(FrameAddr, FrameAddr) X(Zero, Zero) \
+	X(Jump, Jump) X(JumpIfFalse, JumpIfFalse) X(JumpIfTrue, JumpIfTrue) \
+	X(JumpTable, JumpTable) X(SwitchSearch, SwitchSearch) \
+	X(Loop, Loop) X(LoopIf, LoopIf) \
+	X(CallFunction, CallFunction) X(CallPrepared, CallPrepared) X(CallWalker, CallWalker) \
+	X(Return, Return) X(ReturnVoid, ReturnVoid) \
+	X(Get, Get) X(Print, Print) X(Malloc, Malloc) X(Free, Free) X(ParallelFor, ParallelFor)
+
+enum Opcode : uint32_t {
+#define AST_OPCODE_ENUM(name, kernel) OP_##name,
+	AST_OPCODES(AST_OPCODE_ENUM)
+#undef AST_OPCODE_ENUM
+	/// Leaves the dispatch loop; see Machine::mHalt
+	OP_Halt
+};
+
+/// The opcode of a kernel, for the lowering
+template <class Kernel> struct OpcodeOf;
+#define AST_OPCODE_OF(name, kernel) \
+	template <> struct OpcodeOf<kernel> { static const Opcode value = OP_##name; };
+AST_OPCODES(AST_OPCODE_OF)
+#undef AST_OPCODE_OF
+
+template <class Kernel> Opcode opcode() {
+	return OpcodeOf<Kernel>::value;
+}
+
+#endif
@@ -0,0 +1,1039 @@
+//==--- Lowering.cpp - Lower function bodies to prepared instructions -----===//
+//===----------------------------------------------------------------------===//
+// Types are looked at here, once, to pick the handler instance; nothing is
+// left for run time but the operation itself. Scalars of a function live in
+// slots, local arrays in its frame block; globals at their fixed address in
+// the data segment.
+
+#include "Kernels.h"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/MathExtras.h"
+
+namespace {
+
+/// Width and signedness of a scalar, what a handler is specialized on
+enum Kind { S8, U8, S16, U16, S32, U32, S64, U64 };
+
+template <template <class> class K>
+Opcode byKind(Kind kind) {
+	switch (kind) {
+	case S8: return opcode<K<int8_t>>();
+	case U8: return opcode<K<uint8_t>>();
+	case S16: return opcode<K<int16_t>>();
+	case U16: return opcode<K<uint16_t>>();
+	case S32: return opcode<K<int32_t>>();
+	case U32: return opcode<K<uint32_t>>();
+	case S64: return opcode<K<int64_t>>();
+	default: return opcode<K<uint64_t>>();
+	}
+}
+
+/// Operands of arithmetic are promoted to int at least
+template <template <class> class K>
+Opcode arith(Kind kind) {
+	switch (kind) {
+	case S64: return opcode<K<int64_t>>();
+	case U64: return opcode<K<uint64_t>>();
+	case U32: return opcode<K<uint32_t>>();
+	default: return opcode<K<int32_t>>();
+	}
+}
+
+/// The operator that gives the same result with the operands swapped,
+/// BO_Comma when there is none
+BinaryOperatorKind mirrored(BinaryOperatorKind op) {
+	switch (op) {
+	case BO_Add: case BO_Mul: case BO_EQ: case BO_NE:
+	case BO_And: case BO_Or: case BO_Xor: return op;
+	case BO_LT: return BO_GT;
+	case BO_GT: return BO_LT;
+	case BO_LE: return BO_GE;
+	case BO_GE: return BO_LE;
+	default: return BO_Comma;
+	}
+}
+
+/// Whether s holds a case label of the switch around it, which a folded
+/// if must not drop
+bool hasCaseLabel(Stmt * s) {
+	if (!s || isa<SwitchStmt>(s))
+		return false;
+	if (isa<SwitchCase>(s))
+		return true;
+	for (Stmt * child : s->children())
+		if (hasCaseLabel(child))
+			return true;
+	return false;
+}
+
+class Lowering {
+public:
+	Lowering(FunctionDecl * func, Environment &env)
+		: mEnv(env), mContext(env.context()), mCode(new Code) {
+		mCode->func = func;
+	}
+
+	std::unique_ptr<Code> run(std::string &why);
+
+private:
+	/// Where an lvalue lives: a slot of the frame, a scalar global at addr,
+	/// or memory at the address held by slot plus addr, a field's offset
+	struct LValue {
+		enum { Slot, Global, Memory } kind;
+		int32_t slot;
+		int64_t addr;
+		QualType type;
+	};
+
+	Environment &mEnv;
+	ASTContext &mContext;
+	std::unique_ptr<Code> mCode;
+	llvm::DenseMap<const VarDecl *, int32_t> mLocals;
+	/// First free slot; temporaries are given back after each statement
+	int32_t mTop = 0;
+	/// Jumps whose imm is still an instruction index
+	std::vector<size_t> mJumps;
+	/// Tables whose targets are still instruction indices
+	std::vector<SwitchTable *> mTables;
+	/// Jumps of the breaks out of each enclosing loop or switch, and of the
+	/// continues of each enclosing loop, innermost last
+	std::vector<std::vector<size_t>> mBreaks;
+	std::vector<std::vector<size_t>> mContinues;
+	/// The labels of a switch being lowered, with their instruction
+	struct Cases {
+		QualType type;
+		std::vector<std::pair<int64_t, size_t>> labels;
+		bool hasDefault;
+		size_t otherwise;
+		/// Labels that are statements of the body itself, the only ones
+		/// the walker can start the body from
+		llvm::DenseSet<const SwitchCase *> direct;
+	};
+	std::vector<Cases> mSwitches;
+	/// Ifs whose condition folded to a constant
+	unsigned mPruned = 0;
+	std::string mWhy;
+
+	bool failed() { return !mWhy.empty(); }
+	int32_t unsupported(const std::string &what) {
+		if (mWhy.empty())
+			mWhy = what;
+		return 0;
+	}
+
+	bool scalar(QualType type) {
+		return type->isIntegralOrEnumerationType() || type->isPointerType();
+	}
+	Kind kindOf(QualType type) {
+		if (type->isPointerType())
+			return U64;
+		bool sign = type->isSignedIntegerOrEnumerationType();
+		switch (mContext.getTypeSize(type)) {
+		case 8: return sign ? S8 : U8;
+		case 16: return sign ? S16 : U16;
+		case 32: return sign ? S32 : U32;
+		default: return sign ? S64 : U64;
+		}
+	}
+
+	size_t emit(Opcode op, int32_t dst, int32_t a, int32_t b, int64_t imm, Stmt * src) {
+		mCode->insns.push_back(Insn{nullptr, op, dst, a, b, imm});
+		mCode->sources.push_back(src);
+		return mCode->insns.size() - 1;
+	}
+	size_t here() {
+		return mCode->insns.size();
+	}
+	size_t jump(Opcode op, int32_t cond, size_t target, Stmt * src) {
+		mJumps.push_back(here());
+		return emit(op, -1, cond, 0, target, src);
+	}
+	void patch(size_t insn, size_t target) {
+		mCode->insns[insn].imm = target;
+	}
+	void patch(const std::vector<size_t> &insns, size_t target) {
+		for (size_t insn : insns)
+			patch(insn, target);
+	}
+	int32_t temp() {
+		int32_t slot = mTop++;
+		mCode->numSlots = std::max<unsigned>(mCode->numSlots, mTop);
+		return slot;
+	}
+	/// The slot a result goes to: want when the caller has one
+	int32_t dest(int32_t want) {
+		return want >= 0 ? want : temp();
+	}
+	int32_t into(int32_t val, int32_t want, Stmt * src) {
+		if (want < 0 || want == val)
+			return val;
+		emit(opcode<Move>(), want, val, 0, 0, src);
+		return want;
+	}
+
+	/// A slot holding the address of a new object in the frame's arena block
+	int32_t frameObject(QualType type, Stmt * src) {
+		// arrays get 16 bytes for the block copies on them; checked objects
+		// start a granule after a redzone
+		int64_t align = type->isArrayType() || mEnv.shadow() ? 16 : mContext.getTypeAlignInChars(type).getQuantity();
+		int64_t offset = llvm::alignTo(mCode->frameBytes + (mEnv.shadow() ? Shadow::Redzone : 0), align);
+		mCode->frameBytes = offset + mEnv.sizeOf(type);
+		mCode->objects.push_back(std::make_pair(offset, mEnv.sizeOf(type)));
+		int32_t slot = temp();
+		emit(opcode<FrameAddr>(), slot, 0, 0, offset, src);
+		return slot;
+	}
+
+	/// Integer constant expressions, folded at lowering
+	bool constant(Expr * e, int64_t &val) {
+		Expr::EvalResult result;
+		if (!e->getType()->isIntegralOrEnumerationType() || e->HasSideEffects(mContext) ||
+		    !e->EvaluateAsInt(result, mContext))
+			return false;
+		val = result.Val.getInt().getExtValue();
+		return true;
+	}
+
+	void frameObjects(Stmt * s);
+	void stmt(Stmt * s);
+	void loopStmt(Stmt * s);
+	void switchStmt(SwitchStmt * sw);
+	void local(Decl * decl, DeclStmt * src);
+	void effect(Expr * e);
+	int32_t cond(Expr * e);
+	int32_t expr(Expr * e, int32_t want = -1);
+	int32_t castExpr(CastExpr * c, int32_t want);
+	int32_t binop(BinaryOperator * bop, int32_t want);
+	bool arithKernel(BinaryOperatorKind op, Kind kind, bool inlined, Opcode &kernel);
+	int32_t logical(BinaryOperator * bop, int32_t want);
+	int32_t compoundAssign(CompoundAssignOperator * cao, int32_t want);
+	int32_t unop(UnaryOperator * uop, int32_t want);
+	int32_t incDec(UnaryOperator * uop, int32_t want, bool used);
+	int32_t call(CallExpr * call, int32_t want);
+	LValue assign(BinaryOperator * bop, int32_t &val);
+	LValue lvalue(Expr * e);
+	/// The address of a memory lvalue
+	int32_t address(const LValue &lv, int32_t want, Expr * src);
+	int32_t load(const LValue &lv, int32_t want, Expr * src);
+	void store(const LValue &lv, int32_t val, Expr * src);
+};
+
+std::unique_ptr<Code> Lowering::run(std::string &why) {
+	FunctionDecl * func = mCode->func;
+	if (func->isVariadic())
+		unsupported("variadic function");
+	for (ParmVarDecl * param : func->parameters()) {
+		if (!scalar(param->getType()))
+			unsupported("parameter " + param->getNameAsString() + " of type " + param->getType().getAsString());
+		mLocals[param] = temp();
+	}
+	mCode->numParams = func->getNumParams();
+	// parameters whose address is taken move from their slot to memory
+	for (ParmVarDecl * param : func->parameters()) {
+		if (!mEnv.addressTaken(param))
+			continue;
+		int32_t addr = frameObject(param->getType(), func->getBody());
+		emit(byKind<Store>(kindOf(param->getType())), -1, addr, mLocals[param], 0, func->getBody());
+		mLocals[param] = addr;
+	}
+	QualType ret = func->getReturnType();
+	if (!ret->isVoidType() && !scalar(ret))
+		unsupported("return type " + ret.getAsString());
+	frameObjects(func->getBody());
+
+	stmt(func->getBody());
+	// falling off the end returns 0, like the walker
+	emit(opcode<ReturnVoid>(), -1, 0, 0, 0, func->getBody());
+	if (failed()) {
+		why = mWhy;
+		return nullptr;
+	}
+	for (size_t i : mJumps)
+		mCode->insns[i].imm = (int64_t)(mCode->insns.data() + mCode->insns[i].imm);
+	for (SwitchTable * table : mTables) {
+		for (int64_t &target : table->targets)
+			target = (int64_t)(mCode->insns.data() + target);
+		table->otherwise = (int64_t)(mCode->insns.data() + table->otherwise);
+	}
+	// keeps the next frame's block aligned, after a redzone when checked
+	mCode->frameBytes = llvm::alignTo(mCode->frameBytes + (mEnv.shadow() ? Shadow::Redzone : 0), 16);
+	mEnv.prunedBranches(mPruned);
+	return std::move(mCode);
+}
+
+/// Locals in memory get their address in the prologue, so one that a case
+/// label jumps past still has it; the declaration only zeroes the object.
+void Lowering::frameObjects(Stmt * s) {
+	if (DeclStmt * declstmt = dyn_cast<DeclStmt>(s)) {
+		for (Decl * decl : declstmt->decls()) {
+			VarDecl * var = dyn_cast<VarDecl>(decl);
+			if (!var || !var->hasLocalStorage())
+				continue;
+			QualType type = var->getType();
+			if ((scalar(type) && mEnv.addressTaken(var)) || mContext.getAsConstantArrayType(type) ||
+			    type->isRecordType())
+				mLocals[var] = frameObject(type, declstmt);
+		}
+	}
+	for (Stmt * child : s->children())
+		if (child)
+			frameObjects(child);
+}
+
+void Lowering::stmt(Stmt * s) {
+	if (failed())
+		return;
+	if (CompoundStmt * block = dyn_cast<CompoundStmt>(s)) {
+		int32_t top = mTop;
+		for (Stmt * child : block->body())
+			stmt(child);
+		mTop = top;
+	} else if (DeclStmt * declstmt = dyn_cast<DeclStmt>(s)) {
+		for (Decl * decl : declstmt->decls())
+			local(decl, declstmt);
+	} else if (IfStmt * ifstmt = dyn_cast<IfStmt>(s)) {
+		if (ifstmt->getInit() || ifstmt->getConditionVariable()) {
+			unsupported("declaration in a condition");
+			return;
+		}
+		// a constant condition without side effects keeps only the live branch
+		Expr::EvalResult folded;
+		if (ifstmt->getCond()->EvaluateAsInt(folded, mContext) &&
+		    !hasCaseLabel(folded.Val.getInt().getBoolValue() ? ifstmt->getElse() : ifstmt->getThen())) {
+			bool taken = folded.Val.getInt().getBoolValue();
+			// only counted when there is a branch to leave out
+			if (!taken || ifstmt->getElse())
+				++mPruned;
+			if (taken)
+				stmt(ifstmt->getThen());
+			else if (Stmt * other = ifstmt->getElse())
+				stmt(other);
+			return;
+		}
+		int32_t top = mTop;
+		int32_t c = cond(ifstmt->getCond());
+		mTop = top;
+		size_t toElse = jump(opcode<JumpIfFalse>(), c, 0, ifstmt);
+		stmt(ifstmt->getThen());
+		if (Stmt * other = ifstmt->getElse()) {
+			size_t toEnd = jump(opcode<Jump>(), -1, 0, ifstmt);
+			patch(toElse, here());
+			stmt(other);
+			patch(toEnd, here());
+		} else {
+			patch(toElse, here());
+		}
+	} else if (isa<WhileStmt>(s) || isa<DoStmt>(s) || isa<ForStmt>(s)) {
+		mBreaks.emplace_back();
+		mContinues.emplace_back();
+		loopStmt(s);
+		mBreaks.pop_back();
+		mContinues.pop_back();
+	} else if (SwitchStmt * sw = dyn_cast<SwitchStmt>(s)) {
+		mBreaks.emplace_back();
+		switchStmt(sw);
+		mBreaks.pop_back();
+	} else if (SwitchCase * label = dyn_cast<SwitchCase>(s)) {
+		Cases &cases = mSwitches.back();
+		// like Duff's device; the walker could not run it either
+		if (!cases.direct.count(label)) {
+			unsupported("case label inside a nested statement");
+			return;
+		}
+		if (CaseStmt * c = dyn_cast<CaseStmt>(label)) {
+			int64_t low = mEnv.caseValue(c->getLHS(), cases.type);
+			int64_t high = c->getRHS() ? mEnv.caseValue(c->getRHS(), cases.type) : low;
+			// GNU case ranges become one label per value
+			uint64_t count = (uint64_t)high - (uint64_t)low;
+			if (count >= 1024) {
+				unsupported("case range");
+				return;
+			}
+			for (uint64_t i = 0; i <= count; ++i)
+				cases.labels.push_back(std::make_pair((int64_t)((uint64_t)low + i), here()));
+		} else {
+			cases.hasDefault = true;
+			cases.otherwise = here();
+		}
+		stmt(label->getSubStmt());
+	} else if (isa<BreakStmt>(s)) {
+		mBreaks.back().push_back(jump(opcode<Jump>(), -1, 0, s));
+	} else if (isa<ContinueStmt>(s)) {
+		mContinues.back().push_back(jump(opcode<Jump>(), -1, 0, s));
+	} else if (ReturnStmt * ret = dyn_cast<ReturnStmt>(s)) {
+		if (Expr * value = ret->getRetValue()) {
+			int32_t top = mTop;
+			int32_t val = expr(value);
+			mTop = top;
+			emit(opcode<Return>(), -1, val, 0, 0, ret);
+		} else {
+			emit(opcode<ReturnVoid>(), -1, 0, 0, 0, ret);
+		}
+	} else if (isa<NullStmt>(s)) {
+	} else if (Expr * e = dyn_cast<Expr>(s)) {
+		effect(e);
+	} else {
+		unsupported(s->getStmtClassName());
+	}
+}
+
+/// while, do and for. The condition goes after the body, so an iteration
+/// takes one branch; a continue jumps to what comes after the body, a break
+/// past the loop.
+void Lowering::loopStmt(Stmt * s) {
+	int32_t top = mTop;
+	Expr * c = nullptr;
+	if (WhileStmt * loop = dyn_cast<WhileStmt>(s)) {
+		if (loop->getConditionVariable()) {
+			unsupported("declaration in a condition");
+			return;
+		}
+		c = loop->getCond();
+	} else if (ForStmt * loop = dyn_cast<ForStmt>(s)) {
+		if (loop->getConditionVariable()) {
+			unsupported("declaration in a condition");
+			return;
+		}
+		if (Stmt * init = loop->getInit())
+			stmt(init);
+		c = loop->getCond();
+	} else {
+		c = cast<DoStmt>(s)->getCond();
+	}
+	size_t toCond = c && !isa<DoStmt>(s) ? jump(opcode<Jump>(), -1, 0, s) : 0;
+	size_t body = here();
+	if (WhileStmt * loop = dyn_cast<WhileStmt>(s))
+		stmt(loop->getBody());
+	else if (ForStmt * loop = dyn_cast<ForStmt>(s))
+		stmt(loop->getBody());
+	else
+		stmt(cast<DoStmt>(s)->getBody());
+	size_t next = here();
+	if (ForStmt * loop = dyn_cast<ForStmt>(s))
+		if (Expr * inc = loop->getInc())
+			effect(inc);
+	if (c) {
+		if (!isa<DoStmt>(s))
+			patch(toCond, here());
+		int32_t t = mTop;
+		int32_t val = cond(c);
+		mTop = t;
+		jump(opcode<LoopIf>(), val, body, s);
+	} else {
+		jump(opcode<Loop>(), -1, body, s);
+	}
+	patch(mContinues.back(), next);
+	patch(mBreaks.back(), here());
+	mTop = top;
+}
+
+/// One JumpTable or SwitchSearch instruction instead of a comparison per
+/// case: labels that fill at least a third of their range index a table,
+/// others are searched.
+void Lowering::switchStmt(SwitchStmt * sw) {
+	if (sw->getInit() || sw->getConditionVariable()) {
+		unsupported("declaration in a condition");
+		return;
+	}
+	Expr * c = sw->getCond();
+	int32_t top = mTop;
+	int32_t val = expr(c);
+	mTop = top;
+	size_t dispatch = emit(opcode<SwitchSearch>(), -1, val, 0, 0, sw);
+	mSwitches.push_back(Cases{c->getType(), {}, false, 0, {}});
+	std::vector<Stmt *> body(1, sw->getBody());
+	if (CompoundStmt * block = dyn_cast<CompoundStmt>(sw->getBody()))
+		body.assign(block->body_begin(), block->body_end());
+	for (Stmt * child : body)
+		for (SwitchCase * label = dyn_cast<SwitchCase>(child); label; label = dyn_cast<SwitchCase>(label->getSubStmt()))
+			mSwitches.back().direct.insert(label);
+	stmt(sw->getBody());
+	Cases cases = mSwitches.back();
+	mSwitches.pop_back();
+	patch(mBreaks.back(), here());
+	if (failed())
+		return;
+
+	std::sort(cases.labels.begin(), cases.labels.end());
+	size_t otherwise = cases.hasDefault ? cases.otherwise : here();
+	if (cases.labels.empty()) {
+		mCode->insns[dispatch].op = opcode<Jump>();
+		patch(dispatch, otherwise);
+		mJumps.push_back(dispatch);
+		return;
+	}
+	std::unique_ptr<SwitchTable> table(new SwitchTable);
+	table->otherwise = otherwise;
+	uint64_t range = (uint64_t)cases.labels.back().first - (uint64_t)cases.labels.front().first;
+	if (range < 3 * cases.labels.size()) {
+		table->low = cases.labels.front().first;
+		table->targets.assign(range + 1, otherwise);
+		for (const std::pair<int64_t, size_t> &label : cases.labels)
+			table->targets[(uint64_t)label.first - (uint64_t)table->low] = label.second;
+		mCode->insns[dispatch].op = opcode<JumpTable>();
+	} else {
+		for (const std::pair<int64_t, size_t> &label : cases.labels) {
+			table->keys.push_back(label.first);
+			table->targets.push_back(label.second);
+		}
+	}
+	mCode->insns[dispatch].imm = (int64_t)table.get();
+	mTables.push_back(table.get());
+	mCode->tables.push_back(std::move(table));
+}
+
+void Lowering::local(Decl * decl, DeclStmt * src) {
+	VarDecl * var = dyn_cast<VarDecl>(decl);
+	if (!var)
+		return;
+	if (!var->hasLocalStorage()) {
+		unsupported("static local " + var->getNameAsString());
+		return;
+	}
+	QualType type = var->getType();
+	if (scalar(type) && mEnv.addressTaken(var)) {
+		int32_t addr = mLocals[var];
+		if (Expr * init = var->getInit()) {
+			int32_t top = mTop;
+			emit(byKind<Store>(kindOf(type)), -1, addr, expr(init), 0, src);
+			mTop = top;
+		} else {
+			emit(opcode<Zero>(), -1, addr, 0, mEnv.sizeOf(type), src);
+		}
+	} else if (scalar(type)) {
+		int32_t slot = temp();
+		mLocals[var] = slot;
+		if (Expr * init = var->getInit()) {
+			int32_t top = mTop;
+			expr(init, slot);
+			mTop = top;
+		} else {
+			emit(opcode<Const>(), slot, 0, 0, 0, src);
+		}
+	} else if (mContext.getAsConstantArrayType(type) || type->isRecordType()) {
+		// C++ gives records a call of their default constructor, which
+		// does nothing when it is trivial; a copy is left to the walker
+		CXXConstructExpr * construct = var->hasInit() ? dyn_cast<CXXConstructExpr>(var->getInit()) : nullptr;
+		if (var->hasInit() && !(construct && construct->getNumArgs() == 0 &&
+		                        construct->getConstructor()->isDefaultConstructor() &&
+		                        construct->getConstructor()->isTrivial())) {
+			unsupported("initializer of " + var->getNameAsString());
+			return;
+		}
+		int32_t slot = mLocals[var];
+		emit(opcode<Zero>(), -1, slot, 0, mEnv.sizeOf(type), src);
+	} else {
+		unsupported("local " + var->getNameAsString() + " of type " + type.getAsString());
+	}
+}
+
+void Lowering::effect(Expr * e) {
+	int32_t top = mTop;
+	// i++ as a statement needs no copy of the old value
+	UnaryOperator * uop = dyn_cast<UnaryOperator>(e->IgnoreParens());
+	if (uop && uop->isIncrementDecrementOp())
+		incDec(uop, -1, false);
+	else
+		expr(e);
+	mTop = top;
+}
+
+/// Branches test for non-zero themselves
+int32_t Lowering::cond(Expr * e) {
+	e = e->IgnoreParens();
+	if (ImplicitCastExpr * cast = dyn_cast<ImplicitCastExpr>(e))
+		if (cast->getCastKind() == CK_IntegralToBoolean || cast->getCastKind() == CK_PointerToBoolean)
+			return expr(cast->getSubExpr());
+	return expr(e);
+}
+
+int32_t Lowering::expr(Expr * e, int32_t want) {
+	if (failed())
+		return 0;
+	e = e->IgnoreParens();
+	int64_t val;
+	if (constant(e, val)) {
+		int32_t dst = dest(want);
+		emit(opcode<Const>(), dst, 0, 0, val, e);
+		return dst;
+	}
+	if (CastExpr * c = dyn_cast<CastExpr>(e))
+		return castExpr(c, want);
+	if (BinaryOperator * bop = dyn_cast<BinaryOperator>(e))
+		return binop(bop, want);
+	if (UnaryOperator * uop = dyn_cast<UnaryOperator>(e))
+		return unop(uop, want);
+	if (CallExpr * c = dyn_cast<CallExpr>(e))
+		return call(c, want);
+	return unsupported(e->getStmtClassName());
+}
+
+int32_t Lowering::castExpr(CastExpr * c, int32_t want) {
+	Expr * sub = c->getSubExpr();
+	switch (c->getCastKind()) {
+	case CK_LValueToRValue:
+		return load(lvalue(sub), want, c);
+	case CK_ArrayToPointerDecay: {
+		LValue lv = lvalue(sub);
+		// an array lvalue's slot holds its address
+		if (lv.kind == LValue::Memory)
+			return address(lv, want, c);
+		return into(lv.slot, want, c);
+	}
+	case CK_NullToPointer: {
+		int32_t dst = dest(want);
+		emit(opcode<Const>(), dst, 0, 0, 0, c);
+		return dst;
+	}
+	case CK_NoOp:
+	case CK_BitCast:
+	case CK_IntegralToPointer:
+	case CK_ToVoid:
+		return expr(sub, want);
+	case CK_IntegralCast:
+	case CK_PointerToIntegral:
+	case CK_IntegralToBoolean:
+	case CK_PointerToBoolean: {
+		QualType to = c->getType();
+		int32_t val = expr(sub);
+		if (to->isBooleanType()) {
+			int32_t dst = dest(want);
+			emit(opcode<ToBool>(), dst, val, 0, 0, c);
+			return dst;
+		}
+		// slots hold normalized values, so widening keeps the bits
+		uint64_t toBits = mContext.getTypeSize(to), fromBits = mContext.getTypeSize(sub->getType());
+		bool toSigned = to->isSignedIntegerOrEnumerationType();
+		bool fromSigned = sub->getType()->isSignedIntegerOrEnumerationType();
+		if (toBits == 64 || (toBits > fromBits && (toSigned || !fromSigned)) ||
+		    (toBits == fromBits && toSigned == fromSigned))
+			return into(val, want, c);
+		int32_t dst = dest(want);
+		emit(byKind<Convert>(kindOf(to)), dst, val, 0, 0, c);
+		return dst;
+	}
+	default:
+		return unsupported(std::string("cast ") + c->getCastKindName());
+	}
+}
+
+int32_t Lowering::binop(BinaryOperator * bop, int32_t want) {
+	Expr * lhs = bop->getLHS();
+	Expr * rhs = bop->getRHS();
+	BinaryOperatorKind op = bop->getOpcode();
+	if (op == BO_Assign) {
+		int32_t val;
+		assign(bop, val);
+		return into(val, want, bop);
+	}
+	if (op == BO_Comma) {
+		effect(lhs);
+		return expr(rhs, want);
+	}
+	if (op == BO_LAnd || op == BO_LOr)
+		return logical(bop, want);
+	if (CompoundAssignOperator * cao = dyn_cast<CompoundAssignOperator>(bop))
+		return compoundAssign(cao, want);
+
+	Opcode kernel;
+	int64_t scale = 0;
+	bool lptr = lhs->getType()->isPointerType(), rptr = rhs->getType()->isPointerType();
+	if ((op == BO_Add || op == BO_Sub) && (lptr || rptr)) {
+		QualType pointee = (lptr ? lhs : rhs)->getType()->getPointeeType();
+		if (pointee->isIncompleteType() && !pointee->isVoidType())
+			return unsupported("arithmetic on " + (lptr ? lhs : rhs)->getType().getAsString());
+		scale = pointee->isVoidType() ? 1 : mEnv.sizeOf(pointee);
+		if (op == BO_Add)
+			kernel = lptr ? byKind<PtrPlus>(kindOf(rhs->getType())) : byKind<PlusPtr>(kindOf(lhs->getType()));
+		else
+			kernel = rptr ? opcode<PtrDiff>() : byKind<PtrMinus>(kindOf(rhs->getType()));
+	} else {
+		// both operands have the same type after the usual conversions, but
+		// for a shift's count, which is masked anyway. A constant one goes
+		// inline, on the right.
+		Kind kind = kindOf(lhs->getType());
+		int64_t imm;
+		bool inlined = constant(rhs, imm);
+		if (!inlined && mirrored(op) != BO_Comma && constant(lhs, imm)) {
+			std::swap(lhs, rhs);
+			op = mirrored(op);
+			inlined = true;
+		}
+		if (!arithKernel(op, kind, inlined, kernel))
+			return unsupported("operator " + bop->getOpcodeStr().str());
+		if (inlined) {
+			int32_t a = expr(lhs);
+			int32_t dst = dest(want);
+			emit(kernel, dst, a, 0, imm, bop);
+			return dst;
+		}
+	}
+	int32_t a = expr(lhs);
+	int32_t b = expr(rhs);
+	int32_t dst = dest(want);
+	emit(kernel, dst, a, b, scale, bop);
+	return dst;
+}
+
+bool Lowering::arithKernel(BinaryOperatorKind op, Kind kind, bool inlined, Opcode &kernel) {
+	switch (op) {
+	case BO_Add: kernel = inlined ? arith<AddImm>(kind) : arith<AddOp>(kind); break;
+	case BO_Sub: kernel = inlined ? arith<SubImm>(kind) : arith<SubOp>(kind); break;
+	case BO_Mul: kernel = inlined ? arith<MulImm>(kind) : arith<MulOp>(kind); break;
+	case BO_Div: kernel = inlined ? arith<DivImm>(kind) : arith<DivOp>(kind); break;
+	case BO_Rem: kernel = inlined ? arith<RemImm>(kind) : arith<RemOp>(kind); break;
+	case BO_And: kernel = inlined ? arith<AndImm>(kind) : arith<AndOp>(kind); break;
+	case BO_Or: kernel = inlined ? arith<OrImm>(kind) : arith<OrOp>(kind); break;
+	case BO_Xor: kernel = inlined ? arith<XorImm>(kind) : arith<XorOp>(kind); break;
+	case BO_Shl: kernel = inlined ? arith<ShlImm>(kind) : arith<ShlOp>(kind); break;
+	case BO_Shr: kernel = inlined ? arith<ShrImm>(kind) : arith<ShrOp>(kind); break;
+	case BO_LT: kernel = inlined ? arith<LTImm>(kind) : arith<LTOp>(kind); break;
+	case BO_GT: kernel = inlined ? arith<GTImm>(kind) : arith<GTOp>(kind); break;
+	case BO_LE: kernel = inlined ? arith<LEImm>(kind) : arith<LEOp>(kind); break;
+	case BO_GE: kernel = inlined ? arith<GEImm>(kind) : arith<GEOp>(kind); break;
+	case BO_EQ: kernel = inlined ? arith<EQImm>(kind) : arith<EQOp>(kind); break;
+	case BO_NE: kernel = inlined ? arith<NEImm>(kind) : arith<NEOp>(kind); break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/// a && b and a || b: b runs only when a does not decide, the result is 0
+/// or 1. Built in a temporary, want may be read by b.
+int32_t Lowering::logical(BinaryOperator * bop, int32_t want) {
+	int32_t dst = temp();
+	int32_t top = mTop;
+	emit(opcode<ToBool>(), dst, cond(bop->getLHS()), 0, 0, bop);
+	mTop = top;
+	size_t toEnd = jump(bop->getOpcode() == BO_LAnd ? opcode<JumpIfFalse>() : opcode<JumpIfTrue>(), dst, 0, bop);
+	emit(opcode<ToBool>(), dst, cond(bop->getRHS()), 0, 0, bop);
+	mTop = top;
+	patch(toEnd, here());
+	return into(dst, want, bop);
+}
+
+/// a op= b in one kernel when a has a slot; otherwise a load, the kernel
+/// and a store
+int32_t Lowering::compoundAssign(CompoundAssignOperator * cao, int32_t want) {
+	Expr * lhs = cao->getLHS();
+	Expr * rhs = cao->getRHS();
+	BinaryOperatorKind op = BinaryOperator::getOpForCompoundAssignment(cao->getOpcode());
+	LValue lv = lvalue(lhs);
+	if (failed())
+		return 0;
+	bool slot = lv.kind == LValue::Slot;
+	int32_t old = slot ? lv.slot : load(lv, -1, cao);
+	int32_t res = slot ? lv.slot : temp();
+	if (lhs->getType()->isPointerType()) {
+		QualType pointee = lhs->getType()->getPointeeType();
+		if (pointee->isIncompleteType() && !pointee->isVoidType())
+			return unsupported("arithmetic on " + lhs->getType().getAsString());
+		int64_t scale = pointee->isVoidType() ? 1 : mEnv.sizeOf(pointee);
+		Opcode kernel = op == BO_Add ? byKind<PtrPlus>(kindOf(rhs->getType())) : byKind<PtrMinus>(kindOf(rhs->getType()));
+		int32_t b = expr(rhs);
+		emit(kernel, res, old, b, scale, cao);
+	} else {
+		// computed in the promoted type, then narrowed back to a's
+		Kind kind = kindOf(cao->getComputationResultType());
+		Opcode kernel;
+		int64_t imm;
+		bool inlined = constant(rhs, imm);
+		if (!arithKernel(op, kind, inlined, kernel))
+			return unsupported("operator " + cao->getOpcodeStr().str());
+		if (inlined) {
+			emit(kernel, res, old, 0, imm, cao);
+		} else {
+			int32_t b = expr(rhs);
+			emit(kernel, res, old, b, 0, cao);
+		}
+		if (kindOf(lhs->getType()) != kind)
+			emit(byKind<Convert>(kindOf(lhs->getType())), res, res, 0, 0, cao);
+	}
+	if (!slot)
+		store(lv, res, cao);
+	return into(res, want, cao);
+}
+
+/// ++ and --: one AddImm on a slot, the step being the pointee's size for
+/// pointers. used says whether the value of the expression is needed.
+int32_t Lowering::incDec(UnaryOperator * uop, int32_t want, bool used) {
+	QualType type = uop->getSubExpr()->getType();
+	int64_t step = 1;
+	if (type->isPointerType()) {
+		QualType pointee = type->getPointeeType();
+		if (pointee->isIncompleteType() && !pointee->isVoidType())
+			return unsupported("arithmetic on " + type.getAsString());
+		step = pointee->isVoidType() ? 1 : mEnv.sizeOf(pointee);
+	}
+	if (uop->isDecrementOp())
+		step = -step;
+	LValue lv = lvalue(uop->getSubExpr());
+	if (failed())
+		return 0;
+	bool slot = lv.kind == LValue::Slot;
+	int32_t old = slot ? lv.slot : load(lv, -1, uop);
+	if (used && uop->isPostfix() && slot) {
+		old = temp();
+		emit(opcode<Move>(), old, lv.slot, 0, 0, uop);
+	}
+	int32_t next = slot ? lv.slot : temp();
+	Kind kind = kindOf(type);
+	emit(type->isPointerType() ? opcode<AddImm<int64_t>>() : arith<AddImm>(kind), next,
+	     slot ? lv.slot : old, 0, step, uop);
+	// arithmetic is done in int at least; char and short wrap back
+	if (kind != S32 && kind != U32 && kind != S64 && kind != U64)
+		emit(byKind<Convert>(kind), next, next, 0, 0, uop);
+	if (!slot)
+		store(lv, next, uop);
+	if (!used)
+		return next;
+	return into(uop->isPostfix() ? old : next, want, uop);
+}
+
+int32_t Lowering::unop(UnaryOperator * uop, int32_t want) {
+	Expr * sub = uop->getSubExpr();
+	switch (uop->getOpcode()) {
+	case UO_Plus:
+		return expr(sub, want);
+	case UO_Minus: {
+		int32_t val = expr(sub);
+		int32_t dst = dest(want);
+		emit(byKind<Neg>(kindOf(uop->getType())), dst, val, 0, 0, uop);
+		return dst;
+	}
+	case UO_Not: {
+		int32_t val = expr(sub);
+		int32_t dst = dest(want);
+		emit(arith<XorImm>(kindOf(uop->getType())), dst, val, 0, -1, uop);
+		return dst;
+	}
+	case UO_LNot: {
+		// compares the operand itself with 0, like cond
+		Expr * operand = sub->IgnoreParens();
+		if (ImplicitCastExpr * cast = dyn_cast<ImplicitCastExpr>(operand))
+			if (cast->getCastKind() == CK_IntegralToBoolean || cast->getCastKind() == CK_PointerToBoolean)
+				operand = cast->getSubExpr();
+		int32_t val = expr(operand);
+		int32_t dst = dest(want);
+		emit(arith<EQImm>(kindOf(operand->getType())), dst, val, 0, 0, uop);
+		return dst;
+	}
+	case UO_PreInc:
+	case UO_PreDec:
+	case UO_PostInc:
+	case UO_PostDec:
+		return incDec(uop, want, true);
+	case UO_AddrOf: {
+		LValue lv = lvalue(sub);
+		if (lv.kind == LValue::Memory)
+			return address(lv, want, uop);
+		if (lv.kind == LValue::Slot && lv.type->isArrayType())
+			return into(lv.slot, want, uop);
+		if (lv.kind == LValue::Global) {
+			int32_t dst = dest(want);
+			emit(opcode<Const>(), dst, 0, 0, lv.addr, uop);
+			return dst;
+		}
+		return unsupported("address of " + sub->getType().getAsString() + " variable");
+	}
+	default:
+		return unsupported("operator " + UnaryOperator::getOpcodeStr(uop->getOpcode()).str());
+	}
+}
+
+int32_t Lowering::call(CallExpr * c, int32_t want) {
+	FunctionDecl * callee = c->getDirectCallee();
+	if (!callee)
+		return unsupported("indirect call");
+	switch (mEnv.builtin(callee)) {
+	case Environment::BuiltinGet: {
+		int32_t dst = dest(want);
+		emit(opcode<Get>(), dst, 0, 0, 0, c);
+		return dst;
+	}
+	case Environment::BuiltinPrint: {
+		int32_t val = expr(c->getArg(0));
+		emit(opcode<Print>(), -1, val, 0, 0, c);
+		return val;
+	}
+	case Environment::BuiltinMalloc: {
+		int32_t size = expr(c->getArg(0));
+		int32_t dst = dest(want);
+		emit(opcode<Malloc>(), dst, size, 0, 0, c);
+		return dst;
+	}
+	case Environment::BuiltinFree: {
+		int32_t addr = expr(c->getArg(0));
+		emit(opcode<Free>(), -1, addr, 0, 0, c);
+		return addr;
+	}
+	case Environment::BuiltinParallelFor: {
+		FunctionDecl * func = mEnv.parallelBody(c);
+		if (!func)
+			return unsupported("PARALLEL_FOR over something other than a function of one parameter");
+		int32_t begin = expr(c->getArg(0));
+		int32_t end = expr(c->getArg(1));
+		emit(opcode<ParallelFor>(), -1, begin, end, (int64_t)func, c);
+		return begin;
+	}
+	case Environment::NotBuiltin:
+		break;
+	}
+	FunctionDecl * def = callee->getDefinition();
+	if (!def)
+		return unsupported("call to " + callee->getNameAsString() + ", which has no body");
+	unsigned argc = c->getNumArgs();
+	if (argc != def->getNumParams())
+		return unsupported("call to " + callee->getNameAsString() + " with " + std::to_string(argc) + " arguments");
+	// the arguments go to consecutive slots, copied from there by the call
+	int32_t first = mTop;
+	for (unsigned i = 0; i < argc; ++i)
+		temp();
+	for (unsigned i = 0; i < argc; ++i)
+		expr(c->getArg(i), first + i);
+	int32_t dst = dest(want);
+	emit(opcode<CallFunction>(), dst, first, argc, (int64_t)def, c);
+	return dst;
+}
+
+Lowering::LValue Lowering::assign(BinaryOperator * bop, int32_t &val) {
+	LValue lv = lvalue(bop->getLHS());
+	// straight into the variable when it has a slot
+	val = expr(bop->getRHS(), lv.kind == LValue::Slot ? lv.slot : -1);
+	store(lv, val, bop);
+	return lv;
+}
+
+Lowering::LValue Lowering::lvalue(Expr * e) {
+	e = e->IgnoreParens();
+	LValue lv = {LValue::Slot, 0, 0, e->getType()};
+	if (failed())
+		return lv;
+	if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(e)) {
+		VarDecl * var = dyn_cast<VarDecl>(ref->getDecl());
+		if (!var) {
+			unsupported("reference to " + ref->getDecl()->getNameAsString());
+			return lv;
+		}
+		llvm::DenseMap<const VarDecl *, int32_t>::iterator it = mLocals.find(var);
+		if (it != mLocals.end()) {
+			// the slot of an address-taken local or a record holds its address
+			lv.slot = it->second;
+			if (mEnv.addressTaken(var) || var->getType()->isRecordType())
+				lv.kind = LValue::Memory;
+		} else if (int64_t addr = mEnv.globalAddress(var)) {
+			if (scalar(var->getType())) {
+				lv.kind = LValue::Global;
+				lv.addr = addr;
+			} else {
+				// an array or a record: its address is a constant
+				lv.kind = LValue::Memory;
+				lv.slot = temp();
+				emit(opcode<Const>(), lv.slot, 0, 0, addr, ref);
+			}
+		} else {
+			unsupported("variable " + var->getNameAsString() + " of type " + var->getType().getAsString());
+		}
+		return lv;
+	}
+	if (UnaryOperator * uop = dyn_cast<UnaryOperator>(e)) {
+		if (uop->getOpcode() == UO_Deref) {
+			lv.kind = LValue::Memory;
+			lv.slot = expr(uop->getSubExpr());
+			return lv;
+		}
+	}
+	if (MemberExpr * member = dyn_cast<MemberExpr>(e)) {
+		FieldDecl * field = dyn_cast<FieldDecl>(member->getMemberDecl());
+		if (!field || field->isBitField()) {
+			unsupported("member " + member->getMemberDecl()->getNameAsString());
+			return lv;
+		}
+		// the field's offset rides along to the Load or Store
+		if (member->isArrow()) {
+			lv.kind = LValue::Memory;
+			lv.slot = expr(member->getBase());
+		} else {
+			LValue base = lvalue(member->getBase());
+			if (base.kind != LValue::Memory) {
+				unsupported("member of " + member->getBase()->getType().getAsString());
+				return lv;
+			}
+			lv.kind = LValue::Memory;
+			lv.slot = base.slot;
+			lv.addr = base.addr;
+		}
+		lv.addr += mEnv.fieldOffset(field);
+		return lv;
+	}
+	if (ArraySubscriptExpr * sub = dyn_cast<ArraySubscriptExpr>(e)) {
+		int32_t base = expr(sub->getBase());
+		int32_t idx = expr(sub->getIdx());
+		lv.kind = LValue::Memory;
+		lv.slot = temp();
+		emit(byKind<PtrPlus>(kindOf(sub->getIdx()->getType())), lv.slot, base, idx, mEnv.sizeOf(e->getType()), sub);
+		return lv;
+	}
+	if (BinaryOperator * bop = dyn_cast<BinaryOperator>(e)) {
+		// C++ assignments are lvalues, a = b = c reads b back
+		if (bop->getOpcode() == BO_Assign) {
+			int32_t val;
+			return assign(bop, val);
+		}
+	}
+	unsupported(std::string("lvalue ") + e->getStmtClassName());
+	return lv;
+}
+
+int32_t Lowering::address(const LValue &lv, int32_t want, Expr * src) {
+	if (!lv.addr)
+		return into(lv.slot, want, src);
+	int32_t dst = dest(want);
+	emit(opcode<AddImm<int64_t>>(), dst, lv.slot, 0, lv.addr, src);
+	return dst;
+}
+
+int32_t Lowering::load(const LValue &lv, int32_t want, Expr * src) {
+	if (lv.kind == LValue::Slot)
+		return into(lv.slot, want, src);
+	int32_t dst = dest(want);
+	if (lv.kind == LValue::Global)
+		emit(byKind<LoadGlobal>(kindOf(lv.type)), dst, 0, 0, lv.addr, src);
+	else
+		emit(mEnv.shadow() ? byKind<CheckedLoad>(kindOf(lv.type)) : byKind<Load>(kindOf(lv.type)), dst, lv.slot, 0, lv.addr, src);
+	return dst;
+}
+
+void Lowering::store(const LValue &lv, int32_t val, Expr * src) {
+	if (lv.kind == LValue::Slot) {
+		if (val != lv.slot)
+			emit(opcode<Move>(), lv.slot, val, 0, 0, src);
+	} else if (lv.kind == LValue::Global) {
+		emit(byKind<StoreGlobal>(kindOf(lv.type)), -1, val, 0, lv.addr, src);
+	} else {
+		emit(mEnv.shadow() ? byKind<CheckedStore>(kindOf(lv.type)) : byKind<Store>(kindOf(lv.type)), -1, lv.slot, val, lv.addr, src);
+	}
+}
+
+} // namespace
+
+std::unique_ptr<Code> lowerFunction(FunctionDecl * func, Environment &env, std::string &why) {
+	return Lowering(func, env).run(why);
+}
+
+void linkCalls(Code &code, Environment &env) {
+	for (Insn &insn : code.insns) {
+		if (insn.op != OP_CallFunction)
+			continue;
+		FunctionDecl * callee = (FunctionDecl *)insn.imm;
+		if (const Code * target = env.preparedAlready(callee)) {
+			insn.op = OP_CallPrepared;
+			insn.imm = (int64_t)target;
+		} else if (env.walked(callee)) {
+			insn.op = OP_CallWalker;
+		}
+		// otherwise the callee is prepared when the call first runs
+	}
+}
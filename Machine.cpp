@@ -0,0 +1,135 @@
+//==--- Machine.cpp - Run prepared functions -------------------------------===//
+//===----------------------------------------------------------------------===//
+
+#include "Kernels.h"
+
+#if !defined(AST_DISPATCH_SWITCH) && !defined(__GNUC__)
+#define AST_DISPATCH_SWITCH
+#endif
+
+// fuzz builds report every kernel run as a node, see Environment::cover
+#ifdef AST_INTERPRETER_FUZZ
+#define AST_COVER(ip) mEnv.cover(Stmt::lastStmtConstant + 1 + (ip)->op)
+#else
+#define AST_COVER(ip)
+#endif
+
+/// Slots and local arrays of all prepared frames; deeper recursion stops the
+/// program with a "stack" error
+static const size_t SlotStackSize = 1 << 20;
+static const size_t ArenaSize = 8 << 20;
+
+Machine::Machine(Environment &env) : mEnv(env),
+	mSlots(new int64_t[SlotStackSize]), mArena(new char[ArenaSize]) {
+	mSlotTop = mSlots.get();
+	mSlotEnd = mSlotTop + SlotStackSize;
+	mArenaTop = mArena.get();
+	mArenaEnd = mArenaTop + ArenaSize;
+	mHalt = Insn{nullptr, OP_Halt, -1, 0, 0, 0};
+	dispatch(nullptr);
+	if (mLabels)
+		mHalt.label = mLabels[OP_Halt];
+}
+
+void Machine::thread(Code &code) {
+	if (!mLabels)
+		return;
+	for (Insn &insn : code.insns)
+		insn.label = mLabels[insn.op];
+}
+
+int64_t Machine::run(const Code * code, const int64_t * args, unsigned argc) {
+	size_t base = mBase;
+	mBase = mFrames.size();
+	mResult = 0;
+	const Insn * ip = push(code, args, argc, -1, nullptr);
+	if (ip) {
+		dispatch(ip);
+	} else {
+		mEnv.fail("stack", "interpreter stack exhausted", code->func->getBody());
+	}
+	mBase = base;
+	return mResult;
+}
+
+void Machine::dispatch(const Insn * ip) {
+#ifdef AST_DISPATCH_SWITCH
+	if (!ip)
+		return;
+	for (;;) {
+		switch (ip->op) {
+#define AST_OPCODE_CASE(name, kernel) case OP_##name: AST_COVER(ip); ip = kernel::run(*this, ip); break;
+		AST_OPCODES(AST_OPCODE_CASE)
+#undef AST_OPCODE_CASE
+		case OP_Halt:
+			return;
+		}
+	}
+#else
+	// one indirect jump per kernel, so each one gets its own branch history
+	static const void * const labels[] = {
+#define AST_OPCODE_LABEL(name, kernel) &&L_##name,
+		AST_OPCODES(AST_OPCODE_LABEL)
+#undef AST_OPCODE_LABEL
+		&&L_Halt
+	};
+	if (!ip) {
+		mLabels = labels;
+		return;
+	}
+	goto *ip->label;
+#define AST_OPCODE_BODY(name, kernel) L_##name: AST_COVER(ip); ip = kernel::run(*this, ip); goto *ip->label;
+	AST_OPCODES(AST_OPCODE_BODY)
+#undef AST_OPCODE_BODY
+L_Halt:
+	return;
+#endif
+}
+
+const Insn * Machine::push(const Code * code, const int64_t * args, unsigned argc,
+                           int32_t dst, const Insn * ret) {
+	if ((size_t)(mSlotEnd - mSlotTop) < code->numSlots || (size_t)(mArenaEnd - mArenaTop) < code->frameBytes)
+		return nullptr;
+	int64_t * regs = mSlotTop;
+	std::copy(args, args + argc, regs);
+	mSlotTop += code->numSlots;
+	mFrames.push_back(Frame{code, ret, dst, regs, mArenaTop});
+	if (Shadow * shadow = mEnv.shadow()) {
+		// only the frame's objects are addressable, the gaps are redzones
+		shadow->poison((int64_t)mArenaTop, code->frameBytes, Shadow::StackRedzone);
+		for (const std::pair<unsigned, unsigned> &object : code->objects)
+			shadow->unpoison((int64_t)mArenaTop + object.first, object.second);
+	}
+	mArenaTop += code->frameBytes;
+	mRegs = regs;
+	mEnv.noteDepth();
+	return code->insns.data();
+}
+
+const Insn * Machine::pop(int64_t value) {
+	Frame frame = mFrames.back();
+	mFrames.pop_back();
+	mSlotTop = frame.regs;
+	mArenaTop = frame.arena;
+	if (Shadow * shadow = mEnv.shadow())
+		shadow->poison((int64_t)frame.arena, frame.code->frameBytes, Shadow::StackDead);
+	mRegs = mFrames.empty() ? nullptr : mFrames.back().regs;
+	if (mFrames.size() == mBase) {
+		mResult = value;
+		return &mHalt;
+	}
+	mRegs[frame.dst] = value;
+	return frame.ret;
+}
+
+void Machine::addRoots(GcRoots &roots) {
+	roots.ranges.push_back(std::make_pair((int64_t)mSlots.get(), (int64_t)((char *)mSlotTop - (char *)mSlots.get())));
+	roots.ranges.push_back(std::make_pair((int64_t)mArena.get(), (int64_t)(mArenaTop - mArena.get())));
+}
+
+const Insn * Machine::unwind() {
+	while (mFrames.size() > mBase)
+		pop(0);
+	mResult = 0;
+	return &mHalt;
+}
@@ -0,0 +1,359 @@
+//==--- Native.cpp - native tier for hot guest functions -------------------===//
+//===----------------------------------------------------------------------===//
+#include "Environment.h"
+
+#ifdef AST_INTERPRETER_NATIVE
+
+#include "clang/AST/Mangle.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+/// The Environment serving the builtins of the native code running on this thread
+static thread_local Environment * tEnv = nullptr;
+
+static int hostGet() {
+   // under --multiplex GET may suspend this fiber, and the programs that
+   // run meanwhile set tEnv to their own
+   Environment * env = tEnv;
+   int val = (int)env->input();
+   tEnv = env;
+   return val;
+}
+static void hostPrint(int val) {
+   tEnv->output(val);
+}
+static void * hostMalloc(int size) {
+   return (void *)tEnv->allocate(size);
+}
+static void hostFree(void * addr) {
+   tEnv->release((int64_t)addr);
+}
+
+static bool isBuiltin(const FunctionDecl * func) {
+   if (!func->getIdentifier())
+      return false;
+   StringRef name = func->getName();
+   return name == "GET" || name == "PRINT" || name == "MALLOC" || name == "FREE";
+}
+
+static llvm::JITTargetAddress builtinAddress(StringRef name) {
+   if (name == "GET")
+      return llvm::pointerToJITTargetAddress(&hostGet);
+   if (name == "PRINT")
+      return llvm::pointerToJITTargetAddress(&hostPrint);
+   if (name == "MALLOC")
+      return llvm::pointerToJITTargetAddress(&hostMalloc);
+   return llvm::pointerToJITTargetAddress(&hostFree);
+}
+
+static std::string entryName(const std::string &mangled) {
+   return "__ast_entry_" + mangled;
+}
+
+/// Runs clang CodeGen and keeps the module it produced
+class CaptureModuleAction : public EmitLLVMOnlyAction {
+public:
+   CaptureModuleAction(llvm::LLVMContext * context, std::unique_ptr<llvm::Module> &module)
+      : EmitLLVMOnlyAction(context), mModule(module) {
+   }
+protected:
+   void EndSourceFileAction() override {
+      EmitLLVMOnlyAction::EndSourceFileAction();
+      mModule = takeModule();
+   }
+private:
+   std::unique_ptr<llvm::Module> &mModule;
+};
+
+/// Run the program through clang CodeGen at -O2, in the same language the
+/// interpreter parses it in
+static std::unique_ptr<llvm::Module> lowerProgram(StringRef code, llvm::LLVMContext * context) {
+   std::unique_ptr<llvm::Module> module;
+   if (!tooling::runToolOnCodeWithArgs(
+          std::unique_ptr<FrontendAction>(new CaptureModuleAction(context, module)),
+          code, {"-xc++", "-O2"}, "native.cc", "ast-interpreter"))
+      return nullptr;
+   return module;
+}
+
+/// Collects the functions a body calls and notices whether it touches
+/// globals or calls through a pointer
+class BodyScan : public RecursiveASTVisitor<BodyScan> {
+public:
+   bool VisitDeclRefExpr(DeclRefExpr * ref) {
+      if (VarDecl * var = dyn_cast<VarDecl>(ref->getDecl()))
+         if (var->hasGlobalStorage())
+            local = false;
+      if (FunctionDecl * func = dyn_cast<FunctionDecl>(ref->getDecl()))
+         if (!isBuiltin(func))
+            callees.push_back(func->getCanonicalDecl());
+      return local;
+   }
+   bool VisitCallExpr(CallExpr * call) {
+      if (!call->getDirectCallee())
+         local = false;
+      return local;
+   }
+
+   bool local = true;
+   std::vector<const FunctionDecl *> callees;
+};
+
+struct NativeTier::Impl {
+   ASTContext &context;
+   ASTNameGenerator names;
+   std::unique_ptr<llvm::orc::LLJIT> jit;
+   /// canonical declarations of the functions native code may run
+   llvm::DenseSet<const FunctionDecl *> eligible;
+   bool built = false;
+
+   explicit Impl(ASTContext &context) : context(context), names(context) {
+   }
+
+   void findEligible() {
+      llvm::DenseMap<const FunctionDecl *, std::vector<const FunctionDecl *>> callees;
+      for (Decl * decl : context.getTranslationUnitDecl()->decls()) {
+         FunctionDecl * func = dyn_cast<FunctionDecl>(decl);
+         if (!func || !func->doesThisDeclarationHaveABody() || isBuiltin(func) || func->isVariadic())
+            continue;
+         // pointers would cross between the two memory models, see Native.h
+         bool scalar = func->getReturnType()->isVoidType() || func->getReturnType()->isIntegerType();
+         for (ParmVarDecl * param : func->parameters())
+            scalar = scalar && param->getType()->isIntegerType();
+         if (!scalar)
+            continue;
+         BodyScan scan;
+         scan.TraverseStmt(func->getBody());
+         if (!scan.local)
+            continue;
+         eligible.insert(func->getCanonicalDecl());
+         callees[func->getCanonicalDecl()] = scan.callees;
+      }
+      // a function is only as native as everything it calls
+      bool changed = true;
+      while (changed) {
+         changed = false;
+         for (auto &entry : callees) {
+            if (!eligible.count(entry.first))
+               continue;
+            for (const FunctionDecl * callee : entry.second) {
+               if (!eligible.count(callee)) {
+                  eligible.erase(entry.first);
+                  changed = true;
+                  break;
+               }
+            }
+         }
+      }
+   }
+
+   /// Add __ast_entry_<name>(i64 *args) calling func with its real signature
+   bool addEntry(llvm::Module &module, const FunctionDecl * func) {
+      std::string mangled = names.getName(func);
+      llvm::Function * target = module.getFunction(mangled);
+      if (!target || target->isDeclaration())
+         return false;
+      llvm::LLVMContext &ctx = module.getContext();
+      llvm::Type * i64 = llvm::Type::getInt64Ty(ctx);
+      llvm::FunctionType * type = llvm::FunctionType::get(i64, {llvm::PointerType::getUnqual(i64)}, false);
+      llvm::Function * entry = llvm::Function::Create(type, llvm::Function::ExternalLinkage,
+                                                      entryName(mangled), module);
+      llvm::IRBuilder<> builder(llvm::BasicBlock::Create(ctx, "entry", entry));
+      llvm::FunctionType * targetType = target->getFunctionType();
+      std::vector<llvm::Value *> args;
+      for (unsigned i = 0; i < targetType->getNumParams(); ++i) {
+         llvm::Value * arg = builder.CreateLoad(i64, builder.CreateConstGEP1_64(i64, entry->getArg(0), i));
+         args.push_back(builder.CreateTrunc(arg, targetType->getParamType(i)));
+      }
+      llvm::CallInst * result = builder.CreateCall(target, args);
+      result->setAttributes(target->getAttributes());
+      result->setCallingConv(target->getCallingConv());
+      if (targetType->getReturnType()->isVoidTy())
+         builder.CreateRet(llvm::ConstantInt::get(i64, 0));
+      else if (func->getReturnType()->isSignedIntegerType())
+         builder.CreateRet(builder.CreateSExtOrTrunc(result, i64));
+      else
+         builder.CreateRet(builder.CreateZExtOrTrunc(result, i64));
+      return true;
+   }
+
+   bool build() {
+      built = true;
+      findEligible();
+      if (eligible.empty())
+         return false;
+
+      SourceManager &sm = context.getSourceManager();
+      std::unique_ptr<llvm::LLVMContext> llvmContext(new llvm::LLVMContext());
+      std::unique_ptr<llvm::Module> module = lowerProgram(sm.getBufferData(sm.getMainFileID()), llvmContext.get());
+      if (!module)
+         return false;
+
+      std::vector<const FunctionDecl *> failed;
+      for (const FunctionDecl * func : eligible)
+         if (!addEntry(*module, func))
+            failed.push_back(func);
+      for (const FunctionDecl * func : failed)
+         eligible.erase(func);
+
+      llvm::InitializeNativeTarget();
+      llvm::InitializeNativeTargetAsmPrinter();
+      llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> created = llvm::orc::LLJITBuilder().create();
+      if (!created) {
+         llvm::errs() << "native: " << llvm::toString(created.takeError()) << "\n";
+         return false;
+      }
+      jit = std::move(*created);
+      module->setDataLayout(jit->getDataLayout());
+
+      llvm::orc::JITDylib &lib = jit->getMainJITDylib();
+      llvm::orc::SymbolMap builtins;
+      for (Decl * decl : context.getTranslationUnitDecl()->decls())
+         if (FunctionDecl * func = dyn_cast<FunctionDecl>(decl))
+            if (isBuiltin(func) && !func->hasBody())
+               builtins[jit->mangleAndIntern(names.getName(func))] =
+                  llvm::JITEvaluatedSymbol(builtinAddress(func->getName()), llvm::JITSymbolFlags::Exported);
+      // memset and friends that CodeGen may emit
+      llvm::Expected<std::unique_ptr<llvm::orc::DynamicLibrarySearchGenerator>> process =
+         llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix());
+      if (process)
+         lib.addGenerator(std::move(*process));
+      else
+         llvm::consumeError(process.takeError());
+      llvm::Error error = lib.define(llvm::orc::absoluteSymbols(std::move(builtins)));
+      if (!error)
+         error = jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(llvmContext)));
+      if (error) {
+         llvm::errs() << "native: " << llvm::toString(std::move(error)) << "\n";
+         jit.reset();
+         return false;
+      }
+      return true;
+   }
+};
+
+NativeTier::NativeTier(ASTContext &context, Environment * env) : mImpl(new Impl(context)), mEnv(env) {
+}
+
+NativeTier::~NativeTier() {
+}
+
+NativeTier::Entry NativeTier::compile(FunctionDecl * func) {
+   if (!mImpl->built)
+      mImpl->build();
+   func = func->getCanonicalDecl();
+   if (!mImpl->jit || !mImpl->eligible.count(func))
+      return nullptr;
+   llvm::Expected<llvm::JITEvaluatedSymbol> symbol = mImpl->jit->lookup(entryName(mImpl->names.getName(func)));
+   if (!symbol) {
+      llvm::errs() << "native: " << llvm::toString(symbol.takeError()) << "\n";
+      return nullptr;
+   }
+   return (Entry)symbol->getAddress();
+}
+
+int64_t NativeTier::call(Entry entry, const int64_t * args) {
+   Environment * saved = tEnv;
+   tEnv = mEnv;
+   int64_t result = entry(args);
+   tEnv = saved;
+   return result;
+}
+
+static bool emitObject(llvm::Module &module, const std::string &path) {
+   llvm::InitializeNativeTarget();
+   llvm::InitializeNativeTargetAsmPrinter();
+   std::string error;
+   const llvm::Target * target = llvm::TargetRegistry::lookupTarget(module.getTargetTriple(), error);
+   if (!target) {
+      llvm::errs() << "error: " << error << "\n";
+      return false;
+   }
+   std::unique_ptr<llvm::TargetMachine> machine(target->createTargetMachine(
+      module.getTargetTriple(), "generic", "", llvm::TargetOptions(), llvm::Reloc::PIC_));
+   module.setDataLayout(machine->createDataLayout());
+
+   std::error_code ec;
+   llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+   if (ec) {
+      llvm::errs() << "error: cannot write " << path << ": " << ec.message() << "\n";
+      return false;
+   }
+   llvm::legacy::PassManager passes;
+   if (machine->addPassesToEmitFile(passes, out, nullptr, llvm::CGFT_ObjectFile)) {
+      llvm::errs() << "error: cannot emit object files for " << module.getTargetTriple() << "\n";
+      return false;
+   }
+   passes.run(module);
+   return true;
+}
+
+bool compileProgram(const std::string &code, const std::string &output, const std::string &runtime) {
+   llvm::LLVMContext context;
+   std::unique_ptr<llvm::Module> module = lowerProgram(code, &context);
+   if (!module)
+      return false;
+   if (llvm::StringRef(output).endswith(".o"))
+      return emitObject(*module, output);
+
+   llvm::SmallString<128> object;
+   if (std::error_code ec = llvm::sys::fs::createTemporaryFile("ast-aot", "o", object)) {
+      llvm::errs() << "error: cannot create a temporary file: " << ec.message() << "\n";
+      return false;
+   }
+   bool linked = false;
+   if (emitObject(*module, object.str().str())) {
+      llvm::ErrorOr<std::string> driver = llvm::sys::findProgramByName("c++");
+      if (!driver)
+         driver = llvm::sys::findProgramByName("cc");
+      if (!driver) {
+         llvm::errs() << "error: no c++ or cc to link with\n";
+      } else {
+         llvm::StringRef args[] = {*driver, object, runtime, "-o", output};
+         std::string message;
+         linked = llvm::sys::ExecuteAndWait(*driver, args, llvm::None, {}, 0, 0, &message) == 0;
+         if (!linked)
+            llvm::errs() << "error: linking " << output << " failed " << message << "\n";
+      }
+   }
+   llvm::sys::fs::remove(object);
+   return linked;
+}
+
+#else
+
+bool compileProgram(const std::string &, const std::string &, const std::string &) {
+   llvm::errs() << "error: --aot needs a build with ENABLE_NATIVE\n";
+   return false;
+}
+
+struct NativeTier::Impl {
+};
+
+NativeTier::NativeTier(ASTContext &, Environment * env) : mEnv(env) {
+}
+
+NativeTier::~NativeTier() {
+}
+
+NativeTier::Entry NativeTier::compile(FunctionDecl *) {
+   return nullptr;
+}
+
+int64_t NativeTier::call(Entry entry, const int64_t * args) {
+   return entry(args);
+}
+
+#endif
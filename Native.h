@@ -0,0 +1,56 @@
+//==--- Native.h - native tier for hot guest functions ---------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_NATIVE_H
+#define AST_INTERPRETER_NATIVE_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+namespace clang {
+class ASTContext;
+class FunctionDecl;
+}
+
+class Environment;
+
+/// Compiles hot guest functions to native code. The program source is run
+/// through clang CodeGen once, on the first promotion, and the module is
+/// handed to an ORC LLJIT in which GET, PRINT, MALLOC and FREE resolve to the
+/// Environment's builtins.
+///
+/// Native code keeps its own copies of globals and does not share the
+/// interpreter's frames, so only functions that cannot tell the difference
+/// are compiled: integer parameters and results, no globals, and callees that
+/// are builtins or compile themselves. Everything else stays interpreted.
+///
+/// Without AST_INTERPRETER_NATIVE (cmake -DENABLE_NATIVE=ON) compile() always
+/// returns null.
+class NativeTier {
+public:
+   /// Takes the guest arguments as 64-bit values and returns the result the
+   /// same way
+   typedef int64_t (*Entry)(const int64_t * args);
+
+   NativeTier(clang::ASTContext &context, Environment * env);
+   ~NativeTier();
+
+   /// Native code for func, or null when it must stay interpreted
+   Entry compile(clang::FunctionDecl * func);
+
+   /// Run native code with this tier's Environment serving the builtins
+   int64_t call(Entry entry, const int64_t * args);
+
+   struct Impl;
+private:
+   std::unique_ptr<Impl> mImpl;
+   Environment * mEnv;
+};
+
+/// Compile a whole program ahead of time through the same CodeGen path and
+/// link it against the runtime library, which provides the builtins. An
+/// output ending in .o is left as an object file. Prints an error and returns
+/// false on failure.
+bool compileProgram(const std::string &code, const std::string &output, const std::string &runtime);
+
+#endif
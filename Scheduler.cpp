@@ -0,0 +1,237 @@
+//==--- Scheduler.cpp - Many programs on worker threads --------------------===//
+//===----------------------------------------------------------------------===//
+#include "Scheduler.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+
+volatile sig_atomic_t Stop = 0;
+
+void requestStop(int) {
+   Stop = 1;
+}
+
+double milliseconds(std::chrono::steady_clock::duration time) {
+   return std::chrono::duration<double, std::milli>(time).count();
+}
+
+/// Write path through a temporary name, so that whoever waits for path never
+/// sees it half written
+bool writeAtomically(const std::string &path, const std::string &data) {
+   std::string temp = path + ".tmp";
+   {
+      std::error_code ec;
+      llvm::raw_fd_ostream os(temp, ec);
+      if (ec)
+         return false;
+      os << data;
+      os.close();
+      if (os.has_error()) {
+         os.clear_error();
+         return false;
+      }
+   }
+   return !llvm::sys::fs::rename(temp, path);
+}
+
+} // namespace
+
+Scheduler::Scheduler(unsigned workers, size_t maxPending, Runner run, Runner done)
+   : mRun(std::move(run)), mDone(std::move(done)), mMaxPending(std::max<size_t>(maxPending, 1)) {
+   if (!workers)
+      workers = std::max(1u, std::thread::hardware_concurrency());
+   mStart = mEnd = std::chrono::steady_clock::now();
+   for (unsigned i = 0; i < workers; ++i)
+      mWorkers.emplace_back(new Worker);
+   for (unsigned i = 0; i < workers; ++i)
+      mWorkers[i]->thread = std::thread([this, i] { work(i); });
+}
+
+Scheduler::~Scheduler() {
+   finish();
+}
+
+void Scheduler::submit(std::unique_ptr<Job> job) {
+   job->submitted = std::chrono::steady_clock::now();
+   std::unique_lock<std::mutex> lock(mLock);
+   mSpace.wait(lock, [this] { return mQueued < mMaxPending; });
+   Worker &worker = *mWorkers[mNext++ % mWorkers.size()];
+   {
+      std::lock_guard<std::mutex> guard(worker.lock);
+      worker.jobs.push_back(std::move(job));
+   }
+   ++mQueued;
+   lock.unlock();
+   mWork.notify_one();
+}
+
+void Scheduler::finish() {
+   {
+      std::lock_guard<std::mutex> lock(mLock);
+      mStopping = true;
+   }
+   mWork.notify_all();
+   for (std::unique_ptr<Worker> &worker : mWorkers)
+      if (worker->thread.joinable())
+         worker->thread.join();
+}
+
+void Scheduler::work(unsigned self) {
+   for (;;) {
+      {
+         // claim one of the queued jobs before looking for it, so that a
+         // job is never taken by two workers nor missed by all of them
+         std::unique_lock<std::mutex> lock(mLock);
+         mWork.wait(lock, [this] { return mQueued || mStopping; });
+         if (!mQueued)
+            return;
+         --mQueued;
+      }
+      mSpace.notify_one();
+      std::unique_ptr<Job> job = take(self);
+      mRun(*job);
+      mDone(*job);
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      std::lock_guard<std::mutex> lock(mLock);
+      mLatencies.push_back(milliseconds(now - job->submitted));
+      mEnd = now;
+   }
+}
+
+std::unique_ptr<Job> Scheduler::take(unsigned self) {
+   // a claimed job is in some deque, though another worker may be moving
+   // through the deques at the same time
+   for (;;) {
+      for (size_t k = 0; k < mWorkers.size(); ++k) {
+         Worker &worker = *mWorkers[(self + k) % mWorkers.size()];
+         std::lock_guard<std::mutex> guard(worker.lock);
+         if (worker.jobs.empty())
+            continue;
+         std::unique_ptr<Job> job;
+         if (k == 0) {
+            job = std::move(worker.jobs.front());
+            worker.jobs.pop_front();
+         } else {
+            job = std::move(worker.jobs.back());
+            worker.jobs.pop_back();
+         }
+         return job;
+      }
+   }
+}
+
+void Scheduler::report(llvm::raw_ostream &os) {
+   std::lock_guard<std::mutex> lock(mLock);
+   std::vector<double> latencies = mLatencies;
+   std::sort(latencies.begin(), latencies.end());
+   double seconds = milliseconds(mEnd - mStart) / 1000;
+   double p50 = latencies.empty() ? 0 : latencies[(latencies.size() - 1) * 50 / 100];
+   double p99 = latencies.empty() ? 0 : latencies[(latencies.size() - 1) * 99 / 100];
+   os << "== " << latencies.size() << " programs in " << llvm::format("%.3f", seconds) << " s, "
+      << llvm::format("%.1f", seconds > 0 ? latencies.size() / seconds : 0.0) << " programs/s, latency p50 "
+      << llvm::format("%.3f", p50) << " ms, p99 " << llvm::format("%.3f", p99) << " ms\n";
+}
+
+bool runThroughput(const std::vector<std::string> &inputs, unsigned workers, size_t maxPending,
+                   const Scheduler::Runner &run, llvm::raw_ostream &report) {
+   std::mutex reportLock;
+   std::atomic<bool> ok(true);
+   Scheduler scheduler(workers, maxPending, run, [&](Job &job) {
+      std::lock_guard<std::mutex> lock(reportLock);
+      report << "== " << job.name << ": exit " << job.status << "\n" << job.output;
+      report.flush();
+      if (job.status)
+         ok = false;
+   });
+   for (const std::string &input : inputs) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> data = llvm::MemoryBuffer::getFile(input);
+      if (!data) {
+         std::lock_guard<std::mutex> lock(reportLock);
+         report << "== " << input << ": " << data.getError().message() << "\n";
+         ok = false;
+         continue;
+      }
+      std::unique_ptr<Job> job(new Job);
+      job->name = input;
+      job->code = (*data)->getBuffer().str();
+      scheduler.submit(std::move(job));
+   }
+   scheduler.finish();
+   scheduler.report(report);
+   return ok;
+}
+
+bool serveDirectory(const std::string &dir, unsigned workers, size_t maxPending,
+                    const Scheduler::Runner &run, llvm::raw_ostream &report) {
+   if (!llvm::sys::fs::is_directory(dir)) {
+      report << "error: " << dir << " is not a directory\n";
+      return false;
+   }
+   std::mutex reportLock;
+   Scheduler scheduler(workers, maxPending, run, [&](Job &job) {
+      std::string output = job.output + "== exit " + std::to_string(job.status) + "\n";
+      bool written = writeAtomically(job.name + ".out", output);
+      llvm::sys::fs::remove(job.name + ".c.running");
+      llvm::sys::fs::remove(job.name + ".in");
+      if (!written) {
+         std::lock_guard<std::mutex> lock(reportLock);
+         report << "error: cannot write " << job.name << ".out\n";
+      }
+   });
+
+   // no SA_RESTART, so that the sleep between scans ends at once
+   struct sigaction action = {};
+   action.sa_handler = requestStop;
+   struct sigaction oldInt, oldTerm;
+   sigaction(SIGINT, &action, &oldInt);
+   sigaction(SIGTERM, &action, &oldTerm);
+   Stop = 0;
+
+   bool ok = true;
+   while (!Stop) {
+      bool found = false;
+      std::error_code ec;
+      for (llvm::sys::fs::directory_iterator it(dir, ec), end; it != end && !ec && !Stop; it.increment(ec)) {
+         llvm::StringRef path = it->path();
+         if (!path.endswith(".c"))
+            continue;
+         // claimed by renaming, so the next scan skips it
+         std::string name = path.drop_back(2).str();
+         if (llvm::sys::fs::rename(path, name + ".c.running"))
+            continue;
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> code = llvm::MemoryBuffer::getFile(name + ".c.running");
+         if (!code)
+            continue;
+         std::unique_ptr<Job> job(new Job);
+         job->name = name;
+         job->code = (*code)->getBuffer().str();
+         if (llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> input = llvm::MemoryBuffer::getFile(name + ".in"))
+            job->input = (*input)->getBuffer().str();
+         scheduler.submit(std::move(job));
+         found = true;
+      }
+      if (ec) {
+         std::lock_guard<std::mutex> lock(reportLock);
+         report << "error: " << dir << ": " << ec.message() << "\n";
+         ok = false;
+         break;
+      }
+      if (!found)
+         usleep(10000);
+   }
+   sigaction(SIGINT, &oldInt, nullptr);
+   sigaction(SIGTERM, &oldTerm, nullptr);
+   scheduler.finish();
+   scheduler.report(report);
+   return ok;
+}
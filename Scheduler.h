@@ -0,0 +1,98 @@
+//==--- Scheduler.h - Many programs on worker threads ----------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_SCHEDULER_H
+#define AST_INTERPRETER_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+class raw_ostream;
+}
+
+/// One program to interpret, with what GET reads and what PRINT wrote
+struct Job {
+   std::string name;
+   std::string code;
+   std::string input;
+   std::chrono::steady_clock::time_point submitted;
+
+   std::string output;
+   int status = 0;
+};
+
+/// Runs independent programs on one worker thread per core. Each worker has
+/// a deque of jobs; submit deals jobs out round robin, a worker takes the
+/// oldest job of its own deque and, when that is empty, steals the newest
+/// of another. At most maxPending jobs wait in the deques, submit blocks
+/// beyond that, so a producer cannot outrun the workers.
+class Scheduler {
+public:
+   /// Runs a job on a worker thread
+   typedef std::function<void(Job &)> Runner;
+
+   /// workers 0 means one per core; done is called on the worker after run
+   Scheduler(unsigned workers, size_t maxPending, Runner run, Runner done);
+   ~Scheduler();
+
+   void submit(std::unique_ptr<Job> job);
+   /// Wait for the submitted jobs and stop the workers
+   void finish();
+
+   /// Jobs done, the time since the scheduler started and the latency from
+   /// submit to done, in milliseconds
+   void report(llvm::raw_ostream &os);
+
+private:
+   struct Worker {
+      std::mutex lock;
+      std::deque<std::unique_ptr<Job>> jobs;
+      std::thread thread;
+   };
+
+   void work(unsigned self);
+   std::unique_ptr<Job> take(unsigned self);
+
+   Runner mRun;
+   Runner mDone;
+   size_t mMaxPending;
+   std::vector<std::unique_ptr<Worker>> mWorkers;
+   size_t mNext = 0;
+
+   /// Guards the counters below; taken before a deque's lock, never after
+   std::mutex mLock;
+   std::condition_variable mWork;
+   std::condition_variable mSpace;
+   /// Jobs in the deques that no worker claimed yet
+   size_t mQueued = 0;
+   bool mStopping = false;
+   std::chrono::steady_clock::time_point mStart;
+   std::chrono::steady_clock::time_point mEnd;
+   std::vector<double> mLatencies;
+};
+
+/// --throughput: runs every input once on a scheduler, reports "== <input>:
+/// exit <status>" and the output of each as it finishes, then the
+/// throughput and latencies. False when an input could not be read or did
+/// not exit with 0.
+bool runThroughput(const std::vector<std::string> &inputs, unsigned workers, size_t maxPending,
+                   const Scheduler::Runner &run, llvm::raw_ostream &report);
+
+/// --serve: runs every <name>.c that shows up in dir, with <name>.in as its
+/// input when there is one. Submitters write the input first and the job
+/// under another name, then rename the job into place. The result goes to
+/// <name>.out the same way, PRINT's output followed by "== exit <status>",
+/// and the job's files are removed.
+/// Returns after SIGINT or SIGTERM once the claimed jobs are done, with the
+/// statistics on report; false when dir cannot be read.
+bool serveDirectory(const std::string &dir, unsigned workers, size_t maxPending,
+                    const Scheduler::Runner &run, llvm::raw_ostream &report);
+
+#endif
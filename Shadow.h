@@ -0,0 +1,130 @@
+//==--- Shadow.h - Shadow memory for checked guest accesses ----------------===//
+//===----------------------------------------------------------------------===//
+// With --sanitize every object the guest can reach is described by one shadow
+// byte per 8-byte granule: MALLOC blocks, local arrays and address-taken
+// locals, each with redzones around it. Loads and stores look up their
+// granules before touching host memory, so an overflow, a use after FREE or a
+// wild pointer stops the program instead of corrupting the interpreter.
+
+#ifndef AST_INTERPRETER_SHADOW_H
+#define AST_INTERPRETER_SHADOW_H
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+
+#include "llvm/ADT/DenseMap.h"
+
+class Shadow {
+public:
+	/// Shadow byte values. 1 to 7 mean only that many leading bytes of the
+	/// granule are addressable, which happens at the end of an object.
+	enum State : uint8_t {
+		Addressable = 0,
+		StackRedzone = 0xf2,
+		StackDead = 0xf5,
+		GlobalRedzone = 0xf9,
+		HeapRedzone = 0xfa,
+		HeapFreed = 0xfd,
+		/// Memory no guest object was ever placed in
+		Unknown = 0xff
+	};
+	static const int64_t Granule = 8;
+	/// Bytes left poisoned on both sides of every object
+	static const int64_t Redzone = 16;
+
+	/// Whether all of [addr, addr + size) is addressable. size is at most
+	/// 8 on the fast path, where only the first and last byte are looked
+	/// up: partial granules only end objects, so the bytes between cannot
+	/// be poisoned when both ends are not.
+	bool check(int64_t addr, int64_t size) {
+		uint64_t first = addr, last = addr + size - 1;
+		if (size > Granule || (first >> PageBits) != (last >> PageBits))
+			return state(addr, size) == Addressable;
+		const uint8_t * page = lookup(first >> PageBits);
+		return page && addressable(page, first) && addressable(page, last);
+	}
+
+	/// What the first bad byte of [addr, addr + size) belongs to, or
+	/// Addressable
+	uint8_t state(int64_t addr, int64_t size) {
+		for (uint64_t a = addr, end = addr + size; a < end; ++a) {
+			const uint8_t * page = lookup(a >> PageBits);
+			if (!page)
+				return Unknown;
+			if (addressable(page, a))
+				continue;
+			uint8_t s = page[(a & PageMask) / Granule];
+			// past the end of an object: the redzone after it tells which
+			if (s < Granule)
+				return state((a | (Granule - 1)) + 1, 1);
+			return s;
+		}
+		return Addressable;
+	}
+
+	static const char * describe(uint8_t state) {
+		switch (state) {
+		case StackRedzone: return "stack buffer overflow";
+		case StackDead: return "use of a returned frame's memory";
+		case GlobalRedzone: return "global buffer overflow";
+		case HeapRedzone: return "heap buffer overflow";
+		case HeapFreed: return "use after FREE";
+		default: return "wild access";
+		}
+	}
+
+	/// Make [addr, addr + size) addressable; addr is granule aligned
+	void unpoison(int64_t addr, int64_t size) {
+		fill(addr, size & ~(Granule - 1), Addressable);
+		if (size & (Granule - 1))
+			fill(addr + (size & ~(Granule - 1)), Granule, (uint8_t)(size & (Granule - 1)));
+	}
+
+	/// Mark the granules covering [addr, addr + size) with state
+	void poison(int64_t addr, int64_t size, State state) {
+		fill(addr, size, state);
+	}
+
+private:
+	/// 64K of guest memory per shadow page, so that a loop over an array
+	/// stays on the cached page
+	static const unsigned PageBits = 16;
+	static const uint64_t PageMask = (1 << PageBits) - 1;
+
+	static bool addressable(const uint8_t * page, uint64_t a) {
+		uint8_t s = page[(a & PageMask) / Granule];
+		return s == Addressable || (s < Granule && (a & (Granule - 1)) < s);
+	}
+
+	const uint8_t * lookup(uint64_t page) {
+		if (page == mLastPage)
+			return mLast;
+		llvm::DenseMap<uint64_t, std::unique_ptr<uint8_t[]>>::iterator it = mPages.find(page);
+		if (it == mPages.end())
+			return nullptr;
+		mLastPage = page;
+		mLast = it->second.get();
+		return mLast;
+	}
+
+	void fill(int64_t addr, int64_t size, uint8_t value) {
+		for (uint64_t a = addr & ~(Granule - 1), end = addr + size; a < end; ) {
+			uint64_t page = a >> PageBits;
+			std::unique_ptr<uint8_t[]> &shadow = mPages[page];
+			if (!shadow) {
+				shadow.reset(new uint8_t[(PageMask + 1) / Granule]);
+				memset(shadow.get(), Unknown, (PageMask + 1) / Granule);
+			}
+			uint64_t stop = std::min<uint64_t>(end, (page + 1) << PageBits);
+			memset(shadow.get() + (a & PageMask) / Granule, value, (stop - a + Granule - 1) / Granule);
+			a = (stop + Granule - 1) & ~(Granule - 1);
+		}
+	}
+
+	llvm::DenseMap<uint64_t, std::unique_ptr<uint8_t[]>> mPages;
+	uint64_t mLastPage = UINT64_MAX;
+	const uint8_t * mLast = nullptr;
+};
+
+#endif
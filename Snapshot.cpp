@@ -0,0 +1,214 @@
+//==--- Snapshot.cpp - Guest state saved between processes -----------------===//
+//===----------------------------------------------------------------------===//
+#include "Environment.h"
+#include "Snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+
+const char Magic[8] = {'A', 'S', 'T', 'S', 'N', 'A', 'P', '3'};
+
+struct Header {
+	char magic[8];
+	uint64_t arenaBase;
+	uint64_t arenaUsed;
+	/// Where the arena bytes start in the file, page aligned
+	uint64_t arenaOffset;
+	/// Blocks of a --sanitize heap sit between redzones
+	uint64_t redzone;
+	/// (address, size) pairs of live blocks, then (block, bytes) pairs of
+	/// free ones, then (address, size, name length, name, bytes) records of
+	/// globals
+	uint64_t blocks;
+	uint64_t freeBlocks;
+	uint64_t globals;
+};
+
+void write64(llvm::raw_ostream &os, uint64_t val) {
+	os.write((const char *)&val, sizeof(val));
+}
+
+/// Reads the records after the header, failing past end
+class Reader {
+	const char * mPos;
+	const char * mEnd;
+public:
+	Reader(const char * begin, const char * end) : mPos(begin), mEnd(end) {}
+
+	bool read64(uint64_t &val) {
+		if (mEnd - mPos < (ptrdiff_t)sizeof(val))
+			return false;
+		memcpy(&val, mPos, sizeof(val));
+		mPos += sizeof(val);
+		return true;
+	}
+	bool readString(uint64_t size, std::string &val) {
+		if ((uint64_t)(mEnd - mPos) < size)
+			return false;
+		val.assign(mPos, size);
+		mPos += size;
+		return true;
+	}
+};
+
+} // namespace
+
+bool saveSnapshot(Environment &env, const std::string &path, std::string &error) {
+	Heap &heap = env.heap();
+	if (!heap.arena()) {
+		error = "the heap is not in arena mode";
+		return false;
+	}
+	std::map<std::string, SavedGlobal> globals = env.saveGlobals();
+	uint64_t freeBlocks = 0;
+	for (const std::pair<const int64_t, std::vector<int64_t>> &size : heap.freeBlocks())
+		freeBlocks += size.second.size();
+
+	std::error_code ec;
+	llvm::raw_fd_ostream os(path, ec);
+	if (ec) {
+		error = path + ": " + ec.message();
+		return false;
+	}
+	Header header;
+	memcpy(header.magic, Magic, sizeof(Magic));
+	header.arenaBase = (uint64_t)heap.arena();
+	header.arenaUsed = heap.arenaUsed();
+	header.arenaOffset = 0;
+	header.redzone = heap.redzone();
+	header.blocks = heap.blocks().size();
+	header.freeBlocks = freeBlocks;
+	header.globals = globals.size();
+
+	std::string tables;
+	llvm::raw_string_ostream ts(tables);
+	for (const std::pair<const int64_t, int64_t> &block : heap.blocks()) {
+		write64(ts, block.first);
+		write64(ts, block.second);
+	}
+	for (const std::pair<const int64_t, std::vector<int64_t>> &size : heap.freeBlocks()) {
+		for (int64_t block : size.second) {
+			write64(ts, block);
+			write64(ts, size.first);
+		}
+	}
+	for (const std::pair<const std::string, SavedGlobal> &global : globals) {
+		write64(ts, global.second.addr);
+		write64(ts, global.second.bytes.size());
+		write64(ts, global.first.size());
+		ts << global.first << global.second.bytes;
+	}
+	ts.flush();
+
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	header.arenaOffset = llvm::alignTo(sizeof(header) + tables.size(), page);
+	os.write((const char *)&header, sizeof(header));
+	os << tables;
+	os.write_zeros(header.arenaOffset - sizeof(header) - tables.size());
+	os.write(heap.arena(), heap.arenaUsed());
+	os.close();
+	if (os.has_error()) {
+		error = path + ": " + os.error().message();
+		os.clear_error();
+		return false;
+	}
+	return true;
+}
+
+bool loadSnapshot(Environment &env, const std::string &path, std::string &error) {
+	Heap &heap = env.heap();
+	if (!heap.arena() || heap.arenaUsed() || !heap.blocks().empty()) {
+		error = "the heap is not an empty arena";
+		return false;
+	}
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		error = path + ": " + strerror(errno);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+		close(fd);
+		error = path + ": not a snapshot";
+		return false;
+	}
+	// the tables are read through a mapping too; only the arena stays mapped
+	void * file = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (file == MAP_FAILED) {
+		close(fd);
+		error = path + ": " + strerror(errno);
+		return false;
+	}
+	Header header;
+	memcpy(&header, file, sizeof(header));
+	const char * begin = (const char *)file;
+	bool ok = !memcmp(header.magic, Magic, sizeof(Magic)) &&
+		header.arenaOffset + header.arenaUsed <= (uint64_t)st.st_size &&
+		header.arenaUsed <= (uint64_t)Heap::ArenaCapacity;
+	if (ok && header.arenaBase != (uint64_t)heap.arena())
+		error = "snapshot arena at 0x" + llvm::utohexstr(header.arenaBase) + ", not 0x" +
+			llvm::utohexstr((uint64_t)heap.arena());
+	else if (ok && header.redzone != (uint64_t)heap.redzone())
+		error = std::string("snapshot was taken ") + (header.redzone ? "with" : "without") + " --sanitize";
+
+	std::map<int64_t, int64_t> blocks;
+	std::map<int64_t, std::vector<int64_t>> freeBlocks;
+	std::map<std::string, SavedGlobal> globals;
+	Reader reader(begin + sizeof(header), begin + (ok ? header.arenaOffset : sizeof(header)));
+	// the heap hands out and zero-fills what the tables say, so all of it
+	// must lie in the used part of the arena
+	auto inArena = [&header](uint64_t addr, uint64_t size) {
+		return addr >= header.arenaBase && addr - header.arenaBase <= header.arenaUsed &&
+			size <= header.arenaUsed - (addr - header.arenaBase);
+	};
+	for (uint64_t i = 0; ok && i < header.blocks; ++i) {
+		uint64_t addr, size;
+		ok = reader.read64(addr) && reader.read64(size) && inArena(addr, size);
+		blocks[addr] = size;
+	}
+	for (uint64_t i = 0; ok && i < header.freeBlocks; ++i) {
+		uint64_t block, bytes;
+		ok = reader.read64(block) && reader.read64(bytes) && inArena(block, bytes);
+		freeBlocks[bytes].push_back(block);
+	}
+	for (uint64_t i = 0; ok && i < header.globals; ++i) {
+		uint64_t addr, size, length;
+		std::string name;
+		SavedGlobal global;
+		ok = reader.read64(addr) && reader.read64(size) && reader.read64(length) &&
+			reader.readString(length, name) && reader.readString(size, global.bytes);
+		global.addr = addr;
+		globals[name] = global;
+	}
+	munmap(file, st.st_size);
+	if (!ok && error.empty())
+		error = path + ": not a snapshot";
+	if (!error.empty()) {
+		close(fd);
+		return false;
+	}
+
+	// over the reserved arena, copy-on-write: pages are read in as the
+	// program touches them
+	if (header.arenaUsed) {
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		void * arena = mmap(heap.arena(), llvm::alignTo(header.arenaUsed, page), PROT_READ | PROT_WRITE,
+		                    MAP_PRIVATE | MAP_FIXED, fd, header.arenaOffset);
+		if (arena == MAP_FAILED) {
+			close(fd);
+			error = path + ": " + strerror(errno);
+			return false;
+		}
+	}
+	close(fd);
+	heap.adopt(header.arenaUsed, blocks, freeBlocks);
+	env.restoreGlobals(globals);
+	return true;
+}
@@ -0,0 +1,27 @@
+//==--- Snapshot.h - Guest state saved between processes -------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_SNAPSHOT_H
+#define AST_INTERPRETER_SNAPSHOT_H
+
+#include <string>
+
+class Environment;
+
+/// A snapshot is the guest state at the end of a run: the globals by name,
+/// like the REPL carries them over, and the heap. The heap must be in arena
+/// mode (Heap::useArena) so that its image maps back at the same address,
+/// copy-on-write, and pointers to blocks stay valid. The globals land in
+/// the loading program's data segment; pointers to them, in globals and
+/// blocks, are relocated there (Environment::restoreGlobals). Pointers to
+/// globals the loading program does not have dangle.
+///
+/// The file is a header, the block tables and the globals, then the arena
+/// bytes at a page-aligned offset.
+
+/// Write env's globals and heap to path
+bool saveSnapshot(Environment &env, const std::string &path, std::string &error);
+/// Map the heap image of path into env's empty arena and set the globals the
+/// current program declares with the same names
+bool loadSnapshot(Environment &env, const std::string &path, std::string &error);
+
+#endif
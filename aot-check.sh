@@ -0,0 +1,29 @@
+#!/bin/bash
+# Compile every test program with --aot and check that the executable prints
+# exactly the PRINT lines the interpreter prints. Needs a build with
+# ENABLE_NATIVE. The summary is also appended to aot_check_output.txt.
+out=$(mktemp)
+status=0
+checked=0
+failed=0
+for f in ./classtest/test*.c ./test/test*.c;
+do
+checked=$((checked + 1))
+if ! ./ast-interpreter --aot "$out" "$f"; then
+   echo "FAIL (compile) $f"
+   status=1
+   failed=$((failed + 1))
+   continue
+fi
+expected=$(./ast-interpreter "$f" </dev/null 2>/dev/null | grep -a "^	output : ")
+actual=$("$out" </dev/null)
+if [ "$expected" != "$actual" ]; then
+   echo "FAIL $f"
+   diff <(echo "$expected") <(echo "$actual")
+   status=1
+   failed=$((failed + 1))
+fi
+done
+rm -f "$out"
+echo "aot-check: $checked programs, $failed failed" | tee -a aot_check_output.txt
+exit $status
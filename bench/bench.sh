@@ -0,0 +1,18 @@
+#!/bin/bash
+# Run every bench/*.c walked and prepared and print the execution time the
+# interpreter reports in --stats. Results are also appended to bench_output.txt.
+#   ./bench/bench.sh [path/to/ast-interpreter] [more options for every run]
+BIN=${1:-./ast-interpreter}
+shift
+STATS=$(mktemp)
+for f in bench/*.c; do
+   for mode in walk prepared; do
+      opts="$@"
+      [ $mode = walk ] && opts="--walk $opts"
+      : > $STATS
+      $BIN $opts --stats=json --stats-file=$STATS $f > /dev/null 2>&1
+      ms=$(sed -n 's/.*"exec_ms":\([0-9.e+-]*\).*/\1/p' $STATS)
+      printf "%-12s %-9s %12s ms\n" $(basename $f .c) $mode "$ms" | tee -a bench_output.txt
+   done
+done
+rm -f $STATS
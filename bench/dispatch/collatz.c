@@ -0,0 +1,22 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int n;
+   int x;
+   int steps = 0;
+   for (n = 1; n < 100000; n = n + 1) {
+      x = n;
+      while (x != 1) {
+         if (x - x / 2 * 2 == 0)
+            x = x / 2;
+         else
+            x = 3 * x + 1;
+         steps = steps + 1;
+      }
+   }
+   PRINT(steps);
+   return 0;
+}
@@ -0,0 +1,13 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int i;
+   int sum = 0;
+   for (i = 0; i < 30000000; i = i + 1)
+      sum = sum + i * 3 - 7 - i;
+   PRINT(sum);
+   return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Build the interpreter once per dispatch mode (INTERP_DISPATCH) and run the
+# loop-heavy programs next to this script with each. Prints the execution time
+# from --stats and, where perf is installed, branches and branch misses of the
+# whole process.
+#   LLVM_DIR=/usr/lib/llvm-14 ./bench/dispatch/dispatch.sh
+cd "$(dirname "$0")/../.."
+for mode in threaded switch; do
+   cmake -S . -B _bench_$mode -DCMAKE_BUILD_TYPE=Release -DINTERP_DISPATCH=$mode \
+      ${LLVM_DIR:+-DLLVM_DIR=$LLVM_DIR} > /dev/null &&
+   cmake --build _bench_$mode -j"$(nproc)" > /dev/null || exit 1
+done
+STATS=$(mktemp)
+for f in bench/dispatch/*.c; do
+   for mode in threaded switch; do
+      : > $STATS
+      cmd="./_bench_$mode/ast-interpreter --stats=json --stats-file=$STATS $f"
+      misses=""
+      if command -v perf > /dev/null; then
+         misses=$(perf stat -x, -e branches,branch-misses $cmd 2>&1 > /dev/null |
+            awk -F, '/branch/ { printf "%s %s  ", $1, $3 }')
+      else
+         $cmd > /dev/null 2>&1
+      fi
+      ms=$(sed -n 's/.*"exec_ms":\([0-9.e+-]*\).*/\1/p' $STATS)
+      printf "%-10s %-9s %10s ms  %s\n" $(basename $f .c) $mode "$ms" "$misses" | tee -a bench_output.txt
+   done
+done
+rm -f $STATS
@@ -0,0 +1,17 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int fib(int n) {
+   int c;
+   if (n < 2)
+      return n;
+   c = fib(n - 1) + fib(n - 2);
+   return c;
+}
+
+int main() {
+   PRINT(fib(20));
+   return 0;
+}
@@ -0,0 +1,19 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int i;
+   int j;
+   int sum = 0;
+   for (i = 0; i < 300; i = i + 1) {
+      j = 0;
+      while (j < 300) {
+         sum = sum + (i * j) / 7 - j;
+         j = j + 1;
+      }
+   }
+   PRINT(sum);
+   return 0;
+}
@@ -0,0 +1,25 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int *a;
+   int *p;
+   int i;
+   int n = 2000;
+   int sum = 0;
+   a = (int *)MALLOC(sizeof(int) * n);
+   for (i = 0; i < n; i = i + 1)
+      *(a + i) = i;
+   for (i = 0; i < 50; i = i + 1) {
+      p = a;
+      while (p < a + n) {
+         sum = sum + *p - 1000;
+         p = p + 1;
+      }
+   }
+   FREE(a);
+   PRINT(sum);
+   return 0;
+}
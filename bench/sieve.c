@@ -0,0 +1,23 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int flags[4000];
+   int i;
+   int j;
+   int count = 0;
+   for (i = 2; i < 4000; i = i + 1) {
+      if (flags[i] == 0) {
+         count = count + 1;
+         j = i + i;
+         while (j < 4000) {
+            flags[j] = 1;
+            j = j + i;
+         }
+      }
+   }
+   PRINT(count);
+   return 0;
+}
@@ -0,0 +1,136 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+/* A guest bytecode machine: a dense switch on the opcode per step, then a
+   sparse one on the characters of an expression, state by state. */
+
+int code[32];
+int stack[16];
+
+int run(int n) {
+   int pc = 0;
+   int sp = 0;
+   int acc = 0;
+   int steps = 0;
+   while (1) {
+      steps++;
+      switch (code[pc++]) {
+      case 0: /* push imm */
+         stack[sp++] = code[pc++];
+         break;
+      case 1: /* add */
+         sp--;
+         stack[sp - 1] += stack[sp];
+         break;
+      case 2: /* sub */
+         sp--;
+         stack[sp - 1] -= stack[sp];
+         break;
+      case 3: /* mul */
+         sp--;
+         stack[sp - 1] *= stack[sp];
+         break;
+      case 4: /* acc += pop */
+         acc += stack[--sp];
+         break;
+      case 5: /* dup */
+         stack[sp] = stack[sp - 1];
+         sp++;
+         break;
+      case 6: /* jump to imm if top != 0 */
+         if (stack[--sp] != 0) {
+            pc = code[pc];
+            continue;
+         }
+         pc++;
+         break;
+      case 7: /* push n */
+         stack[sp++] = n;
+         break;
+      case 8: /* halt */
+         return acc % 1000 + steps % 7;
+      default:
+         return -1;
+      }
+   }
+}
+
+char text[64];
+
+int scan() {
+   int i;
+   int state = 0;
+   int tokens = 0;
+   for (i = 0; text[i] != 0; i++) {
+      switch (text[i]) {
+      case ' ':
+         state = 0;
+         break;
+      case '+':
+      case '-':
+      case '*':
+      case '/':
+      case '(':
+      case ')':
+         tokens++;
+         state = 0;
+         break;
+      case 'x':
+      case 'y':
+      case 'z':
+         if (state != 1)
+            tokens++;
+         state = 1;
+         break;
+      default:
+         if (state != 2)
+            tokens++;
+         state = 2;
+      }
+   }
+   return tokens;
+}
+
+int main() {
+   int i;
+   int sum = 0;
+   int k = 0;
+   /* acc += n * i for i = n .. 1 */
+   code[k++] = 7;
+   code[k++] = 5;  /* 1: loop with i on the stack */
+   code[k++] = 7;
+   code[k++] = 3;
+   code[k++] = 4;
+   code[k++] = 0;
+   code[k++] = 1;
+   code[k++] = 2;
+   code[k++] = 5;
+   code[k++] = 6;
+   code[k++] = 1;
+   code[k++] = 8;
+   for (i = 0; i < 300; i++)
+      sum += run(i % 50 + 1);
+   PRINT(sum);
+
+   k = 0;
+   text[k++] = '(';
+   text[k++] = 'x';
+   text[k++] = ' ';
+   text[k++] = '+';
+   text[k++] = ' ';
+   text[k++] = '1';
+   text[k++] = '2';
+   text[k++] = ')';
+   text[k++] = '*';
+   text[k++] = 'y';
+   text[k++] = 'z';
+   text[k++] = '-';
+   text[k++] = '7';
+   sum = 0;
+   for (i = 0; i < 3000; i++)
+      sum += scan();
+   PRINT(sum);
+   return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Interpret every test program ROUNDS times, once with one process per
+# program as test.sh does, once on the worker threads of --throughput, and
+# print the wall time of both. --throughput also reports its p50/p99 latency.
+#   ./bench/throughput.sh [path/to/ast-interpreter] [rounds] [more options]
+BIN=${1:-./ast-interpreter}
+ROUNDS=${2:-10}
+shift $(( $# < 2 ? $# : 2 ))
+programs=()
+for ((r = 0; r < ROUNDS; r++)); do
+   programs+=(./classtest/test*.c ./test/test*.c)
+done
+
+start=$(date +%s.%N)
+for f in "${programs[@]}"; do
+   $BIN "$@" $f < /dev/null > /dev/null 2>&1
+done
+end=$(date +%s.%N)
+printf "%-12s %5d programs %10.3f s\n" processes ${#programs[@]} $(echo "$end - $start" | bc) | tee -a bench_output.txt
+
+start=$(date +%s.%N)
+$BIN "$@" --throughput "${programs[@]}" < /dev/null 2> /dev/null | tail -n 1 | tee -a bench_output.txt
+end=$(date +%s.%N)
+printf "%-12s %5d programs %10.3f s\n" throughput ${#programs[@]} $(echo "$end - $start" | bc) | tee -a bench_output.txt
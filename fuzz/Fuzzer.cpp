@@ -0,0 +1,390 @@
+//==--- fuzz/Fuzzer.cpp - Differential fuzzing against native code ---------===//
+//===----------------------------------------------------------------------===//
+// A libFuzzer target. Each input becomes a guest program: inputs starting
+// with "extern" are taken as program text (seed the corpus with classtest/),
+// anything else drives a generator for the README grammar that only writes
+// programs with one meaning in C++: every variable is initialized, loops run
+// a bounded counter, division is by positive literals, indexes are in bounds
+// and GET and calls only appear where their order cannot matter.
+//
+// The program is interpreted in-process, walked and prepared, and compiled
+// with the host compiler against runtime/runtime.cpp, which stubs the
+// builtins. When all of them run to the end, their PRINT output has to match;
+// otherwise the program is printed and the target aborts. -fwrapv gives the
+// native side the interpreter's wrapping int arithmetic.
+//
+// Besides the compiler's own edge coverage of the interpreter, every
+// statement walked and every kernel run bumps libFuzzer's extra counters,
+// see Environment::cover.
+//
+//   cmake -DENABLE_FUZZ=ON -DCMAKE_CXX_COMPILER=clang++ ...
+//   ./ast-fuzzer -close_fd_mask=2 corpus/ ../classtest
+#include "../Fuzz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fuzzer/FuzzedDataProvider.h>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#ifndef AST_FUZZ_CXX
+#define AST_FUZZ_CXX "c++"
+#endif
+#ifndef AST_FUZZ_RUNTIME
+#define AST_FUZZ_RUNTIME "runtime/runtime.cpp"
+#endif
+
+namespace {
+
+__attribute__((used, section("__libfuzzer_extra_counters")))
+uint8_t Counters[1 << 16];
+
+/// The compiler and the runtime object, built once
+std::string Compiler;
+std::string RuntimeObject;
+
+/// Writes guest programs in the README grammar from fuzzer bytes. A choice
+/// of 0, which is what an exhausted input yields, always ends the current
+/// block, so every input makes a finite program.
+class ProgramGenerator {
+public:
+   explicit ProgramGenerator(FuzzedDataProvider &data) : mData(data) {}
+
+   std::string generate() {
+      mOut = "extern int GET();\nextern void * MALLOC(int);\n"
+             "extern void FREE(void *);\nextern void PRINT(int);\n";
+      mScopes.emplace_back();
+      for (unsigned i = 0, n = choose(3); i < n; ++i) {
+         std::string name = fresh("g");
+         mOut += "int " + name + " = " + literal() + ";\n";
+         mScopes.back().push_back(Var{name, Var::Scalar, 0, true});
+      }
+      for (unsigned i = 0, n = choose(4); i < n; ++i)
+         function(fresh("f"), 1 + choose(3));
+      function("main", 0);
+      return mOut;
+   }
+
+   /// The numbers GET reads
+   std::string input() {
+      std::string in;
+      for (unsigned i = 0; i < 8; ++i)
+         in += std::to_string(mData.ConsumeIntegralInRange<int>(-100, 100)) + "\n";
+      return in;
+   }
+
+private:
+   struct Var {
+      std::string name;
+      enum Kind { Scalar, Array, Block } kind;
+      /// Elements of an array or a MALLOC'ed block
+      unsigned size;
+      /// Loop counters are only read in their loop
+      bool assignable;
+   };
+
+   struct Function {
+      std::string name;
+      unsigned params;
+   };
+
+   unsigned choose(unsigned n) {
+      return mData.ConsumeIntegralInRange<unsigned>(0, n);
+   }
+
+   std::string fresh(const char * prefix) {
+      return prefix + std::to_string(mNames++);
+   }
+
+   std::string indent() {
+      return std::string(mDepth * 3, ' ');
+   }
+
+   std::string literal() {
+      int64_t val = mData.ConsumeBool() ? mData.ConsumeIntegralInRange<int>(-10, 10)
+                                        : mData.ConsumeIntegralInRange<int>(-2147483647, 2147483647);
+      return val < 0 ? "(" + std::to_string(val) + ")" : std::to_string(val);
+   }
+
+   std::vector<const Var *> visible(Var::Kind kind, bool assignable) {
+      std::vector<const Var *> vars;
+      for (const std::vector<Var> &scope : mScopes)
+         for (const Var &var : scope)
+            if (var.kind == kind && (var.assignable || !assignable))
+               vars.push_back(&var);
+      return vars;
+   }
+
+   /// An element of an array or a block, by literal index
+   std::string element(bool assignable) {
+      std::vector<const Var *> vars = visible(Var::Array, assignable);
+      std::vector<const Var *> blocks = visible(Var::Block, assignable);
+      vars.insert(vars.end(), blocks.begin(), blocks.end());
+      if (vars.empty())
+         return "";
+      const Var * var = vars[choose(vars.size() - 1)];
+      std::string index = std::to_string(choose(var->size - 1));
+      if (var->kind == Var::Block && mData.ConsumeBool())
+         return "*(" + var->name + " + " + index + ")";
+      return var->name + "[" + index + "]";
+   }
+
+   /// An expression without side effects
+   std::string expr(unsigned depth) {
+      switch (depth ? choose(7) : choose(2)) {
+      default:
+         return literal();
+      case 1:
+      case 2: {
+         std::vector<const Var *> vars = visible(Var::Scalar, false);
+         if (vars.empty())
+            return literal();
+         return vars[choose(vars.size() - 1)]->name;
+      }
+      case 3: {
+         static const char * const ops[] = {"+", "-", "*", "<", ">", "=="};
+         return "(" + expr(depth - 1) + " " + ops[choose(5)] + " " + expr(depth - 1) + ")";
+      }
+      case 4:
+         return "(" + expr(depth - 1) + " / " + std::to_string(1 + choose(8)) + ")";
+      case 5:
+         return "(-" + expr(depth - 1) + ")";
+      case 6: {
+         std::string elem = element(false);
+         return elem.empty() ? literal() : elem;
+      }
+      case 7:
+         return "((int)(char)" + expr(depth - 1) + ")";
+      }
+   }
+
+   void assign() {
+      std::vector<const Var *> vars = visible(Var::Scalar, true);
+      std::string target = mData.ConsumeBool() ? element(true) : "";
+      if (target.empty() && !vars.empty())
+         target = vars[choose(vars.size() - 1)]->name;
+      if (target.empty())
+         return;
+      std::string value;
+      unsigned what = choose(5);
+      if (what == 1)
+         value = "GET()";
+      else if (what == 2 && !mFunctions.empty()) {
+         const Function &callee = mFunctions[choose(mFunctions.size() - 1)];
+         value = callee.name + "(";
+         for (unsigned i = 0; i < callee.params; ++i)
+            value += (i ? ", " : "") + expr(2);
+         value += ")";
+      } else {
+         value = expr(3);
+      }
+      mOut += indent() + target + " = " + value + ";\n";
+   }
+
+   void block(unsigned nesting) {
+      ++mDepth;
+      mScopes.emplace_back();
+      for (unsigned budget = 12; budget; --budget) {
+         unsigned what = choose(9);
+         if (what == 0)
+            break;
+         statement(what, nesting);
+      }
+      for (const Var &var : mScopes.back())
+         if (var.kind == Var::Block)
+            mOut += indent() + "FREE(" + var.name + ");\n";
+      mScopes.pop_back();
+      --mDepth;
+   }
+
+   void statement(unsigned what, unsigned nesting) {
+      switch (what) {
+      case 1: {
+         std::string name = fresh("v");
+         mOut += indent() + "int " + name + " = " + expr(3) + ";\n";
+         mScopes.back().push_back(Var{name, Var::Scalar, 0, true});
+         break;
+      }
+      case 2:
+      case 3:
+         assign();
+         break;
+      case 4:
+         mOut += indent() + "PRINT(" + expr(3) + ");\n";
+         break;
+      case 5: {
+         std::string name = fresh("a");
+         unsigned size = 1 + choose(3);
+         mOut += indent() + "int " + name + "[" + std::to_string(size) + "];\n";
+         for (unsigned i = 0; i < size; ++i)
+            mOut += indent() + name + "[" + std::to_string(i) + "] = " + expr(2) + ";\n";
+         mScopes.back().push_back(Var{name, Var::Array, size, true});
+         break;
+      }
+      case 6: {
+         // MALLOC hands out zeroed memory on both sides
+         std::string name = fresh("p");
+         unsigned size = 1 + choose(3);
+         mOut += indent() + "int * " + name + " = (int *)MALLOC(" + std::to_string(size * 4) + ");\n";
+         mScopes.back().push_back(Var{name, Var::Block, size, true});
+         break;
+      }
+      case 7:
+         if (nesting >= 3)
+            break;
+         mOut += indent() + "if (" + expr(3) + ") {\n";
+         block(nesting + 1);
+         if (mData.ConsumeBool()) {
+            mOut += indent() + "} else {\n";
+            block(nesting + 1);
+         }
+         mOut += indent() + "}\n";
+         break;
+      case 8:
+      case 9: {
+         if (nesting >= 3)
+            break;
+         std::string counter = fresh("c");
+         std::string trips = std::to_string(choose(8));
+         if (what == 8) {
+            mOut += indent() + "int " + counter + " = 0;\n";
+            mOut += indent() + "while (" + counter + " < " + trips + ") {\n";
+         } else {
+            mOut += indent() + "int " + counter + ";\n";
+            mOut += indent() + "for (" + counter + " = 0; " + counter + " < " + trips + "; " +
+                    counter + " = " + counter + " + 1) {\n";
+         }
+         mScopes.back().push_back(Var{counter, Var::Scalar, 0, false});
+         block(nesting + 1);
+         if (what == 8)
+            mOut += indent() + "   " + counter + " = " + counter + " + 1;\n";
+         mOut += indent() + "}\n";
+         break;
+      }
+      }
+   }
+
+   /// Defines a function that can call the ones before it
+   void function(const std::string &name, unsigned params) {
+      mOut += "int " + name + "(";
+      mScopes.emplace_back();
+      for (unsigned i = 0; i < params; ++i) {
+         std::string param = fresh("x");
+         mOut += (i ? ", int " : "int ") + param;
+         mScopes.back().push_back(Var{param, Var::Scalar, 0, true});
+      }
+      mOut += ") {\n";
+      block(0);
+      mOut += "   return " + (name == "main" ? std::string("0") : expr(3)) + ";\n}\n";
+      mScopes.pop_back();
+      mFunctions.push_back(Function{name, params});
+   }
+
+   FuzzedDataProvider &mData;
+   std::string mOut;
+   std::vector<std::vector<Var>> mScopes;
+   std::vector<Function> mFunctions;
+   unsigned mNames = 0;
+   unsigned mDepth = 0;
+};
+
+/// Compiles code against the runtime and runs it; false when it did not
+/// compile or did not exit with 0 within the time limit
+bool runNative(const std::string &code, const std::string &input, std::string &output) {
+   llvm::SmallString<128> source, in, out, exe;
+   llvm::sys::fs::createTemporaryFile("ast-fuzz", "cc", source);
+   llvm::sys::fs::createTemporaryFile("ast-fuzz", "in", in);
+   llvm::sys::fs::createTemporaryFile("ast-fuzz", "out", out);
+   llvm::sys::fs::createTemporaryFile("ast-fuzz", "", exe);
+   bool ran = false;
+   {
+      std::error_code ec;
+      llvm::raw_fd_ostream os(source, ec);
+      os << code;
+      llvm::raw_fd_ostream is(in, ec);
+      is << input;
+   }
+   llvm::StringRef compile[] = {Compiler, "-xc++", "-O1", "-fwrapv", "-w", source,
+                                "-xnone", RuntimeObject, "-o", exe};
+   llvm::Optional<llvm::StringRef> quiet[] = {llvm::None, llvm::StringRef(""), llvm::StringRef("")};
+   if (llvm::sys::ExecuteAndWait(Compiler, compile, llvm::None, quiet) == 0) {
+      llvm::StringRef args[] = {exe};
+      llvm::Optional<llvm::StringRef> redirects[] = {llvm::StringRef(in), llvm::StringRef(out),
+                                                     llvm::StringRef("")};
+      if (llvm::sys::ExecuteAndWait(exe, args, llvm::None, redirects, 10) == 0) {
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> printed = llvm::MemoryBuffer::getFile(out);
+         if (printed) {
+            output = (*printed)->getBuffer().str();
+            ran = true;
+         }
+      }
+   }
+   for (const llvm::SmallString<128> &path : {source, in, out, exe})
+      llvm::sys::fs::remove(path);
+   return ran;
+}
+
+void mismatch(const std::string &code, const std::string &input, const char * engine,
+              const std::string &expected, const std::string &actual) {
+   llvm::errs() << "==== program\n" << code << "==== input\n" << input
+                << "==== native\n" << expected << "==== " << engine << "\n" << actual;
+   abort();
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+   const char * cxx = getenv("AST_FUZZ_CXX");
+   llvm::ErrorOr<std::string> compiler = llvm::sys::findProgramByName(cxx ? cxx : AST_FUZZ_CXX);
+   llvm::SmallString<128> object;
+   if (!compiler || llvm::sys::fs::createTemporaryFile("ast-fuzz-runtime", "o", object)) {
+      fprintf(stderr, "error: no compiler for the native side\n");
+      exit(1);
+   }
+   Compiler = *compiler;
+   RuntimeObject = object.str().str();
+   llvm::StringRef args[] = {Compiler, "-c", "-O1", AST_FUZZ_RUNTIME, "-o", RuntimeObject};
+   std::string message;
+   if (llvm::sys::ExecuteAndWait(Compiler, args, llvm::None, {}, 0, 0, &message) != 0) {
+      fprintf(stderr, "error: cannot compile %s %s\n", AST_FUZZ_RUNTIME, message.c_str());
+      exit(1);
+   }
+   return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+   FuzzRun run;
+   llvm::StringRef text((const char *)data, size);
+   if (text.startswith("extern")) {
+      run.code = text.str();
+      run.input = "1\n2\n3\n4\n5\n6\n7\n8\n";
+   } else {
+      FuzzedDataProvider provider(data, size);
+      ProgramGenerator generator(provider);
+      run.code = generator.generate();
+      run.input = generator.input();
+   }
+   run.coverage = Counters;
+   run.coverageSize = sizeof(Counters);
+
+   interpretProgram(run);
+   if (!run.finished)
+      return 0;
+   std::string prepared = run.output;
+   run.walk = true;
+   interpretProgram(run);
+   bool walked = run.finished;
+
+   std::string native;
+   if (!runNative(run.code, run.input, native))
+      return 0;
+   if (prepared != native)
+      mismatch(run.code, run.input, "prepared", native, prepared);
+   if (walked && run.output != native)
+      mismatch(run.code, run.input, "walked", native, run.output);
+   return 0;
+}
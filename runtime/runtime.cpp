@@ -0,0 +1,33 @@
+//==--- runtime/runtime.cpp - builtins of --aot executables ----------------===//
+//===----------------------------------------------------------------------===//
+// Programs compiled with --aot call these instead of the interpreter's
+// builtins. The guest declares them without extern "C", so they keep C++
+// linkage here too. PRINT has to print exactly what Environment::output does.
+#include <stdio.h>
+#include <stdlib.h>
+
+int GET() {
+   long long val = 0;
+   if (scanf("%lld", &val) != 1)
+      val = 0;
+   return (int)val;
+}
+
+void PRINT(int val) {
+   printf("\toutput : %d\n", val);
+}
+
+// the interpreter's heap hands out zeroed memory as well
+void * MALLOC(int size) {
+   return calloc(size > 0 ? size : 1, 1);
+}
+
+void FREE(void * addr) {
+   free(addr);
+}
+
+// the interpreter spreads the calls over threads, in no particular order
+void PARALLEL_FOR(int begin, int end, void (*body)(int)) {
+   for (int i = begin; i < end; ++i)
+      body(i);
+}
@@ -1,25 +1,21 @@
-#!/bin/bash      
-for((i=0;i<=9;i++));   
+#!/bin/bash
+for((i=0;i<=9;i++));
 do
-var1=`cat ./classtest/test0$i.c` 
-var2=`cat ./test/test0$i.c`
-echo $i   
-./ast-interpreter "$var1"
+echo $i
+./ast-interpreter ./classtest/test0$i.c
 echo "test"
-./ast-interpreter "$var2"
-done 
+./ast-interpreter ./test/test0$i.c
+done
 
-for((i=10;i<=24;i++));                                                                                
-do                                                                                                  
-var1=`cat ./classtest/test$i.c`
-echo $i                                                                                             
-./ast-interpreter "$var1"                                                                           
+for((i=10;i<=24;i++));
+do
+echo $i
+./ast-interpreter ./classtest/test$i.c
 done
 
-for((i=10;i<=19;i++));
+for((i=10;i<=27;i++));
 do
-var2=`cat ./test/test$i.c`
 echo $i
 echo "test"
-./ast-interpreter "$var2"
-done  
+./ast-interpreter ./test/test$i.c
+done
@@ -0,0 +1,29 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+void swap(int *x, int *y) {
+   int t;
+   t = *x;
+   *x = *y;
+   *y = t;
+}
+
+int bump(int n) {
+   int *p;
+   p = &n;
+   *p = *p + 1;
+   return n;
+}
+
+int main() {
+   int a;
+   int b;
+   a = 1;
+   b = 2;
+   swap(&a, &b);
+   PRINT(a);
+   PRINT(b);
+   PRINT(bump(41));
+}
@@ -0,0 +1,24 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern void PARALLEL_FOR(int, int, void (*)(int));
+
+int *squares;
+
+void square(int i) {
+   squares[i] = i * i;
+}
+
+int main() {
+   int i;
+   int sum;
+   squares = (int *)MALLOC(4000);
+   PARALLEL_FOR(0, 1000, square);
+   sum = 0;
+   for (i = 0; i < 1000; i = i + 1) {
+      sum = sum + squares[i];
+   }
+   PRINT(sum);
+   FREE(squares);
+}
@@ -0,0 +1,35 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int isOdd(int n);
+
+int isEven(int n) {
+   if (n == 0)
+      return 1;
+   return isOdd(n - 1);
+}
+
+int isOdd(int n) {
+   if (n == 0)
+      return 0;
+   return isEven(n - 1);
+}
+
+int fact(int n) {
+   if (n < 2)
+      return 1;
+   return n * fact(n - 1);
+}
+
+int unused(int n) {
+   return unused(n + 1);
+}
+
+int main() {
+   PRINT(isEven(10));
+   PRINT(isOdd(7));
+   PRINT(fact(10));
+   PRINT(fact(5));
+}
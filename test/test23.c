@@ -0,0 +1,31 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int helperA(int n) {
+   return n + 1;
+}
+
+int helperB(int n) {
+   return helperA(n) * 2;
+}
+
+int twice(int n) {
+   if (1)
+      return n * 2;
+   else
+      return helperB(n);
+}
+
+int main() {
+   int a;
+   a = twice(21);
+   if (0) {
+      a = helperB(a);
+   }
+   if (2 - 2)
+      PRINT(0);
+   else
+      PRINT(a);
+}
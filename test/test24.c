@@ -0,0 +1,37 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int primes[5] = {2, 3, 5, 7, 11};
+char tag[4] = {'a', 'b'};
+int counter = 10;
+int *first = primes;
+int table[8];
+
+void bump() {
+   counter = counter + 1;
+}
+
+int sum(int *a, int n) {
+   int i;
+   int s;
+   s = 0;
+   for (i = 0; i < n; i = i + 1)
+      s = s + a[i];
+   return s;
+}
+
+int main() {
+   int i;
+   bump();
+   bump();
+   PRINT(counter);
+   PRINT(sum(primes, 5));
+   PRINT(tag[1]);
+   PRINT(tag[3]);
+   PRINT(*first);
+   for (i = 0; i < 8; i = i + 1)
+      table[i] = i * i;
+   PRINT(sum(table, 8));
+}
@@ -0,0 +1,70 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+struct Point {
+   int x;
+   char tag;
+   long y;
+};
+
+struct Node {
+   int value;
+   struct Node *next;
+};
+
+struct Point origin = {3, 'o', 4};
+int grid[3][4];
+
+int area(struct Point *p) {
+   return p->x * p->y;
+}
+
+int initialized(int k) {
+   struct Point p = {1, 'a', 2};
+   struct Point q = p;
+   int a[3] = {1, 2, k};
+   p.x = k;
+   return p.x * 1000 + q.x * 100 + q.y * 10 + a[2] + (q.tag == 'a') + a[0] - a[1];
+}
+
+int main() {
+   int i;
+   int j;
+   int sum;
+   struct Point pts[2];
+   struct Node *head;
+   struct Node *n;
+
+   for (i = 0; i < 3; i = i + 1)
+      for (j = 0; j < 4; j = j + 1)
+         grid[i][j] = i * 10 + j;
+   PRINT(grid[2][3]);
+   PRINT(grid[1][0] + grid[0][1]);
+
+   pts[1].x = 6;
+   pts[1].y = 7;
+   pts[1].tag = 'p';
+   PRINT(area(&pts[1]));
+   PRINT(pts[1].tag);
+   PRINT(area(&origin));
+   PRINT(origin.tag);
+   PRINT(initialized(5));
+
+   head = 0;
+   for (i = 1; i <= 4; i = i + 1) {
+      n = (struct Node *)MALLOC(sizeof(struct Node));
+      n->value = i;
+      n->next = head;
+      head = n;
+   }
+   sum = 0;
+   while (head != 0) {
+      sum = sum * 10 + head->value;
+      n = head;
+      head = head->next;
+      FREE(n);
+   }
+   PRINT(sum);
+}
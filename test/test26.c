@@ -0,0 +1,95 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int calls;
+int hits[4];
+
+int touch(int v) {
+   calls++;
+   return v;
+}
+
+int main() {
+   int i;
+   int x;
+   int bits;
+   long wide;
+   char c;
+   int a[4];
+   int *p;
+
+   x = 17;
+   PRINT(x % 5);
+   PRINT(-x % 5);
+   PRINT((x & 12) | (x ^ 3));
+   PRINT(~x);
+   PRINT(!x);
+   PRINT(!!x);
+   PRINT(x << 3);
+   PRINT(-x >> 2);
+   wide = 1;
+   PRINT((wide << 40) >> 38);
+
+   x += 3;
+   x -= 1;
+   x *= 4;
+   x /= 3;
+   x %= 7;
+   PRINT(x);
+   bits = 0;
+   bits |= 12;
+   bits &= 10;
+   bits ^= 3;
+   bits <<= 2;
+   bits >>= 1;
+   PRINT(bits);
+
+   c = 126;
+   c++;
+   c++;
+   PRINT(c);
+   c += 1;
+   PRINT(c);
+
+   i = 5;
+   PRINT(i++);
+   PRINT(i);
+   PRINT(++i);
+   PRINT(i--);
+   PRINT(--i);
+
+   for (i = 0; i < 4; i++)
+      a[i] = i * 10;
+   a[2]++;
+   ++a[3];
+   a[1] += a[2];
+   p = a;
+   p++;
+   PRINT(*p);
+   p += 2;
+   PRINT(*p);
+   PRINT(*p--);
+   PRINT(*p);
+   for (i = 0; i < 4; ++i)
+      hits[i] += i;
+   hits[3]--;
+   PRINT(hits[3] + hits[2]);
+   calls++;
+   PRINT(calls);
+
+   calls = 0;
+   if (touch(0) && touch(1))
+      PRINT(1);
+   if (touch(1) || touch(0))
+      PRINT(2);
+   x = touch(1) && touch(0) || touch(3);
+   PRINT(x);
+   PRINT(calls);
+   i = 0;
+   while (i < 10 && a[i % 4] != 20)
+      i++;
+   PRINT(i);
+   return 0;
+}
@@ -0,0 +1,134 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int dense(int op) {
+   int r = 0;
+   switch (op) {
+   case 0:
+      r = 10;
+      break;
+   case 1:
+      r = 11;
+   case 2:
+      r += 2;
+      break;
+   case 4:
+      return 44;
+   default:
+      r = -1;
+   }
+   return r;
+}
+
+int sparse(long key) {
+   switch (key) {
+   case -1000:
+      return 1;
+   case 7:
+   case 70:
+      return 2;
+   case 70000:
+      return 3;
+   case 4000000000:
+      return 4;
+   }
+   return 0;
+}
+
+int skipped(int k) {
+   int r = 0;
+   switch (k) {
+   case 0:
+      r = 1;
+      int a[4];
+      int x;
+      int *p;
+   case 1:
+      p = &x;
+      a[k] = k + 5;
+      *p = a[k] * 2;
+      r += x + a[k];
+      break;
+   }
+   return r;
+}
+
+int main() {
+   int i;
+   int j;
+   int sum;
+   unsigned u;
+
+   for (i = -1; i < 6; i++)
+      PRINT(dense(i));
+   PRINT(skipped(0) + skipped(1) * 100);
+   PRINT(sparse(-1000) + sparse(70) * 10 + sparse(70000) * 100 + sparse(4000000000) * 1000 + sparse(8));
+
+   sum = 0;
+   for (i = 0; i < 10; i++) {
+      if (i % 3 == 0)
+         continue;
+      if (i == 8)
+         break;
+      sum += i;
+   }
+   PRINT(sum);
+
+   i = 0;
+   sum = 0;
+   while (1) {
+      i++;
+      if (i > 20)
+         break;
+      switch (i % 4) {
+      case 0:
+         continue;
+      case 1:
+         sum += 100;
+         break;
+      default:
+         sum++;
+      }
+      sum += 1000;
+   }
+   PRINT(sum);
+
+   i = 10;
+   do {
+      i--;
+      if (i == 5)
+         continue;
+      if (i == 2)
+         break;
+   } while (i > 0);
+   PRINT(i);
+   do
+      i = 42;
+   while (0);
+   PRINT(i);
+
+   sum = 0;
+   for (i = 0; i < 4; i++)
+      for (j = 0; ; j++) {
+         if (j > i)
+            break;
+         sum += j;
+      }
+   PRINT(sum);
+
+   u = 3000000000;
+   switch (u) {
+   case 3000000000:
+      PRINT(1);
+      break;
+   default:
+      PRINT(0);
+   }
+   switch (i) {
+   default:
+      PRINT(i);
+   }
+   return 0;
+}